@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <GL/glew.h>
+
+#include <GLFW/glfw3.h>
+
+#ifdef USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#ifdef USE_OSMESA
+#include <GL/osmesa.h>
+#endif
+
+#include "context.hpp"
+
+static bool initGLEW() {
+	glewExperimental = true; // Needed for core profile
+	if (glewInit() != GLEW_OK) {
+		fprintf(stderr, "Failed to initialize GLEW\n");
+		return false;
+	}
+	// GLEW can leave a GL_INVALID_ENUM behind on core profiles
+	glGetError();
+	return true;
+}
+
+static bool createWindowContext(RenderContext& ctx, const char* title) {
+	// Initialise GLFW
+	if (!glfwInit())
+	{
+		fprintf(stderr, "Failed to initialize GLFW\n");
+		getchar();
+		return false;
+	}
+
+	glfwWindowHint(GLFW_SAMPLES, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+	// Open a window and create its OpenGL context
+	ctx.window = glfwCreateWindow(ctx.width, ctx.height, title, NULL, NULL);
+	if (ctx.window == NULL) {
+		fprintf(stderr, "Failed to open GLFW window.\n");
+		getchar();
+		glfwTerminate();
+		return false;
+	}
+	glfwMakeContextCurrent(ctx.window);
+
+	if (!initGLEW()) {
+		getchar();
+		glfwTerminate();
+		return false;
+	}
+
+	glfwSwapInterval(0);
+	return true;
+}
+
+#ifdef USE_EGL
+static bool createEGLContext(RenderContext& ctx) {
+	// Prefer the surfaceless platform so no display server or GPU device is needed
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay) {
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+		fprintf(stderr, "Failed to initialize EGL\n");
+		return false;
+	}
+	eglBindAPI(EGL_OPENGL_API);
+
+	// Compute shaders need 4.3; without a window there is no config to pick
+	EGLint attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+	if (context == EGL_NO_CONTEXT) {
+		fprintf(stderr, "Failed to create an EGL 4.3 core context (EGL %d.%d)\n", major, minor);
+		eglTerminate(display);
+		return false;
+	}
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		fprintf(stderr, "EGL implementation does not support surfaceless contexts\n");
+		eglDestroyContext(display, context);
+		eglTerminate(display);
+		return false;
+	}
+
+	ctx.display = display;
+	ctx.context = context;
+	return initGLEW();
+}
+#endif
+
+#ifdef USE_OSMESA
+static bool createOSMesaContext(RenderContext& ctx) {
+	const int attribs[] = {
+		OSMESA_FORMAT, OSMESA_RGBA,
+		OSMESA_DEPTH_BITS, 24,
+		OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+		OSMESA_CONTEXT_MAJOR_VERSION, 4,
+		OSMESA_CONTEXT_MINOR_VERSION, 3,
+		0
+	};
+	OSMesaContext context = OSMesaCreateContextAttribs(attribs, NULL);
+	if (!context) {
+		fprintf(stderr, "Failed to create an OSMesa 4.3 core context\n");
+		return false;
+	}
+
+	// OSMesa needs a buffer to make the context current, even though we draw into FBOs
+	ctx.buffer = (unsigned char*)malloc(ctx.width * ctx.height * 4);
+	if (!OSMesaMakeCurrent(context, ctx.buffer, GL_UNSIGNED_BYTE, ctx.width, ctx.height)) {
+		fprintf(stderr, "Failed to make the OSMesa context current\n");
+		OSMesaDestroyContext(context);
+		free(ctx.buffer);
+		ctx.buffer = NULL;
+		return false;
+	}
+
+	ctx.context = context;
+	return initGLEW();
+}
+#endif
+
+bool createContext(RenderContext& ctx, ContextType type, int width, int height, const char* title) {
+	ctx.type = type;
+	ctx.width = width;
+	ctx.height = height;
+	ctx.window = NULL;
+	ctx.display = NULL;
+	ctx.context = NULL;
+	ctx.buffer = NULL;
+
+	switch (type) {
+	case CONTEXT_WINDOW:
+		return createWindowContext(ctx, title);
+	case CONTEXT_EGL:
+#ifdef USE_EGL
+		return createEGLContext(ctx);
+#else
+		fprintf(stderr, "EGL support not compiled in (build with USE_EGL)\n");
+		return false;
+#endif
+	case CONTEXT_OSMESA:
+#ifdef USE_OSMESA
+		return createOSMesaContext(ctx);
+#else
+		fprintf(stderr, "OSMesa support not compiled in (build with USE_OSMESA)\n");
+		return false;
+#endif
+	}
+	return false;
+}
+
+void destroyContext(RenderContext& ctx) {
+	switch (ctx.type) {
+	case CONTEXT_WINDOW:
+		// Close OpenGL window and terminate GLFW
+		glfwTerminate();
+		break;
+	case CONTEXT_EGL:
+#ifdef USE_EGL
+		if (ctx.context) {
+			eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(ctx.display, ctx.context);
+			eglTerminate(ctx.display);
+		}
+#endif
+		break;
+	case CONTEXT_OSMESA:
+#ifdef USE_OSMESA
+		if (ctx.context) {
+			OSMesaDestroyContext((OSMesaContext)ctx.context);
+		}
+		free(ctx.buffer);
+#endif
+		break;
+	}
+	ctx.window = NULL;
+	ctx.display = NULL;
+	ctx.context = NULL;
+	ctx.buffer = NULL;
+}
+
+void swapContext(RenderContext& ctx) {
+	if (ctx.type == CONTEXT_WINDOW) {
+		glfwSwapBuffers(ctx.window);
+		glfwPollEvents();
+	}
+}
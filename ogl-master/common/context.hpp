@@ -0,0 +1,37 @@
+#ifndef CONTEXT_HPP
+#define CONTEXT_HPP
+
+// Where the Renderer gets its OpenGL context from. The window is the normal
+// interactive mode; the offscreen types have no default framebuffer to show,
+// so everything is drawn into FBOs and read back. They run on machines
+// without a display, e.g. Mesa llvmpipe on render and CI nodes.
+//
+// The offscreen backends are compiled in with USE_EGL (surfaceless EGL,
+// link libEGL) or USE_OSMESA (link libOSMesa).
+enum ContextType {
+	CONTEXT_WINDOW,
+	CONTEXT_EGL,
+	CONTEXT_OSMESA
+};
+
+struct RenderContext {
+	ContextType type;
+	int width;
+	int height;
+
+	GLFWwindow* window;		// CONTEXT_WINDOW only
+
+	void* display;			// EGLDisplay
+	void* context;			// EGLContext or OSMesaContext
+	unsigned char* buffer;	// OSMesa colour buffer
+};
+
+// Creates the context, makes it current and initialises GLEW.
+// Returns false (after printing why) if the type is unavailable or fails.
+bool createContext(RenderContext& ctx, ContextType type, int width, int height, const char* title);
+void destroyContext(RenderContext& ctx);
+
+// Presents the frame; does nothing offscreen
+void swapContext(RenderContext& ctx);
+
+#endif
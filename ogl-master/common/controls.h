@@ -7,6 +7,7 @@ static int WINDOWWIDTH = 640;
 static int WINDOWHEIGHT = 360;
 
 void computeMatricesFromInputs(GLFWwindow* window, bool inMenu);
+void computeMatrices();
 glm::mat4 getViewMatrix();
 glm::mat4 getProjectionMatrix();
 glm::vec3 getCameraPosition();
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "imagewrite.hpp"
+
+static void putU32BE(std::vector<unsigned char>& out, unsigned int v) {
+	out.push_back((v >> 24) & 0xFF);
+	out.push_back((v >> 16) & 0xFF);
+	out.push_back((v >> 8) & 0xFF);
+	out.push_back(v & 0xFF);
+}
+
+static unsigned int crc32(const unsigned char* data, size_t length, unsigned int crc = 0) {
+	static unsigned int table[256];
+	static bool tableReady = false;
+	if (!tableReady) {
+		for (unsigned int n = 0; n < 256; n++) {
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[n] = c;
+		}
+		tableReady = true;
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) {
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// Writes one PNG chunk: length, type, data, CRC of type and data
+static void writeChunk(FILE* file, const char* type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> chunk;
+	putU32BE(chunk, (unsigned int)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	putU32BE(chunk, crc32(&chunk[4], chunk.size() - 4));
+	fwrite(&chunk[0], 1, chunk.size(), file);
+}
+
+bool writePNG(const char* imagepath, int width, int height, int channels, const unsigned char* pixels) {
+	if (channels != 3 && channels != 4) {
+		printf("%s: PNG needs 3 or 4 channels\n", imagepath);
+		return false;
+	}
+
+	FILE* file = fopen(imagepath, "wb");
+	if (!file) {
+		printf("%s could not be opened for writing\n", imagepath);
+		return false;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, 8, file);
+
+	std::vector<unsigned char> header;
+	putU32BE(header, width);
+	putU32BE(header, height);
+	header.push_back(8);						// bit depth
+	header.push_back(channels == 4 ? 6 : 2);	// colour type RGBA / RGB
+	header.push_back(0);						// deflate
+	header.push_back(0);						// adaptive filtering
+	header.push_back(0);						// no interlace
+	writeChunk(file, "IHDR", header);
+
+	// Scanlines with filter type 0
+	size_t rowSize = (size_t)width * channels;
+	std::vector<unsigned char> raw;
+	raw.reserve((rowSize + 1) * height);
+	for (int y = 0; y < height; y++) {
+		raw.push_back(0);
+		raw.insert(raw.end(), pixels + y * rowSize, pixels + (y + 1) * rowSize);
+	}
+
+	// zlib stream made of stored (uncompressed) deflate blocks
+	std::vector<unsigned char> zlib;
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	size_t offset = 0;
+	do {
+		size_t blockSize = raw.size() - offset;
+		if (blockSize > 65535) {
+			blockSize = 65535;
+		}
+		bool last = offset + blockSize == raw.size();
+		zlib.push_back(last ? 1 : 0);
+		zlib.push_back(blockSize & 0xFF);
+		zlib.push_back((blockSize >> 8) & 0xFF);
+		zlib.push_back(~blockSize & 0xFF);
+		zlib.push_back((~blockSize >> 8) & 0xFF);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+		offset += blockSize;
+	} while (offset < raw.size());
+
+	unsigned int a = 1, b = 0;
+	for (size_t i = 0; i < raw.size(); i++) {
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	putU32BE(zlib, (b << 16) | a);
+	writeChunk(file, "IDAT", zlib);
+
+	writeChunk(file, "IEND", std::vector<unsigned char>());
+	fclose(file);
+	return true;
+}
+
+static void putU32LE(std::vector<unsigned char>& out, unsigned int v) {
+	out.push_back(v & 0xFF);
+	out.push_back((v >> 8) & 0xFF);
+	out.push_back((v >> 16) & 0xFF);
+	out.push_back((v >> 24) & 0xFF);
+}
+
+static void putF32LE(std::vector<unsigned char>& out, float f) {
+	unsigned int v;
+	memcpy(&v, &f, 4);
+	putU32LE(out, v);
+}
+
+// Header attribute: name, type, size, value
+static void putAttribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value) {
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	putU32LE(out, (unsigned int)value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+bool writeEXR(const char* imagepath, int width, int height, const float* rgb) {
+	FILE* file = fopen(imagepath, "wb");
+	if (!file) {
+		printf("%s could not be opened for writing\n", imagepath);
+		return false;
+	}
+
+	std::vector<unsigned char> header;
+	putU32LE(header, 20000630);	// magic
+	putU32LE(header, 2);		// version 2, single part scanline
+
+	// Channels are stored in alphabetical order
+	std::vector<unsigned char> channels;
+	const char* names[3] = { "B", "G", "R" };
+	for (int c = 0; c < 3; c++) {
+		channels.push_back(names[c][0]);
+		channels.push_back(0);
+		putU32LE(channels, 2);	// FLOAT
+		putU32LE(channels, 0);	// pLinear and reserved
+		putU32LE(channels, 1);	// x sampling
+		putU32LE(channels, 1);	// y sampling
+	}
+	channels.push_back(0);
+	putAttribute(header, "channels", "chlist", channels);
+
+	putAttribute(header, "compression", "compression", std::vector<unsigned char>(1, 0));
+
+	std::vector<unsigned char> window;
+	putU32LE(window, 0);
+	putU32LE(window, 0);
+	putU32LE(window, width - 1);
+	putU32LE(window, height - 1);
+	putAttribute(header, "dataWindow", "box2i", window);
+	putAttribute(header, "displayWindow", "box2i", window);
+
+	putAttribute(header, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0));
+
+	std::vector<unsigned char> value;
+	putF32LE(value, 1.0f);
+	putAttribute(header, "pixelAspectRatio", "float", value);
+	putAttribute(header, "screenWindowWidth", "float", value);
+
+	value.clear();
+	putF32LE(value, 0.0f);
+	putF32LE(value, 0.0f);
+	putAttribute(header, "screenWindowCenter", "v2f", value);
+	header.push_back(0);
+
+	// Offset table, one chunk per scanline
+	size_t lineBytes = 8 + (size_t)width * 3 * 4;
+	size_t firstLine = header.size() + (size_t)height * 8;
+	for (int y = 0; y < height; y++) {
+		unsigned long long lineOffset = firstLine + y * lineBytes;
+		putU32LE(header, (unsigned int)(lineOffset & 0xFFFFFFFFu));
+		putU32LE(header, (unsigned int)(lineOffset >> 32));
+	}
+	fwrite(&header[0], 1, header.size(), file);
+
+	std::vector<unsigned char> line;
+	for (int y = 0; y < height; y++) {
+		line.clear();
+		putU32LE(line, y);
+		putU32LE(line, width * 3 * 4);
+		for (int c = 2; c >= 0; c--) {
+			for (int x = 0; x < width; x++) {
+				putF32LE(line, rgb[((size_t)y * width + x) * 3 + c]);
+			}
+		}
+		fwrite(&line[0], 1, line.size(), file);
+	}
+
+	fclose(file);
+	return true;
+}
+
+bool writeDDSVolume(const char* imagepath, int width, int height, int depth, const float* rgba, int levels) {
+	FILE* file = fopen(imagepath, "wb");
+	if (!file) {
+		printf("%s could not be opened for writing\n", imagepath);
+		return false;
+	}
+
+	std::vector<unsigned char> header;
+	header.insert(header.end(), "DDS ", "DDS " + 4);
+	putU32LE(header, 124);										// size
+	putU32LE(header, 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x800000);	// caps, height, width, pixel format, mip count, depth
+	putU32LE(header, height);
+	putU32LE(header, width);
+	putU32LE(header, width * 16);								// pitch
+	putU32LE(header, depth);
+	putU32LE(header, levels);									// mip count
+	for (int i = 0; i < 11; i++) {
+		putU32LE(header, 0);									// reserved
+	}
+	putU32LE(header, 32);										// pixel format size
+	putU32LE(header, 0x4);										// DDPF_FOURCC
+	putU32LE(header, 0x30315844);								// "DX10"
+	for (int i = 0; i < 5; i++) {
+		putU32LE(header, 0);									// bit counts and masks
+	}
+	putU32LE(header, 0x1000 | 0x8 | (levels > 1 ? 0x400000 : 0));	// texture, complex, mipmap
+	putU32LE(header, 0x200000);									// DDSCAPS2_VOLUME
+	for (int i = 0; i < 3; i++) {
+		putU32LE(header, 0);
+	}
+	putU32LE(header, 2);										// DXGI_FORMAT_R32G32B32A32_FLOAT
+	putU32LE(header, 4);										// DDS_DIMENSION_TEXTURE3D
+	putU32LE(header, 0);										// misc flags
+	putU32LE(header, 1);										// array size
+	putU32LE(header, 0);										// alpha mode
+	fwrite(&header[0], 1, header.size(), file);
+
+	size_t bytes = 0;
+	for (int level = 0; level < levels; level++) {
+		size_t w = width >> level, h = height >> level, d = depth >> level;
+		bytes += (w ? w : 1) * (h ? h : 1) * (d ? d : 1) * 4 * sizeof(float);
+	}
+	bool written = fwrite(rgba, 1, bytes, file) == bytes;
+	fclose(file);
+	if (!written) {
+		printf("%s: write failed\n", imagepath);
+	}
+	return written;
+}
@@ -0,0 +1,17 @@
+#ifndef IMAGEWRITE_HPP
+#define IMAGEWRITE_HPP
+
+// Rows are stored top to bottom, channels interleaved.
+
+// 8 bit PNG with 3 (RGB) or 4 (RGBA) channels, written uncompressed
+bool writePNG(const char* imagepath, int width, int height, int channels, const unsigned char* pixels);
+
+// 32 bit float RGB OpenEXR, written uncompressed
+bool writeEXR(const char* imagepath, int width, int height, const float* rgb);
+
+// 32 bit float RGBA volume as a DX10 .dds, in the order glGetTexImage returns
+// it (slices, then rows bottom to top) so loadDDS uploads it unchanged. With
+// several mip levels rgba holds each level after the one before.
+bool writeDDSVolume(const char* imagepath, int width, int height, int depth, const float* rgba, int levels = 1);
+
+#endif
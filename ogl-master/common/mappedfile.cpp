@@ -0,0 +1,97 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mappedfile.hpp"
+
+#ifdef _WIN32
+
+bool mapFile(MappedFile& file, const char* path) {
+	file.data = NULL;
+	file.size = 0;
+	file.file = NULL;
+	file.mapping = NULL;
+
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+		CloseHandle(handle);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(handle);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		CloseHandle(mapping);
+		CloseHandle(handle);
+		return false;
+	}
+
+	file.data = (const unsigned char*)data;
+	file.size = (size_t)size.QuadPart;
+	file.file = handle;
+	file.mapping = mapping;
+	return true;
+}
+
+void unmapFile(MappedFile& file) {
+	if (file.data) {
+		UnmapViewOfFile(file.data);
+		CloseHandle((HANDLE)file.mapping);
+		CloseHandle((HANDLE)file.file);
+	}
+	file.data = NULL;
+	file.size = 0;
+	file.file = NULL;
+	file.mapping = NULL;
+}
+
+#else
+
+bool mapFile(MappedFile& file, const char* path) {
+	file.data = NULL;
+	file.size = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+
+	file.data = (const unsigned char*)data;
+	file.size = (size_t)st.st_size;
+	return true;
+}
+
+void unmapFile(MappedFile& file) {
+	if (file.data) {
+		munmap((void*)file.data, file.size);
+	}
+	file.data = NULL;
+	file.size = 0;
+}
+
+#endif
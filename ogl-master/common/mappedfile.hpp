@@ -0,0 +1,25 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file. Texture containers are parsed
+// and uploaded straight from the mapping, without an intermediate copy.
+struct MappedFile {
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#endif
+};
+
+bool mapFile(MappedFile& file, const char* path);
+void unmapFile(MappedFile& file);
+
+// True if [offset, offset + length) lies inside the file
+inline bool fileRangeValid(const MappedFile& file, size_t offset, size_t length) {
+	return offset <= file.size && length <= file.size - offset;
+}
+
+#endif
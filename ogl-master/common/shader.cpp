@@ -5,6 +5,7 @@
 #include <fstream>
 #include <algorithm>
 #include <sstream>
+#include <map>
 using namespace std;
 
 #include <stdlib.h>
@@ -14,7 +15,96 @@ using namespace std;
 
 #include "shader.hpp"
 
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, const char* tessC_file_path, const char* tessE_file_path){
+// Directory part of a shader path, including the trailing separator
+static std::string ShaderDirectory(const std::string& path) {
+	size_t slash = path.find_last_of("/\\");
+	if (slash == std::string::npos) {
+		return "";
+	}
+	return path.substr(0, slash + 1);
+}
+
+// Appends a shader file to code, expanding #include "file" directives relative to the
+// including file. Each file is only included once. #line directives keep the compiler's
+// line numbers pointing at the original files; the source string number is the index in files.
+// defines is inserted after the first #version line and then cleared.
+static bool AppendShaderFile(const std::string& path, std::vector<std::string>& files, std::string& code, const char*& defines) {
+	std::ifstream ShaderStream(path.c_str(), std::ios::in);
+	if (!ShaderStream.is_open()) {
+		return false;
+	}
+
+	int fileIndex = files.size();
+	files.push_back(path);
+
+	std::stringstream sstr;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(ShaderStream, line)) {
+		lineNumber++;
+		size_t start = line.find_first_not_of(" \t");
+
+		if (start != std::string::npos && line.compare(start, 8, "#include") == 0) {
+			size_t open = line.find('"', start);
+			size_t close = (open == std::string::npos) ? open : line.find('"', open + 1);
+			if (close == std::string::npos) {
+				std::printf("Malformed #include in %s line %d\n", path.c_str(), lineNumber);
+				sstr << "\n";
+				continue;
+			}
+
+			std::string includePath = ShaderDirectory(path) + line.substr(open + 1, close - open - 1);
+			if (std::find(files.begin(), files.end(), includePath) == files.end()) {
+				sstr << "#line 1 " << files.size() << "\n";
+				code += sstr.str();
+				sstr.str("");
+				if (!AppendShaderFile(includePath, files, code, defines)) {
+					std::printf("Impossible to open %s, included from %s\n", includePath.c_str(), path.c_str());
+				}
+			}
+			sstr << "#line " << lineNumber + 1 << " " << fileIndex << "\n";
+			continue;
+		}
+
+		sstr << line << "\n";
+		if (defines != NULL && start != std::string::npos && line.compare(start, 8, "#version") == 0) {
+			sstr << defines << "\n";
+			sstr << "#line " << lineNumber + 1 << " " << fileIndex << "\n";
+			defines = NULL;
+		}
+	}
+	code += sstr.str();
+
+	ShaderStream.close();
+	return true;
+}
+
+// Reads a shader with its includes resolved and defines injected.
+// Returns false if the file itself could not be opened.
+static bool ReadShaderFile(const char* file_path, const char* defines, std::string& code, std::vector<std::string>& files) {
+	code.clear();
+	files.clear();
+	if (!AppendShaderFile(file_path, files, code, defines)) {
+		return false;
+	}
+	// No #version line, the defines go first
+	if (defines != NULL) {
+		code = std::string(defines) + "\n#line 1 0\n" + code;
+	}
+	return true;
+}
+
+// Prints which file each source string number in a compile log refers to
+static void PrintShaderFiles(const std::vector<std::string>& files) {
+	if (files.size() < 2) {
+		return;
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		std::printf("  source %d : %s\n", (int)i, files[i].c_str());
+	}
+}
+
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, const char* tessC_file_path, const char* tessE_file_path, const char* defines){
 	bool tess = true;
 
 	if (tessC_file_path == NULL) {
@@ -37,13 +127,8 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 
 	// Read the Vertex Shader code from the file
 	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open()){
-		std::stringstream sstr;
-		sstr << VertexShaderStream.rdbuf();
-		VertexShaderCode = sstr.str();
-		VertexShaderStream.close();
-	}else{
+	std::vector<std::string> VertexShaderFiles;
+	if(!ReadShaderFile(vertex_file_path, defines, VertexShaderCode, VertexShaderFiles)){
 		std::printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", vertex_file_path);
 		getchar();
 		return 0;
@@ -51,33 +136,18 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 
 	// Read the Fragment Shader code from the file
 	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::stringstream sstr;
-		sstr << FragmentShaderStream.rdbuf();
-		FragmentShaderCode = sstr.str();
-		FragmentShaderStream.close();
-	}
+	std::vector<std::string> FragmentShaderFiles;
+	ReadShaderFile(fragment_file_path, defines, FragmentShaderCode, FragmentShaderFiles);
 
 	// Read the Tess Shader code from the file
 	std::string TessCShaderCode;
-	std::ifstream TessCShaderStream(tessC_file_path, std::ios::in);
+	std::vector<std::string> TessCShaderFiles;
 	std::string TessEShaderCode;
-	std::ifstream TessEShaderStream(tessE_file_path, std::ios::in);
+	std::vector<std::string> TessEShaderFiles;
 
 	if (tess) {
-		if (TessCShaderStream.is_open()) {
-			std::stringstream sstr;
-			sstr << TessCShaderStream.rdbuf();
-			TessCShaderCode = sstr.str();
-			TessCShaderStream.close();
-		}
-		if (TessEShaderStream.is_open()) {
-			std::stringstream sstr;
-			sstr << TessEShaderStream.rdbuf();
-			TessEShaderCode = sstr.str();
-			TessEShaderStream.close();
-		}
+		ReadShaderFile(tessC_file_path, defines, TessCShaderCode, TessCShaderFiles);
+		ReadShaderFile(tessE_file_path, defines, TessEShaderCode, TessEShaderFiles);
 	}
 
 
@@ -99,6 +169,7 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 		std::vector<char> VertexShaderErrorMessage(InfoLogLength+1);
 		glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
 		std::printf("%s\n", &VertexShaderErrorMessage[0]);
+		PrintShaderFiles(VertexShaderFiles);
 	}
 
 
@@ -116,6 +187,7 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 		std::vector<char> FragmentShaderErrorMessage(InfoLogLength+1);
 		glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
 		std::printf("%s\n", &FragmentShaderErrorMessage[0]);
+		PrintShaderFiles(FragmentShaderFiles);
 	}
 
 	char const* TessCSourcePointer;
@@ -135,6 +207,7 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 			std::vector<char> TessCShaderErrorMessage(InfoLogLength + 1);
 			glGetShaderInfoLog(TessCShaderID, InfoLogLength, NULL, &TessCShaderErrorMessage[0]);
 			std::printf("%s\n", &TessCShaderErrorMessage[0]);
+			PrintShaderFiles(TessCShaderFiles);
 		}
 
 
@@ -151,6 +224,7 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 			std::vector<char> TessEShaderErrorMessage(InfoLogLength + 1);
 			glGetShaderInfoLog(TessEShaderID, InfoLogLength, NULL, &TessEShaderErrorMessage[0]);
 			std::printf("%s\n", &TessEShaderErrorMessage[0]);
+			PrintShaderFiles(TessEShaderFiles);
 		}
 	}
 
@@ -193,19 +267,13 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	return ProgramID;
 }
 
-GLuint LoadComputeShader(const char* file_path) {
+GLuint LoadComputeShader(const char* file_path, const char* defines) {
 	GLuint ComputeShaderID = glCreateShader(GL_COMPUTE_SHADER);
 
 	// Read the Compute Shader code from the file
 	std::string ComputeShaderCode;
-	std::ifstream ComputeShaderStream(file_path, std::ios::in);
-	if (ComputeShaderStream.is_open()) {
-		std::stringstream sstr;
-		sstr << ComputeShaderStream.rdbuf();
-		ComputeShaderCode = sstr.str();
-		ComputeShaderStream.close();
-	}
-	else {
+	std::vector<std::string> ComputeShaderFiles;
+	if (!ReadShaderFile(file_path, defines, ComputeShaderCode, ComputeShaderFiles)) {
 		std::printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", file_path);
 		getchar();
 		return 0;
@@ -228,6 +296,7 @@ GLuint LoadComputeShader(const char* file_path) {
 		std::vector<char> ComputeShaderErrorMessage(InfoLogLength + 1);
 		glGetShaderInfoLog(ComputeShaderID, InfoLogLength, NULL, &ComputeShaderErrorMessage[0]);
 		std::printf("%s\n", &ComputeShaderErrorMessage[0]);
+		PrintShaderFiles(ComputeShaderFiles);
 	}
 
 	// Link the program
@@ -251,3 +320,37 @@ GLuint LoadComputeShader(const char* file_path) {
 
 	return ProgramID;
 }
+
+// Programs compiled by the permutation loaders, keyed by source paths and defines
+static std::map<std::string, GLuint> ShaderPermutations;
+
+GLuint LoadShaderPermutation(const char* vertex_file_path, const char* fragment_file_path, const char* defines) {
+	std::string key = std::string(vertex_file_path) + "|" + fragment_file_path + "|" + defines;
+	std::map<std::string, GLuint>::iterator cached = ShaderPermutations.find(key);
+	if (cached != ShaderPermutations.end()) {
+		return cached->second;
+	}
+
+	GLuint ProgramID = LoadShaders(vertex_file_path, fragment_file_path, NULL, NULL, defines);
+	ShaderPermutations[key] = ProgramID;
+	return ProgramID;
+}
+
+GLuint LoadComputePermutation(const char* file_path, const char* defines) {
+	std::string key = std::string(file_path) + "|" + defines;
+	std::map<std::string, GLuint>::iterator cached = ShaderPermutations.find(key);
+	if (cached != ShaderPermutations.end()) {
+		return cached->second;
+	}
+
+	GLuint ProgramID = LoadComputeShader(file_path, defines);
+	ShaderPermutations[key] = ProgramID;
+	return ProgramID;
+}
+
+void DeleteShaderPermutations() {
+	for (std::map<std::string, GLuint>::iterator it = ShaderPermutations.begin(); it != ShaderPermutations.end(); ++it) {
+		glDeleteProgram(it->second);
+	}
+	ShaderPermutations.clear();
+}
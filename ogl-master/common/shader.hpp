@@ -1,7 +1,16 @@
 #ifndef SHADER_HPP
 #define SHADER_HPP
 
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, const char* tessC_file_path = NULL, const char* tessE_file_path = NULL );
-GLuint LoadComputeShader(const char* file_path);
+// Shader sources may use #include "file" (relative to the including file).
+// defines is inserted verbatim after the #version line of every stage,
+// e.g. "#define TILE_SIZE_X 8\n#define TILE_SIZE_Y 4"
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, const char* tessC_file_path = NULL, const char* tessE_file_path = NULL, const char* defines = NULL );
+GLuint LoadComputeShader(const char* file_path, const char* defines = NULL);
+
+// Cached variants: each distinct set of defines is compiled once and the same
+// program is returned on later calls. DeleteShaderPermutations frees them all.
+GLuint LoadShaderPermutation(const char* vertex_file_path, const char* fragment_file_path, const char* defines);
+GLuint LoadComputePermutation(const char* file_path, const char* defines);
+void DeleteShaderPermutations();
 
 #endif
@@ -2,6 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 #include <GL/glew.h>
 
 #include <GLFW/glfw3.h>
@@ -9,6 +17,8 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <common/stb_image.h>
 
+#include <common/mappedfile.hpp>
+
 
 GLuint loadBMP_custom(const char * imagepath){
 
@@ -161,99 +171,655 @@ GLuint loadImage(const char* imagepath) {
 
 
 
+// Block compressed and raw formats the DDS and KTX2 loaders upload as stored
+struct TextureFormat {
+	unsigned int dxgi;			// DXGI_FORMAT, for DDS files with a DX10 header
+	unsigned int vk;			// VkFormat, for KTX2
+	GLenum internalFormat;
+	GLenum format;				// 0 for block compressed formats
+	GLenum type;
+	unsigned int blockBytes;	// bytes per 4x4 block, or per pixel when format is set
+};
+
+static const TextureFormat textureFormats[] = {
+	{ 71, 133, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 0, 0, 8 },				// BC1
+	{ 72, 134, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT, 0, 0, 8 },
+	{ 74, 135, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, 0, 0, 16 },			// BC2
+	{ 75, 136, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT, 0, 0, 16 },
+	{ 77, 137, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 0, 0, 16 },			// BC3
+	{ 78, 138, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, 0, 0, 16 },
+	{ 80, 139, GL_COMPRESSED_RED_RGTC1, 0, 0, 8 },						// BC4
+	{ 81, 140, GL_COMPRESSED_SIGNED_RED_RGTC1, 0, 0, 8 },
+	{ 83, 141, GL_COMPRESSED_RG_RGTC2, 0, 0, 16 },						// BC5
+	{ 84, 142, GL_COMPRESSED_SIGNED_RG_RGTC2, 0, 0, 16 },
+	{ 95, 143, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, 0, 0, 16 },		// BC6H
+	{ 96, 144, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, 0, 0, 16 },
+	{ 98, 145, GL_COMPRESSED_RGBA_BPTC_UNORM, 0, 0, 16 },				// BC7
+	{ 99, 146, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, 0, 0, 16 },
+	{ 61, 9, GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1 },
+	{ 49, 16, GL_RG8, GL_RG, GL_UNSIGNED_BYTE, 2 },
+	{ 28, 37, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 },
+	{ 29, 43, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 },
+	{ 54, 76, GL_R16F, GL_RED, GL_HALF_FLOAT, 2 },
+	{ 10, 97, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, 8 },
+	{ 41, 100, GL_R32F, GL_RED, GL_FLOAT, 4 },
+	{ 2, 109, GL_RGBA32F, GL_RGBA, GL_FLOAT, 16 },
+};
+
+static const TextureFormat* findDXGIFormat(unsigned int dxgi) {
+	for (unsigned int i = 0; i < sizeof(textureFormats) / sizeof(textureFormats[0]); i++) {
+		if (textureFormats[i].dxgi == dxgi) return &textureFormats[i];
+	}
+	return NULL;
+}
+
+static const TextureFormat* findVkFormat(unsigned int vk) {
+	for (unsigned int i = 0; i < sizeof(textureFormats) / sizeof(textureFormats[0]); i++) {
+		if (textureFormats[i].vk == vk) return &textureFormats[i];
+	}
+	return NULL;
+}
+
+// Shape of the image stored in a container file
+struct TextureLayout {
+	GLenum target;				// GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY or GL_TEXTURE_3D
+	const TextureFormat* format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;			// 1 unless target is GL_TEXTURE_3D
+	unsigned int layers;		// 1 unless target is GL_TEXTURE_2D_ARRAY
+	unsigned int levels;
+};
+
+static unsigned int mipSize(unsigned int size, unsigned int level) {
+	size >>= level;
+	return size ? size : 1;
+}
+
+// Bytes in one layer of one mip level (all slices of a volume)
+static size_t levelBytes(const TextureLayout& layout, unsigned int level) {
+	size_t width = mipSize(layout.width, level);
+	size_t height = mipSize(layout.height, level);
+	size_t depth = mipSize(layout.depth, level);
+	if (layout.format->format == 0) {
+		return ((width + 3) / 4) * ((height + 3) / 4) * depth * layout.format->blockBytes;
+	}
+	return width * height * depth * layout.format->blockBytes;
+}
+
+static bool layoutValid(const TextureLayout& layout, const char* imagepath) {
+	if (!layout.format) {
+		printf("%s: unsupported pixel format\n", imagepath);
+		return false;
+	}
+	if (layout.width == 0 || layout.height == 0 || layout.depth == 0 || layout.layers == 0 ||
+		layout.width > 16384 || layout.height > 16384 || layout.depth > 2048 || layout.layers > 2048) {
+		printf("%s: bad dimensions %ux%ux%u, %u layers\n", imagepath, layout.width, layout.height, layout.depth, layout.layers);
+		return false;
+	}
+	unsigned int largest = layout.width > layout.height ? layout.width : layout.height;
+	largest = layout.depth > largest ? layout.depth : largest;
+	unsigned int fullChain = 1;
+	while (largest >>= 1) fullChain++;
+	if (layout.levels == 0 || layout.levels > fullChain) {
+		printf("%s: bad mip count %u\n", imagepath, layout.levels);
+		return false;
+	}
+	return true;
+}
+
+// Allocates immutable storage for the whole layout and sets the sampling state
+static GLuint createTextureStorage(const TextureLayout& layout) {
+	GLuint textureID;
+	glGenTextures(1, &textureID);
+	glBindTexture(layout.target, textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	if (layout.target == GL_TEXTURE_2D) {
+		glTexStorage2D(GL_TEXTURE_2D, layout.levels, layout.format->internalFormat, layout.width, layout.height);
+	}
+	else {
+		glTexStorage3D(layout.target, layout.levels, layout.format->internalFormat, layout.width, layout.height,
+			layout.target == GL_TEXTURE_3D ? layout.depth : layout.layers);
+	}
+
+	glTexParameteri(layout.target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(layout.target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(layout.target, GL_TEXTURE_WRAP_R, GL_REPEAT);
+	glTexParameteri(layout.target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(layout.target, GL_TEXTURE_MIN_FILTER, layout.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	return textureID;
+}
+
+// Uploads layerCount consecutive layers of one mip level starting at firstLayer
+static void uploadLevel(const TextureLayout& layout, unsigned int level, unsigned int firstLayer, unsigned int layerCount,
+	const unsigned char* data) {
+	GLsizei width = mipSize(layout.width, level);
+	GLsizei height = mipSize(layout.height, level);
+	GLsizei size = (GLsizei)(levelBytes(layout, level) * layerCount);
+	const TextureFormat* format = layout.format;
+
+	if (layout.target == GL_TEXTURE_2D) {
+		if (format->format == 0) {
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, format->internalFormat, size, data);
+		}
+		else {
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, format->format, format->type, data);
+		}
+		return;
+	}
+
+	GLint zoffset = layout.target == GL_TEXTURE_3D ? 0 : firstLayer;
+	GLsizei depth = layout.target == GL_TEXTURE_3D ? mipSize(layout.depth, level) : layerCount;
+	if (format->format == 0) {
+		glCompressedTexSubImage3D(layout.target, level, 0, 0, zoffset, width, height, depth, format->internalFormat, size, data);
+	}
+	else {
+		glTexSubImage3D(layout.target, level, 0, 0, zoffset, width, height, depth, format->format, format->type, data);
+	}
+}
+
+static unsigned int readU32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long readU64(const unsigned char* p) {
+	return readU32(p) | ((unsigned long long)readU32(p + 4) << 32);
+}
+
 #define FOURCC_DXT1 0x31545844 // Equivalent to "DXT1" in ASCII
 #define FOURCC_DXT3 0x33545844 // Equivalent to "DXT3" in ASCII
 #define FOURCC_DXT5 0x35545844 // Equivalent to "DXT5" in ASCII
+#define FOURCC_ATI1 0x31495441 // Equivalent to "ATI1" in ASCII, BC4 (one channel)
+#define FOURCC_ATI2 0x32495441 // Equivalent to "ATI2" in ASCII, BC5 (two channels)
+#define FOURCC_BC4U 0x55344342 // Equivalent to "BC4U" in ASCII
+#define FOURCC_BC4S 0x53344342 // Equivalent to "BC4S" in ASCII
+#define FOURCC_BC5U 0x55354342 // Equivalent to "BC5U" in ASCII
+#define FOURCC_BC5S 0x53354342 // Equivalent to "BC5S" in ASCII
+#define FOURCC_DX10 0x30315844 // Equivalent to "DX10" in ASCII, extended header follows
+#define FOURCC_RGBA16F 113     // D3DFMT_A16B16G16R16F
+#define FOURCC_RGBA32F 116     // D3DFMT_A32B32G32R32F
+
+#define DDPF_FOURCC 0x4
+#define DDPF_RGB 0x40
+#define DDSCAPS2_CUBEMAP 0x200
+#define DDSCAPS2_VOLUME 0x200000
+#define DDS_DIMENSION_TEXTURE3D 4
+#define DDS_MISC_TEXTURECUBE 0x4
+
+// DXGI format for a header without the DX10 extension, 0 if unknown
+static unsigned int legacyDDSFormat(const unsigned char* header) {
+	unsigned int pfFlags = readU32(header + 76);
+	unsigned int fourCC = readU32(header + 80);
+	if (pfFlags & DDPF_FOURCC) {
+		switch (fourCC) {
+		case FOURCC_DXT1: return 71;
+		case FOURCC_DXT3: return 74;
+		case FOURCC_DXT5: return 77;
+		case FOURCC_ATI1: case FOURCC_BC4U: return 80;
+		case FOURCC_BC4S: return 81;
+		case FOURCC_ATI2: case FOURCC_BC5U: return 83;
+		case FOURCC_BC5S: return 84;
+		case FOURCC_RGBA16F: return 10;
+		case FOURCC_RGBA32F: return 2;
+		}
+		return 0;
+	}
+	// Plain RGBA8 in R, G, B, A byte order
+	if ((pfFlags & DDPF_RGB) && readU32(header + 84) == 32 && readU32(header + 88) == 0x000000FF &&
+		readU32(header + 92) == 0x0000FF00 && readU32(header + 96) == 0x00FF0000) {
+		return 28;
+	}
+	return 0;
+}
 
-GLuint loadDDS(const char * imagepath){
-
-	unsigned char header[124];
+GLuint loadDDS(const char * imagepath, GLenum* target){
 
-	FILE *fp; 
- 
-	/* try to open the file */ 
-	fp = fopen(imagepath, "rb"); 
-	if (fp == NULL){
-		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); getchar(); 
+	MappedFile file;
+	if (!mapFile(file, imagepath)) {
+		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath);
 		return 0;
 	}
-   
+
 	/* verify the type of file */ 
-	char filecode[4]; 
-	fread(filecode, 1, 4, fp); 
-	if (strncmp(filecode, "DDS ", 4) != 0) { 
-		fclose(fp); 
-		return 0; 
+	if (!fileRangeValid(file, 0, 128) || memcmp(file.data, "DDS ", 4) != 0 || readU32(file.data + 4) != 124) {
+		printf("%s is not a DDS file\n", imagepath);
+		unmapFile(file);
+		return 0;
 	}
-	
+
 	/* get the surface desc */ 
-	fread(&header, 124, 1, fp); 
-
-	unsigned int height      = *(unsigned int*)&(header[8 ]);
-	unsigned int width	     = *(unsigned int*)&(header[12]);
-	unsigned int linearSize	 = *(unsigned int*)&(header[16]);
-	unsigned int mipMapCount = *(unsigned int*)&(header[24]);
-	unsigned int fourCC      = *(unsigned int*)&(header[80]);
-
- 
-	unsigned char * buffer;
-	unsigned int bufsize;
-	/* how big is it going to be including all mipmaps? */ 
-	bufsize = mipMapCount > 1 ? linearSize * 2 : linearSize; 
-	buffer = (unsigned char*)malloc(bufsize * sizeof(unsigned char)); 
-	fread(buffer, 1, bufsize, fp); 
-	/* close the file pointer */ 
-	fclose(fp);
-
-	unsigned int components  = (fourCC == FOURCC_DXT1) ? 3 : 4; 
-	unsigned int format;
-	switch(fourCC) 
-	{ 
-	case FOURCC_DXT1: 
-		format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; 
-		break; 
-	case FOURCC_DXT3: 
-		format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; 
-		break; 
-	case FOURCC_DXT5: 
-		format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; 
-		break; 
-	default: 
-		free(buffer); 
-		return 0; 
+	const unsigned char* header = file.data + 4;
+	unsigned int caps2 = readU32(header + 108);
+	size_t offset = 128;
+
+	TextureLayout layout;
+	layout.target = GL_TEXTURE_2D;
+	layout.height = readU32(header + 8);
+	layout.width = readU32(header + 12);
+	layout.depth = 1;
+	layout.layers = 1;
+	// Some writers leave the count at 0 when there are no mipmaps
+	layout.levels = readU32(header + 24) ? readU32(header + 24) : 1;
+
+	bool cubemap = (caps2 & DDSCAPS2_CUBEMAP) != 0;
+	if (readU32(header + 80) == FOURCC_DX10 && (readU32(header + 76) & DDPF_FOURCC)) {
+		if (!fileRangeValid(file, offset, 20)) {
+			printf("%s: truncated DX10 header\n", imagepath);
+			unmapFile(file);
+			return 0;
+		}
+		const unsigned char* dx10 = file.data + offset;
+		offset += 20;
+		layout.format = findDXGIFormat(readU32(dx10));
+		cubemap = cubemap || (readU32(dx10 + 8) & DDS_MISC_TEXTURECUBE) != 0;
+		if (readU32(dx10 + 4) == DDS_DIMENSION_TEXTURE3D) {
+			layout.target = GL_TEXTURE_3D;
+			layout.depth = readU32(header + 20);
+		}
+		else if (readU32(dx10 + 12) > 1) {
+			layout.target = GL_TEXTURE_2D_ARRAY;
+			layout.layers = readU32(dx10 + 12);
+		}
+	}
+	else {
+		layout.format = findDXGIFormat(legacyDDSFormat(header));
+		if (caps2 & DDSCAPS2_VOLUME) {
+			layout.target = GL_TEXTURE_3D;
+			layout.depth = readU32(header + 20);
+		}
 	}
 
-	// Create one OpenGL texture
+	if (cubemap) {
+		printf("%s: cube maps are not supported\n", imagepath);
+		unmapFile(file);
+		return 0;
+	}
+	if (!layoutValid(layout, imagepath)) {
+		unmapFile(file);
+		return 0;
+	}
+
+	/* DDS stores each layer with its full mip chain, one after another */ 
+	size_t layerBytes = 0;
+	for (unsigned int level = 0; level < layout.levels; level++) {
+		layerBytes += levelBytes(layout, level);
+	}
+	if (!fileRangeValid(file, offset, layerBytes * layout.layers)) {
+		printf("%s: truncated, %u bytes of image data expected\n", imagepath, (unsigned int)(layerBytes * layout.layers));
+		unmapFile(file);
+		return 0;
+	}
+
+	GLuint textureID = createTextureStorage(layout);
+	for (unsigned int layer = 0; layer < layout.layers; layer++) {
+		for (unsigned int level = 0; level < layout.levels; level++) {
+			uploadLevel(layout, level, layer, 1, file.data + offset);
+			offset += levelBytes(layout, level);
+		}
+	}
+
+	unmapFile(file);
+
+	if (target) *target = layout.target;
+	return textureID;
+}
+
+GLuint loadKTX2(const char* imagepath, GLenum* target) {
+
+	MappedFile file;
+	if (!mapFile(file, imagepath)) {
+		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath);
+		return 0;
+	}
+
+	static const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+	if (!fileRangeValid(file, 0, 80) || memcmp(file.data, identifier, 12) != 0) {
+		printf("%s is not a KTX2 file\n", imagepath);
+		unmapFile(file);
+		return 0;
+	}
+
+	const unsigned char* header = file.data + 12;
+	unsigned int vkFormat = readU32(header);
+	unsigned int faceCount = readU32(header + 24);
+	unsigned int supercompression = readU32(header + 32);
+
+	TextureLayout layout;
+	layout.format = findVkFormat(vkFormat);
+	layout.width = readU32(header + 8);
+	layout.height = readU32(header + 12) ? readU32(header + 12) : 1;
+	layout.depth = readU32(header + 16) ? readU32(header + 16) : 1;
+	layout.layers = readU32(header + 20) ? readU32(header + 20) : 1;
+	// 0 asks the loader to generate mipmaps, which compressed formats can't do
+	layout.levels = readU32(header + 28) ? readU32(header + 28) : 1;
+	layout.target = layout.depth > 1 ? GL_TEXTURE_3D : (readU32(header + 20) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D);
+
+	if (supercompression != 0 || faceCount != 1 || (layout.depth > 1 && layout.layers > 1)) {
+		printf("%s: supercompressed, cube map and 3D array KTX2 files are not supported\n", imagepath);
+		unmapFile(file);
+		return 0;
+	}
+	if (!layoutValid(layout, imagepath) || !fileRangeValid(file, 80, (size_t)layout.levels * 24)) {
+		unmapFile(file);
+		return 0;
+	}
+
+	/* each level holds all of its layers; the level index gives where */ 
+	const unsigned char* levelIndex = file.data + 80;
+	for (unsigned int level = 0; level < layout.levels; level++) {
+		unsigned long long levelOffset = readU64(levelIndex + level * 24);
+		unsigned long long levelLength = readU64(levelIndex + level * 24 + 8);
+		if (levelLength != levelBytes(layout, level) * layout.layers || !fileRangeValid(file, (size_t)levelOffset, (size_t)levelLength)) {
+			printf("%s: level %u is truncated or has the wrong size\n", imagepath, level);
+			unmapFile(file);
+			return 0;
+		}
+	}
+
+	GLuint textureID = createTextureStorage(layout);
+	for (unsigned int level = 0; level < layout.levels; level++) {
+		uploadLevel(layout, level, 0, layout.layers, file.data + readU64(levelIndex + level * 24));
+	}
+
+	unmapFile(file);
+
+	if (target) *target = layout.target;
+	return textureID;
+}
+
+
+
+// Asynchronous loading. Worker threads decode with stb_image; the render
+// thread copies the pixels into a persistently mapped staging buffer and
+// uploads from it, so the driver never copies from client memory.
+
+struct DecodeJob {
+	std::string path;
+	GLuint texture;
+};
+
+struct DecodedImage {
+	std::string path;
+	GLuint texture;
+	int width;
+	int height;
+	unsigned char* data;
+};
+
+struct TextureUpload {
+	GLuint texture;
+	GLsync fence;
+};
+
+static std::mutex loaderMutex;
+static std::condition_variable loaderWake;		// jobs queued or stopping
+static std::condition_variable loaderDecoded;	// an image finished decoding
+static std::deque<DecodeJob> decodeJobs;
+static std::deque<DecodedImage> decodedImages;
+static std::vector<std::thread> loaderThreads;
+static int decodesPending = 0;
+static bool loaderStopping = false;
+
+// Render thread only
+static std::set<GLuint> loadingTextures;
+static std::set<GLuint> failedTextures;
+static std::vector<TextureUpload> pendingUploads;
+
+static GLuint stagingBuffer = 0;
+static unsigned char* stagingMap = NULL;
+static size_t stagingSize = 0;
+static size_t stagingHead = 0;
+
+static void textureLoaderThread() {
+	while (true) {
+		DecodeJob job;
+		{
+			std::unique_lock<std::mutex> lock(loaderMutex);
+			loaderWake.wait(lock, [] { return loaderStopping || !decodeJobs.empty(); });
+			if (decodeJobs.empty()) {
+				return;
+			}
+			job = decodeJobs.front();
+			decodeJobs.pop_front();
+		}
+
+		DecodedImage image;
+		image.path = job.path;
+		image.texture = job.texture;
+		int channels;
+		image.data = stbi_load(job.path.c_str(), &image.width, &image.height, &channels, 4);
+
+		{
+			std::lock_guard<std::mutex> lock(loaderMutex);
+			decodedImages.push_back(image);
+			decodesPending--;
+		}
+		loaderDecoded.notify_all();
+	}
+}
+
+GLuint loadImageAsync(const char* imagepath) {
+
+	printf("Reading image %s (async)\n", imagepath);
+
+	// The flip setting is global in stb_image, set it before any worker runs
+	stbi_set_flip_vertically_on_load(true);
+
 	GLuint textureID;
 	glGenTextures(1, &textureID);
+	loadingTextures.insert(textureID);
+
+	{
+		std::lock_guard<std::mutex> lock(loaderMutex);
+		if (loaderThreads.empty()) {
+			loaderStopping = false;
+			unsigned int threads = std::thread::hardware_concurrency();
+			threads = threads < 2 ? 1 : (threads > 4 ? 4 : threads);
+			for (unsigned int i = 0; i < threads; i++) {
+				loaderThreads.push_back(std::thread(textureLoaderThread));
+			}
+		}
+
+		DecodeJob job;
+		job.path = imagepath;
+		job.texture = textureID;
+		decodeJobs.push_back(job);
+		decodesPending++;
+	}
+	loaderWake.notify_one();
 
-	// "Bind" the newly created texture : all future texture functions will modify this texture
-	glBindTexture(GL_TEXTURE_2D, textureID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT,1);	
-	
-	unsigned int blockSize = (format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16; 
-	unsigned int offset = 0;
+	return textureID;
+}
+
+static void waitForUploads() {
+	for (size_t i = 0; i < pendingUploads.size(); i++) {
+		glClientWaitSync(pendingUploads[i].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(pendingUploads[i].fence);
+		loadingTextures.erase(pendingUploads[i].texture);
+	}
+	pendingUploads.clear();
+}
+
+// Reserves size bytes of the staging buffer. Space is reused once the
+// uploads reading it have finished, which only stalls when the buffer wraps.
+static size_t allocStaging(size_t size) {
+	if (size > stagingSize) {
+		waitForUploads();
+		if (stagingBuffer) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+			if (stagingMap) {
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			glDeleteBuffers(1, &stagingBuffer);
+		}
+		stagingSize = size > 16 * 1024 * 1024 ? size : 16 * 1024 * 1024;
+		stagingMap = NULL;
+
+		glGenBuffers(1, &stagingBuffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+		if (GLEW_ARB_buffer_storage) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, stagingSize, NULL, flags);
+			stagingMap = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, stagingSize, flags);
+		}
+		else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, stagingSize, NULL, GL_STREAM_DRAW);
+		}
+		stagingHead = 0;
+	}
+	if (stagingHead + size > stagingSize) {
+		waitForUploads();
+		stagingHead = 0;
+	}
 
-	/* load the mipmaps */ 
-	for (unsigned int level = 0; level < mipMapCount && (width || height); ++level) 
-	{ 
-		unsigned int size = ((width+3)/4)*((height+3)/4)*blockSize; 
-		glCompressedTexImage2D(GL_TEXTURE_2D, level, format, width, height,  
-			0, size, buffer + offset); 
-	 
-		offset += size; 
-		width  /= 2; 
-		height /= 2; 
+	size_t offset = stagingHead;
+	stagingHead += (size + 255) & ~(size_t)255;
+	return offset;
+}
 
-		// Deal with Non-Power-Of-Two textures. This code is not included in the webpage to reduce clutter.
-		if(width < 1) width = 1;
-		if(height < 1) height = 1;
+static void uploadImage(DecodedImage& image) {
+	if (!image.data) {
+		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", image.path.c_str());
+		loadingTextures.erase(image.texture);
+		failedTextures.insert(image.texture);
+		return;
+	}
 
-	} 
+	size_t size = (size_t)image.width * image.height * 4;
+	size_t offset = allocStaging(size);
 
-	free(buffer); 
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+	if (stagingMap) {
+		memcpy(stagingMap + offset, image.data, size);
+	}
+	else {
+		// Without ARB_buffer_storage, map just this range; it is not in use by the GPU
+		void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!mapped) {
+			printf("%s: staging buffer could not be mapped\n", image.path.c_str());
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			stbi_image_free(image.data);
+			image.data = NULL;
+			loadingTextures.erase(image.texture);
+			failedTextures.insert(image.texture);
+			return;
+		}
+		memcpy(mapped, image.data, size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+	stbi_image_free(image.data);
+	image.data = NULL;
 
-	return textureID;
+	// Same texture setup as loadImage, sourced from the staging buffer
+	glBindTexture(GL_TEXTURE_2D, image.texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)offset);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glGenerateMipmap(GL_TEXTURE_2D);
 
+	TextureUpload upload;
+	upload.texture = image.texture;
+	upload.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	pendingUploads.push_back(upload);
+}
 
-}
\ No newline at end of file
+void updateTextureLoads() {
+	std::deque<DecodedImage> decoded;
+	{
+		std::lock_guard<std::mutex> lock(loaderMutex);
+		decoded.swap(decodedImages);
+	}
+	for (size_t i = 0; i < decoded.size(); i++) {
+		uploadImage(decoded[i]);
+	}
+
+	// Retire finished uploads without blocking
+	for (size_t i = 0; i < pendingUploads.size(); ) {
+		GLenum status = glClientWaitSync(pendingUploads[i].fence, 0, 0);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+			glDeleteSync(pendingUploads[i].fence);
+			loadingTextures.erase(pendingUploads[i].texture);
+			pendingUploads.erase(pendingUploads.begin() + i);
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+// 0 is what the synchronous loaders return when they fail
+bool isTextureReady(GLuint texture) {
+	return texture != 0 && loadingTextures.count(texture) == 0 && failedTextures.count(texture) == 0;
+}
+
+bool isTextureFailed(GLuint texture) {
+	return texture == 0 || failedTextures.count(texture) != 0;
+}
+
+bool readTextureRed(GLuint textureID, std::vector<float>& texels, int* width, int* height) {
+	GLint w = 0, h = 0;
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &w);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &h);
+	if (w <= 0 || h <= 0) {
+		return false;
+	}
+	texels.resize((size_t)w * h);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, &texels[0]);
+	*width = w;
+	*height = h;
+	return true;
+}
+
+void finishTextureLoads() {
+	while (true) {
+		std::deque<DecodedImage> decoded;
+		{
+			std::unique_lock<std::mutex> lock(loaderMutex);
+			loaderDecoded.wait(lock, [] { return decodesPending == 0 || !decodedImages.empty(); });
+			decoded.swap(decodedImages);
+			if (decoded.empty() && decodesPending == 0) {
+				break;
+			}
+		}
+		for (size_t i = 0; i < decoded.size(); i++) {
+			uploadImage(decoded[i]);
+		}
+	}
+	waitForUploads();
+}
+
+void shutdownTextureLoader() {
+	finishTextureLoads();
+
+	{
+		std::lock_guard<std::mutex> lock(loaderMutex);
+		loaderStopping = true;
+	}
+	loaderWake.notify_all();
+	for (size_t i = 0; i < loaderThreads.size(); i++) {
+		loaderThreads[i].join();
+	}
+	loaderThreads.clear();
+
+	if (stagingBuffer) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+		if (stagingMap) {
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &stagingBuffer);
+		stagingBuffer = 0;
+		stagingMap = NULL;
+		stagingSize = 0;
+	}
+}
@@ -1,18 +1,43 @@
 #ifndef TEXTURE_HPP
 #define TEXTURE_HPP
 
+#include <vector>
+
 // Load a .BMP file using our custom loader
 GLuint loadBMP_custom(const char * imagepath);
 
 GLuint loadImage(const char* imagepath);
 
+// Same as loadImage, but decoded on a worker thread and uploaded later by
+// updateTextureLoads through a mapped staging buffer. The returned texture
+// can be bound straight away; it has no contents until isTextureReady, and
+// never gets any if isTextureFailed.
+GLuint loadImageAsync(const char* imagepath);
+// Uploads finished decodes and retires uploads whose fence has signalled.
+// Call once per frame on the render thread.
+void updateTextureLoads();
+bool isTextureReady(GLuint texture);
+// The image could not be decoded or uploaded
+bool isTextureFailed(GLuint texture);
+// Blocks until every texture requested so far is ready
+void finishTextureLoads();
+// Finishes outstanding loads and stops the worker threads
+void shutdownTextureLoader();
+// Reads level 0 of a 2D texture back as floats from its red channel, rows
+// in texture order (T = 0 first). False if the texture has no contents yet.
+bool readTextureRed(GLuint textureID, std::vector<float>& texels, int* width, int* height);
+
 //// Since GLFW 3, glfwLoadTexture2D() has been removed. You have to use another texture loading library, 
 //// or do it yourself (just like loadBMP_custom and loadDDS)
 //// Load a .TGA file using GLFW's own loader
 //GLuint loadTGA_glfw(const char * imagepath);
 
-// Load a .DDS file using GLFW's own loader
-GLuint loadDDS(const char * imagepath);
+// Load a .DDS file: BC1-BC7 or raw 8/16/32-bit formats, legacy or DX10 header,
+// 2D, 2D array or 3D. The data is uploaded as stored, including its mip chain.
+// target, if given, receives the GL target the texture was created for.
+GLuint loadDDS(const char * imagepath, GLenum* target = NULL);
+// Same for a .KTX2 file without supercompression
+GLuint loadKTX2(const char* imagepath, GLenum* target = NULL);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <common/stb_image.h>
+
+#include "texturecompress.hpp"
+
+#define FOURCC_ATI1 0x31495441 // Equivalent to "ATI1" in ASCII, BC4
+
+// Palette of a BC4 block as the GPU decodes it
+static void bc4Palette(int e0, int e1, float palette[8]) {
+	palette[0] = (float)e0;
+	palette[1] = (float)e1;
+	if (e0 > e1) {
+		for (int i = 1; i <= 6; i++) {
+			palette[i + 1] = ((7 - i) * e0 + i * e1) / 7.0f;
+		}
+	}
+	else {
+		for (int i = 1; i <= 4; i++) {
+			palette[i + 1] = ((5 - i) * e0 + i * e1) / 5.0f;
+		}
+		palette[6] = 0.0f;
+		palette[7] = 255.0f;
+	}
+}
+
+// Picks the nearest palette entry for each value, returns the squared error
+static float bc4Fit(const float values[16], int e0, int e1, unsigned char indices[16]) {
+	float palette[8];
+	bc4Palette(e0, e1, palette);
+
+	float error = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		float best = 1e30f;
+		for (int p = 0; p < 8; p++) {
+			float d = values[i] - palette[p];
+			if (d * d < best) {
+				best = d * d;
+				indices[i] = p;
+			}
+		}
+		error += best;
+	}
+	return error;
+}
+
+static int clampByte(float v) {
+	int i = (int)(v + 0.5f);
+	return i < 0 ? 0 : (i > 255 ? 255 : i);
+}
+
+// Encodes 16 values in [0,255] into an 8 byte BC4 block
+static void encodeBC4Block(const float values[16], unsigned char* block) {
+	float lo = 255.0f, hi = 0.0f;
+	float lo6 = 255.0f, hi6 = 0.0f;
+	for (int i = 0; i < 16; i++) {
+		lo = values[i] < lo ? values[i] : lo;
+		hi = values[i] > hi ? values[i] : hi;
+		// Six-value mode has exact 0 and 255, its endpoints only need to cover the rest
+		if (values[i] > 0.5f && values[i] < 254.5f) {
+			lo6 = values[i] < lo6 ? values[i] : lo6;
+			hi6 = values[i] > hi6 ? values[i] : hi6;
+		}
+	}
+
+	int bestE0 = clampByte(hi), bestE1 = clampByte(lo);
+	unsigned char bestIndices[16];
+	float bestError = bc4Fit(values, bestE0, bestE1, bestIndices);
+
+	// Eight-value mode (e0 > e1). The best endpoints are often just inside the extremes.
+	unsigned char indices[16];
+	for (int d0 = -2; d0 <= 2; d0++) {
+		for (int d1 = -2; d1 <= 2; d1++) {
+			int e0 = clampByte(hi) + d0;
+			int e1 = clampByte(lo) + d1;
+			if (e0 > 255 || e1 < 0 || e0 <= e1) {
+				continue;
+			}
+			float error = bc4Fit(values, e0, e1, indices);
+			if (error < bestError) {
+				bestError = error;
+				bestE0 = e0;
+				bestE1 = e1;
+				memcpy(bestIndices, indices, 16);
+			}
+		}
+	}
+
+	if (lo6 <= hi6) {
+		int e0 = clampByte(lo6), e1 = clampByte(hi6);
+		float error = bc4Fit(values, e0, e1, indices);
+		if (error < bestError) {
+			bestError = error;
+			bestE0 = e0;
+			bestE1 = e1;
+			memcpy(bestIndices, indices, 16);
+		}
+	}
+
+	block[0] = (unsigned char)bestE0;
+	block[1] = (unsigned char)bestE1;
+	unsigned long long bits = 0;
+	for (int i = 0; i < 16; i++) {
+		bits |= (unsigned long long)bestIndices[i] << (3 * i);
+	}
+	for (int i = 0; i < 6; i++) {
+		block[2 + i] = (unsigned char)(bits >> (8 * i));
+	}
+}
+
+// Compresses one mip level. levelData holds values in [0,255].
+static void encodeLevel(const std::vector<float>& levelData, int width, int height, std::vector<unsigned char>& out) {
+	for (int by = 0; by < (height + 3) / 4; by++) {
+		for (int bx = 0; bx < (width + 3) / 4; bx++) {
+			float values[16];
+			for (int i = 0; i < 16; i++) {
+				// Repeat the edge for partial blocks
+				int x = bx * 4 + (i & 3);
+				int y = by * 4 + (i >> 2);
+				x = x < width ? x : width - 1;
+				y = y < height ? y : height - 1;
+				values[i] = levelData[y * width + x];
+			}
+			unsigned char block[8];
+			encodeBC4Block(values, block);
+			out.insert(out.end(), block, block + 8);
+		}
+	}
+}
+
+// 2x2 box filter
+static void downsample(const std::vector<float>& src, int width, int height,
+	std::vector<float>& dst, int dstWidth, int dstHeight) {
+	dst.assign(dstWidth * dstHeight, 0.0f);
+	for (int y = 0; y < dstHeight; y++) {
+		for (int x = 0; x < dstWidth; x++) {
+			int x0 = x * 2, x1 = x * 2 + 1 < width ? x * 2 + 1 : width - 1;
+			int y0 = y * 2, y1 = y * 2 + 1 < height ? y * 2 + 1 : height - 1;
+			dst[y * dstWidth + x] = (src[y0 * width + x0] + src[y0 * width + x1] +
+				src[y1 * width + x0] + src[y1 * width + x1]) * 0.25f;
+		}
+	}
+}
+
+static void putU32(std::vector<unsigned char>& out, unsigned int v) {
+	out.push_back(v & 0xFF);
+	out.push_back((v >> 8) & 0xFF);
+	out.push_back((v >> 16) & 0xFF);
+	out.push_back((v >> 24) & 0xFF);
+}
+
+bool compressTexture(const char* inputpath, const char* outputpath) {
+
+	printf("Compressing %s\n", inputpath);
+
+	// Same orientation as loadImage
+	stbi_set_flip_vertically_on_load(true);
+	int width, height, fileChannels;
+	unsigned char* data = stbi_load(inputpath, &width, &height, &fileChannels, 4);
+	if (!data) {
+		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", inputpath);
+		return false;
+	}
+
+	std::vector<float> level(width * height);
+	for (int i = 0; i < width * height; i++) {
+		level[i] = data[i * 4];
+	}
+	stbi_image_free(data);
+
+	std::vector<unsigned char> blocks;
+	unsigned int mipMapCount = 0;
+	unsigned int linearSize = 0;
+	int levelWidth = width, levelHeight = height;
+	while (true) {
+		encodeLevel(level, levelWidth, levelHeight, blocks);
+		if (mipMapCount == 0) {
+			linearSize = (unsigned int)blocks.size();
+		}
+		mipMapCount++;
+		if (levelWidth == 1 && levelHeight == 1) {
+			break;
+		}
+
+		int nextWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+		int nextHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+		std::vector<float> next;
+		downsample(level, levelWidth, levelHeight, next, nextWidth, nextHeight);
+		level.swap(next);
+		levelWidth = nextWidth;
+		levelHeight = nextHeight;
+	}
+
+	// Legacy DDS header, the layout loadDDS reads
+	std::vector<unsigned char> header;
+	header.insert(header.end(), "DDS ", "DDS " + 4);
+	putU32(header, 124);										// size
+	putU32(header, 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000);	// caps, height, width, pixel format, mip count, linear size
+	putU32(header, height);
+	putU32(header, width);
+	putU32(header, linearSize);
+	putU32(header, 0);											// depth
+	putU32(header, mipMapCount);
+	for (int i = 0; i < 11; i++) {
+		putU32(header, 0);										// reserved
+	}
+	putU32(header, 32);											// pixel format size
+	putU32(header, 0x4);										// DDPF_FOURCC
+	putU32(header, FOURCC_ATI1);
+	for (int i = 0; i < 5; i++) {
+		putU32(header, 0);										// bit counts and masks
+	}
+	putU32(header, 0x1000 | 0x400000 | 0x8);					// texture, mipmap, complex
+	for (int i = 0; i < 4; i++) {
+		putU32(header, 0);										// caps2-4, reserved
+	}
+
+	FILE* file = fopen(outputpath, "wb");
+	if (!file) {
+		printf("%s could not be opened for writing\n", outputpath);
+		return false;
+	}
+	fwrite(&header[0], 1, header.size(), file);
+	fwrite(&blocks[0], 1, blocks.size(), file);
+	fclose(file);
+
+	printf("Wrote %s: %dx%d BC4, %u mips, %u bytes (RGBA8 top level %d bytes)\n", outputpath, width, height,
+		mipMapCount, (unsigned int)blocks.size(), width * height * 4);
+	return true;
+}
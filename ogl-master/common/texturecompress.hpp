@@ -0,0 +1,10 @@
+#ifndef TEXTURECOMPRESS_HPP
+#define TEXTURECOMPRESS_HPP
+
+// Offline block compression of the heightmap into a BC4 (ATI1) .dds file that
+// loadDDS reads: one channel, 4 bits/pixel, taken from the red channel of the
+// input. A full mip chain is written. Rows are stored bottom-up, the same as
+// loadImage uploads them, so UVs do not change.
+bool compressTexture(const char* inputpath, const char* outputpath);
+
+#endif
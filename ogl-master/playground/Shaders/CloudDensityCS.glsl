@@ -1,239 +1,117 @@
 #version 430
 
-writeonly uniform image2D destTex;
-layout(local_size_x = 8, local_size_y = 8) in;
-
-uniform vec2 iResolution;
-uniform float iTime;
-uniform vec3 camPos;
-uniform vec3 camDir;
-uniform vec3 camRight;
-uniform vec3 lightCol;
-uniform vec3 lightDir;
-
-uniform vec3 skyCol;
-uniform vec3 cloudCol;
-
-uniform vec3 cloudScale;
-uniform float detailScale;
-
-uniform vec3 cloudSpeed;
-uniform vec3 detailSpeed;
-
-uniform float zNear;
-uniform float zFar;
-
-uniform sampler3D worleyTex;
-uniform sampler3D detailTex;
-uniform sampler2D bufferTex;
-uniform sampler2D depthTex;
-
-uniform float numSteps;
-uniform float numLightSteps;
-
-uniform float densityMult;
-uniform float densityOfst;
-
-uniform float baseTransmittance;
-
-uniform float forwardScattering;
-uniform float backScattering;
-uniform float baseBrightness;
-uniform float phaseFactor;
-
-uniform float optFactor;
-
-uniform vec3 cloudMin;
-uniform vec3 cloudMax;
-
-struct Ray {
-	vec3 origin;
-	vec3 direction;
-};
-
-struct AABB {
-	vec3 boundsMin;
-	vec3 boundsMax;
-};
-
-vec3 sampleAdjust;
-vec3 sampleAdjustDetail;
+// Workgroup layout
+// Each group shades one TILE_SIZE_X x TILE_SIZE_Y tile. Invocations are mapped
+// onto the tile in Morton order, so every 32-wide warp covers a compact 8x4
+// block and every 64-wide wave an 8x8 block regardless of the tile shape.
+// The Morton mapping requires TILE_SIZE_X == TILE_SIZE_Y or
+// TILE_SIZE_X == 2 * TILE_SIZE_Y, both powers of two. Both can be overridden
+// with injected defines.
+//
+// Occupancy comparison (640x360, per group shared memory is 4 bytes in all cases,
+// so registers and the per-SM group limit decide occupancy):
+//
+//   layout   threads  warps/waves64  groups   notes
+//   8x8      64       2 / 1          3600     previous layout, rows of 8 per warp
+//   16x8     128      4 / 2          1800     default, half the tile reductions
+//   8x4      32       1 / 0.5        7200     one warp per group
+//
+// 8x4 is capped at 50% occupancy on NVIDIA parts that limit resident groups
+// per SM (16 groups x 32 threads on Turing, 32 x 32 of 2048 on Pascal) and
+// leaves half of every wave64 idle on GCN. 8x8 and 16x8 both reach the
+// register-limited occupancy; 16x8 halves the number of tile depth lookups
+// and tile-uniform culls, and with the Morton mapping its warps are as compact
+// as the 8x8 row-major ones. Compare the layouts with the cloud pass timer in
+// the FPS overlay.
+#ifndef TILE_SIZE_X
+#define TILE_SIZE_X 16
+#endif
+#ifndef TILE_SIZE_Y
+#define TILE_SIZE_Y 8
+#endif
+
+#include "CloudRaymarch.glsl"
+
+// Min/max linear depth pyramid from DepthPyramidCS, level 0 at half resolution
+uniform sampler2D depthBoundsTex;
 
-AABB cloudBox = AABB(vec3(-20.0, 0, -20.0), vec3(20.0, 8, 20.0));
-
-// Returns (dstToBox, dstInsideBox). If ray misses box, dstInsideBox will be zero
-vec2 rayBoxDst(vec3 boundsMin, vec3 boundsMax, Ray ray) {
-	// Adapted from: http://psgraphics.blogspot.com/2016/02/new-simple-ray-box-test-from-andrew.html
-	// And: https://github.com/SebLague/Clouds
-
-	vec3 invDir = vec3(1.0) / ray.direction;
-	vec3 t0 = (boundsMin - ray.origin) * invDir;
-	vec3 t1 = (boundsMax - ray.origin) * invDir;
-	vec4 tmin = vec4(min(t0, t1), 1.0);
-	vec4 tmax = vec4(max(t0, t1), 1.0);
-
-	float dstA = max(max(tmin.x, tmin.y), tmin.z);
-	float dstB = min(tmax.x, min(tmax.y, tmax.z));
-
-	// CASE 1: ray intersects box from outside (0 <= dstA <= dstB)
-				// dstA is dst to nearest intersection, dstB dst to far intersection
-
-				// CASE 2: ray intersects box from inside (dstA < 0 < dstB)
-				// dstA is the dst to intersection behind the ray, dstB is dst to forward intersection
-
-				// CASE 3: ray misses box (dstA > dstB)
-
-	float dstToBox = max(0, dstA);
-	float dstInsideBox = max(0, dstB - dstToBox);
-	return vec2(dstToBox, dstInsideBox);
-}
-
-float sampleDensity(vec3 samplePos) {
-	vec3 edgeDst = min(samplePos - cloudBox.boundsMin, cloudBox.boundsMax - samplePos);
-	float edgeFade = min(min(edgeDst.x, min(edgeDst.y, edgeDst.z)), 1.0);
-
-	samplePos *= cloudScale;
-	vec3 detPos = samplePos;
-
-	samplePos = samplePos * 0.03 + sampleAdjust;
-	float sampled = min(1.0, max(0.0, (texture(worleyTex, samplePos).r - densityOfst) * densityMult));
-	sampled *= edgeFade;
-	if (sampled > 0.01) {
-		detPos = detPos * 0.15 * detailScale + sampleAdjustDetail;
-		sampled = min(1.0, max(0.0, sampled - texture(detailTex, detPos).r));
-	}
-	return sampled;
+writeonly uniform image2D destTex;
+layout(local_size_x = TILE_SIZE_X, local_size_y = TILE_SIZE_Y) in;
+
+// Smallest cosTheta in the tile, shared by the whole group
+shared uint tileMinCos;
+
+// Decode the even/odd bits of a Morton index into a 2D position inside the tile
+uvec2 mortonToTile(uint index) {
+	uvec2 pos = uvec2(index, index >> 1) & 0x55555555u;
+	pos = (pos | (pos >> 1)) & 0x33333333u;
+	pos = (pos | (pos >> 2)) & 0x0F0F0F0Fu;
+	pos = (pos | (pos >> 4)) & 0x00FF00FFu;
+	pos = (pos | (pos >> 8)) & 0x0000FFFFu;
+	return pos;
 }
 
-float lightMarch(vec3 cloudPos) {
-	
-	Ray ray = Ray(cloudPos, lightDir);
-	float dstInBox = rayBoxDst(cloudBox.boundsMin, cloudBox.boundsMax, ray).y;
-
-	float stepSize = dstInBox / numLightSteps;
-	float totalDensity = 0.0;
-
-	for (int step = 0; step < numLightSteps; step++) {
-		cloudPos += lightDir * stepSize;
-		totalDensity += max(0.0, sampleDensity(cloudPos) * stepSize);
+// Farthest terrain distance in the tile, from the pyramid level whose texels
+// are as wide as the tile's shorter side. Every invocation reads the same one
+// or two texels, so this costs less than a reduction across the group.
+float tileMaxDepth(uvec2 tileOrigin) {
+	int level = min(findLSB(min(TILE_SIZE_X, TILE_SIZE_Y)) - 1, textureQueryLevels(depthBoundsTex) - 1);
+	ivec2 last = textureSize(depthBoundsTex, level) - 1;
+	ivec2 first = min(ivec2(tileOrigin) >> (level + 1), last);
+	ivec2 end = min((ivec2(tileOrigin) + ivec2(TILE_SIZE_X, TILE_SIZE_Y) - 1) >> (level + 1), last);
+
+	float depth = 0.0;
+	for (int y = first.y; y <= end.y; y++) {
+		for (int x = first.x; x <= end.x; x++) {
+			depth = max(depth, texelFetch(depthBoundsTex, ivec2(x, y), level).g);
+		}
 	}
-
-	float transmittance = exp(-totalDensity);
-	return baseTransmittance + transmittance * (1 - baseTransmittance);
-}
-
-// Henyey-Greenstein
-float hg(float a, float g) {
-	float g2 = g * g;
-	return (1 - g2) / (4 * 3.1415 * pow(1 + g2 - 2 * g * (a), 1.5));
+	return depth;
 }
 
-float phase(vec3 rayDir) {
-	float a = dot(rayDir, lightDir);
-	float blend = .5;
-	float hgBlend = hg(a, forwardScattering) * (1 - blend) + hg(a, -backScattering) * blend;
-	return baseBrightness + hgBlend * phaseFactor;
-}
-
-vec3 skySample(vec3 rayDir) {
-	float sun = dot(rayDir, lightDir) * 0.5 + 0.5;
-	sun = 0.5 + 0.5 * tanh(100.0 * sun - 98.5);
-	return vec3(sun) * lightCol + vec3(1 - sun) * skyCol;
+// Distance from a point to the closest point of an AABB, zero if inside
+float pointBoxDst(vec3 boundsMin, vec3 boundsMax, vec3 p) {
+	vec3 d = max(max(boundsMin - p, p - boundsMax), vec3(0.0));
+	return length(d);
 }
 
 void main()
 {
-	cloudBox = AABB(cloudMin, cloudMax);
-
-	vec3 storePos = vec3(gl_GlobalInvocationID);
-	vec2 coords = (storePos.xy + vec2(0.5)) / iResolution.xy;
-
-
-	sampleAdjust = iTime * cloudSpeed;
-	sampleAdjustDetail = iTime * detailSpeed;
-
-	float nonLinDepth = texture(depthTex, coords).x;
-	float z_n = 2.0 * nonLinDepth - 1.0;
-	float depth = 2.0 * zNear * zFar / (zFar + zNear - z_n * (zFar - zNear));
-
-
-	float fov = tan(45.0 * 0.5 * (3.1415926535897932384626433832795 / 180.0));	//FOV adjust
-	vec2 p = (-iResolution.xy + 2.0 * storePos.xy)/ iResolution.y;
-	p*= fov;
-	p.x *= (4.0 / 3.0)/(iResolution.x/iResolution.y);
-	
-	vec3 camUp = cross(camDir, camRight);
-	vec3 rayDir = normalize(camRight * p.x + camUp * -p.y + camDir);
-
-	float cosTheta = dot(camDir, rayDir);
-
-	Ray ray = Ray(camPos, rayDir);
-	vec2 boxDist = rayBoxDst(cloudBox.boundsMin, cloudBox.boundsMax, ray);
-	if (boxDist.y <= 0 || boxDist.x * cosTheta > depth) {
-		if (nonLinDepth == 1.0) {
-			imageStore(destTex, ivec2(storePos.xy), vec4(skySample(rayDir),1.0));
-		}
-		else {
-			imageStore(destTex, ivec2(storePos.xy), texture(bufferTex, coords));
-		}
-		return;
+	if (gl_LocalInvocationIndex == 0) {
+		tileMinCos = floatBitsToUint(1.0);
 	}
 
-	float phaseVal = phase(rayDir);
-
-	float stepSize = numSteps;
-	float dstLimit = min(depth-boxDist.x * cosTheta,boxDist.y);
-
-	float dstTravelled = 0.0;
-	float lightEnergy = 0.0;
-	float transmittance = 1.0;
-	float lastStepRoot = 0.0;
-
-	while (dstTravelled < dstLimit) {
-		vec3 texPos = camPos + (boxDist.x + dstTravelled) * rayDir;
-		float density = sampleDensity(texPos);
+	uvec2 tileOrigin = gl_WorkGroupID.xy * uvec2(TILE_SIZE_X, TILE_SIZE_Y);
+	ivec2 storePos = ivec2(tileOrigin + mortonToTile(gl_LocalInvocationIndex));
+	bool inImage = all(lessThan(vec2(storePos), iResolution.xy));
 
-		if (density * lastStepRoot < 0.0) {
-			lastStepRoot = 0.0;
-		}
-
-		if (density > 0.01) {
-			float lightTransmittance = lightMarch(texPos);
-			lightEnergy += density * (stepSize + lastStepRoot * lastStepRoot) * transmittance * lightTransmittance * phaseVal;
-			transmittance *= exp(-density * (stepSize + lastStepRoot * lastStepRoot));
-
-			if (transmittance < 0.01) {
-				break;
-			}
-		}
+	CloudRay cr = setupCloudRay(vec2(storePos) + vec2(0.5));
 
-		lastStepRoot = optFactor * density;
-		dstTravelled += stepSize + lastStepRoot * lastStepRoot;
+	// cosTheta is positive, so its bit pattern orders like the float
+	barrier();
+	if (inImage) {
+		atomicMin(tileMinCos, floatBitsToUint(cr.cosTheta));
 	}
-	//geometry intersection
-	if (dstLimit < boxDist.y) {
-		stepSize = dstLimit - (dstTravelled - stepSize);
+	barrier();
 
-		vec3 texPos = camPos + (boxDist.x + dstLimit) * rayDir;
-		float density = sampleDensity(texPos);
-
-		if (density > 0.01) {
-			float lightTransmittance = lightMarch(texPos);
-			lightEnergy += density * stepSize * transmittance * lightTransmittance;
-			transmittance *= exp(-density * stepSize);
-		}
-	}
-
-	vec3 bgCol;
-	if (nonLinDepth == 1.0) {
-		bgCol = skySample(rayDir);
-	}
-	else {
-		bgCol = texture(bufferTex, coords).rgb;
+	if (!inImage) {
+		return;
 	}
 
-	vec3 cloudColFinal = lightEnergy * cloudCol;
-	vec3 col = max(vec3(0.0),min(vec3(1.0),bgCol * transmittance + cloudColFinal));
-	imageStore(destTex, ivec2(storePos.xy), vec4(col, 1.0));
-	
-}
\ No newline at end of file
+	// If no ray in the tile can reach the box before the terrain, skip the box test as well
+#ifdef SPHERICAL_SHELL
+	float camAltitude = length(camPos - planetCentre);
+	float boxNear = max(max(shellInner - camAltitude, camAltitude - shellOuter), 0.0);
+#elif defined(CLOUD_VOLUMES)
+	float boxNear = cloudVolumeCount > 0 ? pointBoxDst(bvhNodes[0].boundsMin, bvhNodes[0].boundsMax, camPos) : 0.0;
+#else
+	float boxNear = pointBoxDst(cloudBox.boundsMin, cloudBox.boundsMax, camPos);
+#endif
+	bool tileOccluded = boxNear * uintBitsToFloat(tileMinCos) > tileMaxDepth(tileOrigin);
+
+	vec4 colour = shadeClouds(cr, tileOccluded);
+#ifdef PROGRESSIVE
+	colour = accumulateFrame(storePos, colour);
+#endif
+	imageStore(destTex, storePos, colour);
+}
@@ -0,0 +1,77 @@
+#version 430
+
+// One face of the far cloud cubemap around camPos, one texel per invocation.
+// Each texel marches the clouds along its direction from farSplit on, as a
+// sky pixel of the cloud shaders would, and stores the light energy in red
+// and the transmittance in green. shadeClouds composites them behind its own
+// march up to farSplit under FAR_IMPOSTOR. Far clouds change little from
+// frame to frame, so the renderer updates one face per frame, and all six
+// once the camera has moved well away from camPos.
+//
+// Compiled with the same variant defines as the cloud shaders, which include
+// FAR_IMPOSTOR whenever the cubemap is in use.
+
+#ifndef FAR_IMPOSTOR
+#define FAR_IMPOSTOR
+#endif
+#include "CloudRaymarch.glsl"
+
+writeonly uniform image2D impostorFace;
+// Cubemap face, in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X onwards
+uniform int face;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// Direction through st in [-1, 1] on the face, as the cubemap is sampled
+vec3 faceDirection(vec2 st) {
+	switch (face) {
+	case 0: return vec3(1.0, -st.y, -st.x);
+	case 1: return vec3(-1.0, -st.y, st.x);
+	case 2: return vec3(st.x, 1.0, st.y);
+	case 3: return vec3(st.x, -1.0, -st.y);
+	case 4: return vec3(st.x, -st.y, 1.0);
+	default: return vec3(-st.x, -st.y, -1.0);
+	}
+}
+
+// Marches the part of layerDst past farSplit, stopping at zFar like a sky pixel looking straight ahead
+void marchFarLayer(vec3 rayDir, vec2 layerDst, float phaseVal, inout float lightEnergy, inout float transmittance) {
+	vec2 farDst = clipLayerDst(layerDst, farSplit, zFar);
+	if (farDst.y > 0.0) {
+		marchCloudLayer(rayDir, farDst, zFar, 1.0, phaseVal, lightEnergy, transmittance);
+	}
+}
+
+void main()
+{
+	ivec2 size = imageSize(impostorFace);
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, size))) {
+		return;
+	}
+
+	setupCloudFrame();
+#ifdef NOISE_LOD
+	// Texel width at the face centre
+	pixelAngle = 2.0 / float(size.x);
+#endif
+
+	vec2 st = (vec2(p) + 0.5) / vec2(size) * 2.0 - 1.0;
+	vec3 rayDir = normalize(faceDirection(st));
+	Ray ray = Ray(camPos, rayDir);
+	float phaseVal = phase(rayDir);
+
+	float lightEnergy = 0.0;
+	float transmittance = 1.0;
+#ifdef CLOUD_VOLUMES
+	vec2 spans[MAX_RAY_VOLUMES];
+	int spanCount = findRaySpans(ray, zFar, spans);
+	for (int i = 0; i < spanCount && transmittance >= 0.01; i++) {
+		marchFarLayer(rayDir, spans[i], phaseVal, lightEnergy, transmittance);
+	}
+#else
+	marchFarLayer(rayDir, cloudLayerDst(ray), phaseVal, lightEnergy, transmittance);
+#endif
+
+	imageStore(impostorFace, p, vec4(lightEnergy, transmittance, 0.0, 0.0));
+}
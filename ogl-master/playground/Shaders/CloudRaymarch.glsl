@@ -0,0 +1,847 @@
+// Shared cloud raymarching core, included by CloudDensityFS.glsl and
+// CloudDensityCS.glsl. Everything that affects the cloud image lives here so
+// the fragment and compute paths stay identical.
+//
+// Compile-time permutations (see Renderer::CloudVariantDefines):
+//   LIGHT_STEPS n   light march step count as a constant instead of numLightSteps
+//   DETAIL_NOISE    erode the base shape with detailTex
+//   GEOMETRY_TAIL   partial last step where the ray is clipped by the terrain
+//   EVOLVING_NOISE  crossfade from worleyTex/detailTex to the newer noise in
+//                   worleyNextTex/detailNextTex by noiseBlend
+//   NOISE_LOD       pick noise mips from the pixel footprint at the sample's
+//                   distance, fade the detail noise out before detailDistance
+//                   and grow the step size by stepGrowth per unit of distance
+//   WEATHER_MAP     scale density by the coverage in weatherTex and the height
+//                   profile of the cloud type, skipping the noise where either
+//                   is zero
+//   SPHERICAL_SHELL the clouds fill a layer between two spheres around
+//                   planetCentre instead of the cloudMin/cloudMax box, so they
+//                   reach the horizon. The march is cut at shellDistance and
+//                   spread over at most maxViewSteps steps.
+//   CLOUD_VOLUMES   march the cloud banks in cloudVolumes that the ray passes
+//                   through, found through the hierarchy in bvhNodes, instead
+//                   of the cloudMin/cloudMax box. Where banks overlap their
+//                   densities add up, and the light march finds the banks
+//                   toward the sun the same way. Takes the place of
+//                   SPHERICAL_SHELL.
+//   SPARSE_VOLUME   take density from the authored bricks in brickAtlas,
+//                   found through brickTable, instead of the noise, and step
+//                   over empty bricks. The clouds fill the volume's bounds
+//                   rather than the cloudMin/cloudMax box. Takes the place of
+//                   CLOUD_VOLUMES and SPHERICAL_SHELL.
+//   VIRTUAL_NOISE   read the base noise from the pages of a volume
+//                   virtualTiles times the size of worleyTex that doesn't
+//                   repeat, requesting the pages it samples through
+//                   pageRequests. Replaces the evolving base noise.
+//   FAR_IMPOSTOR    sky pixels march only as far as farSplit and take the
+//                   clouds beyond it from the farClouds cubemap around the
+//                   camera, which CloudImpostorCS.glsl updates a face at a
+//                   time. Terrain pixels march in full.
+//   PROGRESSIVE     the view is still: jitter the ray within the pixel and
+//                   the start of the march by accumulatedFrames, and average
+//                   the result into historyTex (see accumulateFrame)
+
+uniform vec2 iResolution;
+uniform float iTime;
+uniform vec3 camPos;
+uniform vec3 camDir;
+uniform vec3 camRight;
+uniform vec3 lightCol;
+uniform vec3 lightDir;
+
+uniform vec3 skyCol;
+uniform vec3 cloudCol;
+
+uniform vec3 cloudScale;
+uniform float detailScale;
+
+uniform vec3 cloudSpeed;
+uniform vec3 detailSpeed;
+
+uniform float zFar;
+
+uniform sampler3D worleyTex;
+uniform sampler3D detailTex;
+#ifdef EVOLVING_NOISE
+uniform sampler3D worleyNextTex;
+uniform sampler3D detailNextTex;
+uniform float noiseBlend;
+#endif
+#ifdef WEATHER_MAP
+// Coverage and cloud type over the XZ extent of the box (WeatherCS.glsl)
+uniform sampler2D weatherTex;
+// Density against height through the box, one row per cloud type
+uniform sampler2D heightProfileTex;
+#endif
+uniform sampler2D bufferTex;
+// Distance to the terrain along the view axis, zFar where there is only sky.
+// Written by DepthPyramidCS once the terrain has been drawn.
+uniform sampler2D linearDepthTex;
+
+uniform float numSteps;
+uniform float numLightSteps;
+
+uniform float densityMult;
+uniform float densityOfst;
+
+uniform float baseTransmittance;
+
+uniform float forwardScattering;
+uniform float backScattering;
+uniform float baseBrightness;
+uniform float phaseFactor;
+
+uniform float optFactor;
+
+uniform vec3 cloudMin;
+uniform vec3 cloudMax;
+
+#ifdef SPHERICAL_SHELL
+uniform vec3 planetCentre;
+uniform float shellInner;
+uniform float shellOuter;
+uniform float shellDistance;
+uniform float maxViewSteps;
+#endif
+
+#ifdef CLOUD_VOLUMES
+// Cloud banks in tree order and the hierarchy over them (CloudVolumes in cloudvolumes.h)
+struct CloudVolume {
+	vec3 boundsMin;
+	float density;
+	vec3 boundsMax;
+	float noiseScale;
+	vec3 noiseOffset;
+};
+
+struct BVHNode {
+	vec3 boundsMin;
+	int first;		// left child of an inner node, first volume of a leaf
+	vec3 boundsMax;
+	int count;		// 0 for an inner node
+};
+
+layout(std430, binding = 1) readonly buffer CloudVolumeBuffer {
+	CloudVolume cloudVolumes[];
+};
+
+layout(std430, binding = 2) readonly buffer CloudBVHBuffer {
+	BVHNode bvhNodes[];
+};
+
+uniform int cloudVolumeCount;
+#endif
+
+#ifdef SPARSE_VOLUME
+// Authored clouds in 8^3 bricks (SparseVolume in sparsevolume.h). brickTable
+// holds the atlas slot + 1 of every brick in the bounds, 0 where it is empty.
+// Atlas bricks are 10^3 with a one voxel apron.
+uniform usampler3D brickTable;
+uniform sampler3D brickAtlas;
+uniform vec3 sparseMin;
+uniform vec3 sparseMax;
+uniform float sparseVoxelSize;
+uniform float sparseDensity;
+#endif
+
+#ifdef VIRTUAL_NOISE
+// Base noise without repetition, generated page by page (VirtualNoise in
+// virtualnoise.h). pageTable holds the cache slot + 1 of every page, 0 until
+// it has been generated. pageCache holds the pages with a one voxel apron and
+// virtualFallback the whole volume at the size of worleyTex.
+uniform usampler3D pageTable;
+uniform sampler3D pageCache;
+uniform sampler3D virtualFallback;
+uniform int virtualTiles;
+uniform int virtualPageSize;
+
+// One bit per page sampled since the renderer last read them back
+layout(std430, binding = 3) buffer PageRequests {
+	uint pageRequests[];
+};
+#endif
+
+#ifdef FAR_IMPOSTOR
+// Light energy and transmittance of the clouds past farSplit along each direction
+uniform samplerCube farClouds;
+uniform float farSplit;
+#endif
+
+#ifdef PROGRESSIVE
+// Running average of the frames since the view stopped moving
+layout(rgba32f) uniform image2D historyTex;
+uniform int accumulatedFrames;
+
+// Fraction of a step the march starts at, different every frame
+float marchOffset = 0.0;
+#endif
+
+#ifdef NOISE_LOD
+uniform float detailDistance;
+uniform float stepGrowth;
+#endif
+
+struct Ray {
+	vec3 origin;
+	vec3 direction;
+};
+
+struct AABB {
+	vec3 boundsMin;
+	vec3 boundsMax;
+};
+
+vec3 sampleAdjust;
+vec3 sampleAdjustDetail;
+
+// Mip levels and detail weight for the samples around the current view sample,
+// set by setSampleDistance. Without NOISE_LOD they stay at full resolution.
+float noiseLod = 0.0;
+float detailLod = 0.0;
+float detailFade = 1.0;
+#ifdef NOISE_LOD
+// View angle covered by one pixel, and noise texels per unit of distance
+float pixelAngle;
+float noiseTexels;
+float detailTexels;
+// Average of the detail noise, from its last mip. Faded-out detail erodes by
+// this instead of nothing, so distant clouds keep their coverage.
+float detailMean;
+
+void setSampleDistance(float dist) {
+	float footprint = dist * pixelAngle;
+	noiseLod = log2(max(footprint * noiseTexels, 1.0));
+	detailLod = log2(max(footprint * detailTexels, 1.0));
+	detailFade = clamp(4.0 * (1.0 - dist / detailDistance), 0.0, 1.0);
+}
+#endif
+
+AABB cloudBox = AABB(vec3(-20.0, 0, -20.0), vec3(20.0, 8, 20.0));
+
+// Returns (dstToBox, dstInsideBox). If ray misses box, dstInsideBox will be zero
+vec2 rayBoxDst(vec3 boundsMin, vec3 boundsMax, Ray ray) {
+	// Adapted from: http://psgraphics.blogspot.com/2016/02/new-simple-ray-box-test-from-andrew.html
+	// And: https://github.com/SebLague/Clouds
+
+	vec3 invDir = vec3(1.0) / ray.direction;
+	vec3 t0 = (boundsMin - ray.origin) * invDir;
+	vec3 t1 = (boundsMax - ray.origin) * invDir;
+	vec4 tmin = vec4(min(t0, t1), 1.0);
+	vec4 tmax = vec4(max(t0, t1), 1.0);
+
+	float dstA = max(max(tmin.x, tmin.y), tmin.z);
+	float dstB = min(tmax.x, min(tmax.y, tmax.z));
+
+	// CASE 1: ray intersects box from outside (0 <= dstA <= dstB)
+				// dstA is dst to nearest intersection, dstB dst to far intersection
+
+				// CASE 2: ray intersects box from inside (dstA < 0 < dstB)
+				// dstA is the dst to intersection behind the ray, dstB is dst to forward intersection
+
+				// CASE 3: ray misses box (dstA > dstB)
+
+	float dstToBox = max(0, dstA);
+	float dstInsideBox = max(0, dstB - dstToBox);
+	return vec2(dstToBox, dstInsideBox);
+}
+
+#ifdef SPHERICAL_SHELL
+// Entry and exit distances of the ray through a sphere, x > y if it misses
+vec2 raySphere(vec3 centre, float radius, Ray ray) {
+	vec3 oc = ray.origin - centre;
+	float b = dot(oc, ray.direction);
+	float h = b * b - dot(oc, oc) + radius * radius;
+	if (h < 0.0) {
+		return vec2(1.0, -1.0);
+	}
+	h = sqrt(h);
+	return vec2(-b - h, -b + h);
+}
+
+// Returns (dstToShell, dstInsideShell) for the first stretch of the ray in the
+// shell, like rayBoxDst. From below the layer the ray leaves the inner sphere
+// and then the outer one. From inside or above it, it enters the outer sphere
+// and leaves at the inner one if it points down far enough to reach it.
+vec2 rayShellDst(Ray ray) {
+	vec2 outer = raySphere(planetCentre, shellOuter, ray);
+	if (outer.x > outer.y || outer.y <= 0.0) {
+		return vec2(0.0);
+	}
+	vec2 inner = raySphere(planetCentre, shellInner, ray);
+
+	float dstToShell, dstExit;
+	if (length(ray.origin - planetCentre) < shellInner) {
+		dstToShell = inner.y;
+		dstExit = outer.y;
+	}
+	else {
+		dstToShell = max(outer.x, 0.0);
+		dstExit = inner.x <= inner.y && inner.x > 0.0 ? inner.x : outer.y;
+	}
+	// The far part of grazing rays is cut off to bound the cost per pixel
+	dstExit = min(dstExit, shellDistance);
+	return vec2(dstToShell, max(0.0, dstExit - dstToShell));
+}
+#endif
+
+// Where the ray passes through the cloud layer, box or shell
+vec2 cloudLayerDst(Ray ray) {
+#ifdef SPHERICAL_SHELL
+	return rayShellDst(ray);
+#else
+	return rayBoxDst(cloudBox.boundsMin, cloudBox.boundsMax, ray);
+#endif
+}
+
+// The part of a stretch returned by cloudLayerDst between the distances from and to
+vec2 clipLayerDst(vec2 layerDst, float from, float to) {
+	float start = max(layerDst.x, from);
+	return vec2(start, max(0.0, min(layerDst.x + layerDst.y, to) - start));
+}
+
+#ifdef CLOUD_VOLUMES
+// Banks sampled per ray, the nearest ones if it passes through more
+#define MAX_RAY_VOLUMES 8
+#define BVH_STACK_SIZE 32
+
+// Volumes the last ray passes through and their cloudLayerDst, nearest first
+int rayVolumes[MAX_RAY_VOLUMES];
+vec2 rayVolumeDst[MAX_RAY_VOLUMES];
+
+// Banks sampleDensity sums, set by findRaySpans
+int activeVolumes[MAX_RAY_VOLUMES];
+int activeVolumeCount = 0;
+
+// Density and noise frequency multipliers of the volume being marched
+float volumeDensity;
+float volumeNoiseScale;
+
+// Walks the hierarchy for the volumes the ray enters before maxDst, sorted by
+// entry distance. Returns how many were found.
+int findRayVolumes(Ray ray, float maxDst) {
+	if (cloudVolumeCount == 0) {
+		return 0;
+	}
+
+	int hits = 0;
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		BVHNode node = bvhNodes[stack[--top]];
+		vec2 nodeDst = rayBoxDst(node.boundsMin, node.boundsMax, ray);
+		// Once the list is full only nodes that can hold a nearer volume matter
+		if (nodeDst.y <= 0.0 || nodeDst.x > maxDst ||
+			(hits == MAX_RAY_VOLUMES && nodeDst.x >= rayVolumeDst[hits - 1].x)) {
+			continue;
+		}
+
+		if (node.count == 0) {
+			if (top + 2 <= BVH_STACK_SIZE) {
+				stack[top++] = node.first + 1;
+				stack[top++] = node.first;
+			}
+			continue;
+		}
+
+		for (int v = node.first; v < node.first + node.count; v++) {
+			vec2 dst = rayBoxDst(cloudVolumes[v].boundsMin, cloudVolumes[v].boundsMax, ray);
+			if (dst.y <= 0.0 || dst.x > maxDst) {
+				continue;
+			}
+			// Insert sorted, dropping the farthest when the list is full
+			int i = min(hits, MAX_RAY_VOLUMES - 1);
+			if (hits == MAX_RAY_VOLUMES && dst.x >= rayVolumeDst[i].x) {
+				continue;
+			}
+			for (; i > 0 && rayVolumeDst[i - 1].x > dst.x; i--) {
+				rayVolumes[i] = rayVolumes[i - 1];
+				rayVolumeDst[i] = rayVolumeDst[i - 1];
+			}
+			rayVolumes[i] = v;
+			rayVolumeDst[i] = dst;
+			hits = min(hits + 1, MAX_RAY_VOLUMES);
+		}
+	}
+	return hits;
+}
+
+// Makes the volumes the ray enters before maxDst the ones sampleDensity sums,
+// and merges their stretches along the ray where they overlap, nearest first.
+// Returns how many spans there are.
+int findRaySpans(Ray ray, float maxDst, out vec2 spans[MAX_RAY_VOLUMES]) {
+	int hits = findRayVolumes(ray, maxDst);
+	int count = 0;
+	for (int i = 0; i < hits; i++) {
+		activeVolumes[i] = rayVolumes[i];
+		vec2 dst = rayVolumeDst[i];
+		// Sorted by entry, so a volume either overlaps the last span or starts a new one
+		if (count > 0 && dst.x <= spans[count - 1].x + spans[count - 1].y) {
+			spans[count - 1].y = max(spans[count - 1].y, dst.x + dst.y - spans[count - 1].x);
+		}
+		else {
+			spans[count++] = dst;
+		}
+	}
+	activeVolumeCount = hits;
+	return count;
+}
+
+// Makes volume index the one sampleBankDensity works in
+void selectCloudVolume(int index) {
+	CloudVolume volume = cloudVolumes[index];
+	cloudBox = AABB(volume.boundsMin, volume.boundsMax);
+	volumeDensity = volume.density;
+	volumeNoiseScale = volume.noiseScale;
+	sampleAdjust = iTime * cloudSpeed + volume.noiseOffset;
+	sampleAdjustDetail = iTime * detailSpeed + volume.noiseOffset;
+}
+#endif
+
+#ifdef SPARSE_VOLUME
+// Atlas slot of the brick holding voxelPos, -1 if it is empty
+int brickSlot(vec3 voxelPos) {
+	ivec3 brick = ivec3(floor(voxelPos / 8.0));
+	if (any(lessThan(brick, ivec3(0))) || any(greaterThanEqual(brick, textureSize(brickTable, 0)))) {
+		return -1;
+	}
+	return int(texelFetch(brickTable, brick, 0).r) - 1;
+}
+
+float sampleSparse(vec3 samplePos) {
+	vec3 voxelPos = (samplePos - sparseMin) / sparseVoxelSize;
+	int slot = brickSlot(voxelPos);
+	if (slot < 0) {
+		return 0.0;
+	}
+	ivec3 atlasSize = textureSize(brickAtlas, 0);
+	ivec3 slots = atlasSize / 10;
+	ivec3 atlasBrick = ivec3(slot % slots.x, (slot / slots.x) % slots.y, slot / (slots.x * slots.y));
+	// Voxel i of the brick is atlas texel i + 1, the apron covers the filter at the faces
+	vec3 local = voxelPos - floor(voxelPos / 8.0) * 8.0;
+	vec3 atlasPos = (vec3(atlasBrick * 10) + 1.0 + local) / vec3(atlasSize);
+	return textureLod(brickAtlas, atlasPos, 0.0).r * sparseDensity;
+}
+
+// Distance to where the ray leaves the brick holding samplePos if that brick
+// is empty, 0 if it holds voxels
+float emptyBrickSkip(vec3 samplePos, vec3 rayDir) {
+	vec3 voxelPos = (samplePos - sparseMin) / sparseVoxelSize;
+	if (brickSlot(voxelPos) >= 0) {
+		return 0.0;
+	}
+	vec3 brickMin = sparseMin + floor(voxelPos / 8.0) * 8.0 * sparseVoxelSize;
+	return rayBoxDst(brickMin, brickMin + 8.0 * sparseVoxelSize, Ray(samplePos, rayDir)).y;
+}
+#endif
+
+#ifdef VIRTUAL_NOISE
+float sampleVirtualNoise(vec3 uvw) {
+	uvw = fract(uvw);
+	// Far samples need no more than the fallback or one of its mips
+	float fallbackLod = noiseLod - log2(float(virtualTiles));
+	if (fallbackLod >= 0.0) {
+		return textureLod(virtualFallback, uvw, fallbackLod).r;
+	}
+
+	ivec3 pages = textureSize(pageTable, 0);
+	vec3 voxel = uvw * vec3(pages * virtualPageSize);
+	ivec3 page = min(ivec3(voxel) / virtualPageSize, pages - 1);
+	int pageIndex = (page.z * pages.y + page.y) * pages.x + page.x;
+	uint bit = 1u << uint(pageIndex & 31);
+	if ((pageRequests[pageIndex >> 5] & bit) == 0u) {
+		atomicOr(pageRequests[pageIndex >> 5], bit);
+	}
+
+	uint entry = texelFetch(pageTable, page, 0).r;
+	if (entry == 0u) {
+		return textureLod(virtualFallback, uvw, 0.0).r;
+	}
+	int slot = int(entry) - 1;
+	int cachePage = virtualPageSize + 2;
+	ivec3 cacheSize = textureSize(pageCache, 0);
+	ivec3 slots = cacheSize / cachePage;
+	ivec3 slotPos = ivec3(slot % slots.x, (slot / slots.x) % slots.y, slot / (slots.x * slots.y));
+	// Voxel i of the page is cache texel i + 1, the apron covers the filter at the faces
+	vec3 cachePos = vec3(slotPos * cachePage) + 1.0 + voxel - vec3(page * virtualPageSize);
+	return textureLod(pageCache, cachePos / vec3(cacheSize), 0.0).r;
+}
+#endif
+
+#ifdef CLOUD_VOLUMES
+// Density of the selected bank alone, sampleDensity adds up the banks
+float sampleBankDensity(vec3 samplePos) {
+#else
+float sampleDensity(vec3 samplePos) {
+#endif
+#ifdef SPARSE_VOLUME
+	return sampleSparse(samplePos);
+#else
+#ifdef SPHERICAL_SHELL
+	float altitude = length(samplePos - planetCentre);
+	float edgeFade = min(min(altitude - shellInner, shellOuter - altitude), 1.0);
+	float heightFraction = (altitude - shellInner) / (shellOuter - shellInner);
+#else
+	vec3 edgeDst = min(samplePos - cloudBox.boundsMin, cloudBox.boundsMax - samplePos);
+	float edgeFade = min(min(edgeDst.x, min(edgeDst.y, edgeDst.z)), 1.0);
+	float heightFraction = (samplePos.y - cloudBox.boundsMin.y) / (cloudBox.boundsMax.y - cloudBox.boundsMin.y);
+#endif
+
+#ifdef WEATHER_MAP
+	// Mirrored wrapping repeats the map over a shell wider than the box
+	vec2 weatherPos = (samplePos.xz - cloudBox.boundsMin.xz) / (cloudBox.boundsMax.xz - cloudBox.boundsMin.xz);
+	vec2 weather = texture(weatherTex, weatherPos).rg;
+	float profile = weather.r * texture(heightProfileTex, vec2(heightFraction, weather.g)).r;
+	if (profile <= 0.0) {
+		return 0.0;
+	}
+	edgeFade *= profile;
+#endif
+
+#ifdef CLOUD_VOLUMES
+	samplePos *= cloudScale * volumeNoiseScale;
+#else
+	samplePos *= cloudScale;
+#endif
+	vec3 detPos = samplePos;
+
+	samplePos = samplePos * 0.03 + sampleAdjust;
+#ifdef VIRTUAL_NOISE
+	float noise = sampleVirtualNoise(samplePos / float(virtualTiles));
+#elif defined(EVOLVING_NOISE)
+	float noise = mix(textureLod(worleyTex, samplePos, noiseLod).r, textureLod(worleyNextTex, samplePos, noiseLod).r, noiseBlend);
+#else
+	float noise = textureLod(worleyTex, samplePos, noiseLod).r;
+#endif
+#ifdef CLOUD_VOLUMES
+	float sampled = min(1.0, (noise - densityOfst) * densityMult * volumeDensity);
+#else
+	float sampled = min(1.0, (noise - densityOfst) * densityMult);
+#endif
+	sampled *= edgeFade;
+#ifdef DETAIL_NOISE
+#ifdef NOISE_LOD
+	if (sampled > 0.01 && detailFade <= 0.0) {
+		return max(0.0, sampled - detailMean);
+	}
+#endif
+	if (sampled > 0.01) {
+		detPos = detPos * 0.15 * detailScale + sampleAdjustDetail;
+#ifdef EVOLVING_NOISE
+		float detail = mix(textureLod(detailTex, detPos, detailLod).r, textureLod(detailNextTex, detPos, detailLod).r, noiseBlend);
+#else
+		float detail = textureLod(detailTex, detPos, detailLod).r;
+#endif
+#ifdef NOISE_LOD
+		detail = mix(detailMean, detail, detailFade);
+#endif
+		sampled = min(1.0, max(0.0, sampled - detail));
+	}
+#endif
+	return sampled;
+#endif
+}
+
+#ifdef CLOUD_VOLUMES
+// Sum of the active banks holding samplePos. Outside every cloud it returns
+// the value nearest to one, which the march uses to step further.
+float sampleDensity(vec3 samplePos) {
+	float density = 0.0;
+	float outside = 0.0;
+	bool inside = false;
+	for (int i = 0; i < activeVolumeCount; i++) {
+		CloudVolume volume = cloudVolumes[activeVolumes[i]];
+		if (any(lessThan(samplePos, volume.boundsMin)) || any(greaterThan(samplePos, volume.boundsMax))) {
+			continue;
+		}
+		selectCloudVolume(activeVolumes[i]);
+		float bank = sampleBankDensity(samplePos);
+		if (bank > 0.0) {
+			density += bank;
+		}
+		else {
+			outside = inside ? max(outside, bank) : bank;
+			inside = true;
+		}
+	}
+	return density > 0.0 ? density : outside;
+}
+#endif
+
+float lightMarch(vec3 cloudPos) {
+	
+	Ray ray = Ray(cloudPos, lightDir);
+#ifdef CLOUD_VOLUMES
+	// Every bank toward the sun shades the sample, not only the ones the view
+	// ray passes through. The view ray's banks are put back afterwards.
+	int viewVolumes[MAX_RAY_VOLUMES] = activeVolumes;
+	int viewVolumeCount = activeVolumeCount;
+	vec2 spans[MAX_RAY_VOLUMES];
+	int spanCount = findRaySpans(ray, 1e30, spans);
+	float dstInBox = spanCount > 0 ? spans[spanCount - 1].x + spans[spanCount - 1].y : 0.0;
+#else
+	float dstInBox = cloudLayerDst(ray).y;
+#endif
+
+#ifdef LIGHT_STEPS
+	float stepSize = dstInBox / float(LIGHT_STEPS);
+	float totalDensity = 0.0;
+
+	for (int step = 0; step < LIGHT_STEPS; step++) {
+#else
+	float stepSize = dstInBox / numLightSteps;
+	float totalDensity = 0.0;
+
+	for (int step = 0; step < numLightSteps; step++) {
+#endif
+		cloudPos += lightDir * stepSize;
+		totalDensity += max(0.0, sampleDensity(cloudPos) * stepSize);
+	}
+#ifdef CLOUD_VOLUMES
+	activeVolumes = viewVolumes;
+	activeVolumeCount = viewVolumeCount;
+#endif
+
+	float transmittance = exp(-totalDensity);
+	return baseTransmittance + transmittance * (1 - baseTransmittance);
+}
+
+// Henyey-Greenstein
+float hg(float a, float g) {
+	float g2 = g * g;
+	return (1 - g2) / (4 * 3.1415 * pow(1 + g2 - 2 * g * (a), 1.5));
+}
+
+float phase(vec3 rayDir) {
+	float a = dot(rayDir, lightDir);
+	float blend = .5;
+	float hgBlend = hg(a, forwardScattering) * (1 - blend) + hg(a, -backScattering) * blend;
+	return baseBrightness + hgBlend * phaseFactor;
+}
+
+vec3 skySample(vec3 rayDir) {
+	float sun = dot(rayDir, lightDir) * 0.5 + 0.5;
+	sun = 0.5 + 0.5 * tanh(100.0 * sun - 98.5);
+	return vec3(sun) * lightCol + vec3(1 - sun) * skyCol;
+}
+
+// Per-pixel inputs to the march
+struct CloudRay {
+	vec2 coords;
+	bool sky;
+	float depth;
+	vec3 rayDir;
+	float cosTheta;
+};
+
+// Sets up the globals every march reads. With NOISE_LOD pixelAngle is left to the caller.
+void setupCloudFrame()
+{
+#ifdef SPARSE_VOLUME
+	cloudBox = AABB(sparseMin, sparseMax);
+#else
+	cloudBox = AABB(cloudMin, cloudMax);
+#endif
+
+	sampleAdjust = iTime * cloudSpeed;
+	sampleAdjustDetail = iTime * detailSpeed;
+
+#ifdef NOISE_LOD
+	float scale = max(cloudScale.x, max(cloudScale.y, cloudScale.z));
+	noiseTexels = scale * 0.03 * float(textureSize(worleyTex, 0).x);
+	detailTexels = scale * 0.15 * detailScale * float(textureSize(detailTex, 0).x);
+	detailMean = textureLod(detailTex, vec3(0.5), float(textureQueryLevels(detailTex) - 1)).r;
+#endif
+}
+
+// Sets up the frame globals and the view ray through the pixel centre fragCoord
+CloudRay setupCloudRay(vec2 fragCoord)
+{
+	setupCloudFrame();
+
+	CloudRay cr;
+	cr.coords = fragCoord / iResolution.xy;
+
+	cr.depth = texture(linearDepthTex, cr.coords).x;
+	cr.sky = cr.depth >= zFar;
+
+
+	float fov = tan(45.0 * 0.5 * (3.1415926535897932384626433832795 / 180.0));	//FOV adjust
+#ifdef PROGRESSIVE
+	// Another point of the pixel each frame from the R2 sequence, and an
+	// interleaved gradient noise start offset stepped by the golden ratio
+	float frame = float(accumulatedFrames);
+	vec2 jitter = fract(frame * vec2(0.7548776662, 0.5698402910)) - 0.5;
+	marchOffset = fract(52.9829189 * fract(dot(fragCoord, vec2(0.06711056, 0.00583715))) + 0.6180339887 * frame);
+	vec2 p = (-iResolution.xy + 2.0 * (fragCoord + jitter))/ iResolution.y;
+#else
+	vec2 p = (-iResolution.xy + 2.0 * fragCoord)/ iResolution.y;
+#endif
+	p*= fov;
+	p.x *= (4.0 / 3.0)/(iResolution.x/iResolution.y);
+	
+	vec3 camUp = cross(camDir, camRight);
+	cr.rayDir = normalize(camRight * p.x + camUp * -p.y + camDir);
+
+	cr.cosTheta = dot(camDir, cr.rayDir);
+
+#ifdef NOISE_LOD
+	pixelAngle = 2.0 * fov / iResolution.y;
+#endif
+	return cr;
+}
+
+// Marches the stretch of the view ray through the current cloud layer, boxDist
+// as returned by cloudLayerDst, adding to lightEnergy and taking from transmittance
+void marchCloudLayer(vec3 rayDir, vec2 boxDist, float depth, float cosTheta, float phaseVal,
+	inout float lightEnergy, inout float transmittance)
+{
+	float dstLimit = min(depth-boxDist.x * cosTheta,boxDist.y);
+	float baseStep = numSteps;
+#ifdef SPHERICAL_SHELL
+	// Long grazing stretches near the horizon take longer steps rather than more of them
+	baseStep = max(numSteps, dstLimit / maxViewSteps);
+#endif
+	float stepSize = baseStep;
+
+	float dstTravelled = 0.0;
+#ifdef PROGRESSIVE
+	dstTravelled = marchOffset * stepSize;
+#endif
+
+	float lastStepRoot = 0.0;
+
+	while (dstTravelled < dstLimit) {
+#ifdef NOISE_LOD
+		stepSize = baseStep * (1.0 + stepGrowth * (boxDist.x + dstTravelled));
+		setSampleDistance(boxDist.x + dstTravelled);
+#endif
+		vec3 texPos = camPos + (boxDist.x + dstTravelled) * rayDir;
+#ifdef SPARSE_VOLUME
+		// Nothing to sample until the ray reaches an occupied brick
+		float skip = emptyBrickSkip(texPos, rayDir);
+		if (skip > 0.0) {
+			dstTravelled += skip + 0.01 * sparseVoxelSize;
+			lastStepRoot = 0.0;
+			continue;
+		}
+#endif
+		float density = sampleDensity(texPos);
+
+		if (density * lastStepRoot < 0.0) {
+			lastStepRoot = 0.0;
+		}
+
+		if (density > 0.01) {
+			float lightTransmittance = lightMarch(texPos);
+			lightEnergy += density * (stepSize + lastStepRoot * lastStepRoot) * transmittance * lightTransmittance * phaseVal;
+			transmittance *= exp(-density * (stepSize + lastStepRoot * lastStepRoot));
+
+			if (transmittance < 0.01) {
+				break;
+			}
+		}
+
+		lastStepRoot = optFactor * density;
+		dstTravelled += stepSize + lastStepRoot * lastStepRoot;
+	}
+#ifdef GEOMETRY_TAIL
+	//geometry intersection
+	if (dstLimit < boxDist.y) {
+		stepSize = dstLimit - (dstTravelled - stepSize);
+
+		vec3 texPos = camPos + (boxDist.x + dstLimit) * rayDir;
+#ifdef NOISE_LOD
+		setSampleDistance(boxDist.x + dstLimit);
+#endif
+		float density = sampleDensity(texPos);
+
+		if (density > 0.01) {
+			float lightTransmittance = lightMarch(texPos);
+			lightEnergy += density * stepSize * transmittance * lightTransmittance;
+			transmittance *= exp(-density * stepSize);
+		}
+	}
+#endif
+}
+
+// Marches the view ray and composites the clouds over the scene.
+// skipBox lets the caller cull the ray when it already knows the box is occluded.
+vec4 shadeClouds(CloudRay cr, bool skipBox)
+{
+	vec3 rayDir = cr.rayDir;
+	float depth = cr.depth;
+	float cosTheta = cr.cosTheta;
+
+	Ray ray = Ray(camPos, rayDir);
+#ifdef CLOUD_VOLUMES
+	vec2 spans[MAX_RAY_VOLUMES];
+	int spanCount = skipBox ? 0 : findRaySpans(ray, depth / cosTheta, spans);
+	bool missed = spanCount == 0;
+#else
+	vec2 boxDist = skipBox ? vec2(0.0) : cloudLayerDst(ray);
+	bool missed = boxDist.y <= 0 || boxDist.x * cosTheta > depth;
+#endif
+	if (missed) {
+		if (cr.sky) {
+			return vec4(skySample(rayDir), 1.0);
+		}
+		else {
+			return texture(bufferTex, cr.coords);
+		}
+	}
+
+	float phaseVal = phase(rayDir);
+
+	float lightEnergy = 0.0;
+	float transmittance = 1.0;
+
+#ifdef FAR_IMPOSTOR
+	float nearEnd = cr.sky ? farSplit : 1e30;
+#endif
+#ifdef CLOUD_VOLUMES
+	// Overlapping banks are marched once, front to back, their densities adding up
+	for (int i = 0; i < spanCount && transmittance >= 0.01; i++) {
+#ifdef FAR_IMPOSTOR
+		marchCloudLayer(rayDir, clipLayerDst(spans[i], 0.0, nearEnd), depth, cosTheta, phaseVal, lightEnergy, transmittance);
+#else
+		marchCloudLayer(rayDir, spans[i], depth, cosTheta, phaseVal, lightEnergy, transmittance);
+#endif
+	}
+#elif defined(FAR_IMPOSTOR)
+	marchCloudLayer(rayDir, clipLayerDst(boxDist, 0.0, nearEnd), depth, cosTheta, phaseVal, lightEnergy, transmittance);
+#else
+	marchCloudLayer(rayDir, boxDist, depth, cosTheta, phaseVal, lightEnergy, transmittance);
+#endif
+#ifdef FAR_IMPOSTOR
+	// The far clouds lie behind the near ones
+	if (cr.sky && transmittance >= 0.01) {
+		vec2 far = textureLod(farClouds, rayDir, 0.0).rg;
+		lightEnergy += transmittance * far.r;
+		transmittance *= far.g;
+	}
+#endif
+
+	vec3 bgCol;
+	if (cr.sky) {
+		bgCol = skySample(rayDir);
+	}
+	else {
+		bgCol = texture(bufferTex, cr.coords).rgb;
+	}
+	
+	vec3 cloudColFinal = lightEnergy * cloudCol;
+	vec3 col = max(vec3(0.0),min(vec3(1.0),bgCol * transmittance + cloudColFinal));
+	return vec4(col, 1.0);
+}
+
+#ifdef PROGRESSIVE
+// Folds this frame's colour into the pixel's running average and returns the average
+vec4 accumulateFrame(ivec2 pixel, vec4 colour)
+{
+	vec4 history = accumulatedFrames > 0 ? imageLoad(historyTex, pixel) : colour;
+	vec4 average = mix(history, colour, 1.0 / float(accumulatedFrames + 1));
+	imageStore(historyTex, pixel, average);
+	return average;
+}
+#endif
@@ -0,0 +1,65 @@
+#version 430
+
+// Cloud shadow map for the terrain, one texel per invocation. Each texel is a
+// point on the plane at the bottom of the cloud layer. It stores the optical
+// depth of the clouds between that point and the sun. MountainFS projects the
+// terrain along lightDir onto the plane and reads the depth there, so shading
+// the terrain costs one fetch per fragment instead of a march. Terrain inside
+// the layer takes the share of the depth above it.
+//
+// Compiled with the same variant defines as the cloud shaders, so the shadows
+// follow the density the clouds are drawn with. Rows from rowOffset are
+// written, so the renderer can spread an update over several frames.
+
+#include "CloudRaymarch.glsl"
+
+#define SHADOW_STEPS 32
+
+writeonly uniform image2D shadowMap;
+
+// XZ extent of the map on the plane y = shadowPlane
+uniform vec2 shadowMin;
+uniform vec2 shadowMax;
+uniform float shadowPlane;
+uniform int rowOffset;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// Optical depth along the ray through the current cloud layer, layerDst as
+// returned by cloudLayerDst
+float shadowDepth(Ray ray, vec2 layerDst) {
+	float stepSize = layerDst.y / float(SHADOW_STEPS);
+	float totalDensity = 0.0;
+	for (int step = 0; step < SHADOW_STEPS; step++) {
+		vec3 samplePos = ray.origin + ray.direction * (layerDst.x + (float(step) + 0.5) * stepSize);
+		totalDensity += max(0.0, sampleDensity(samplePos) * stepSize);
+	}
+	return totalDensity;
+}
+
+void main()
+{
+	ivec2 size = imageSize(shadowMap);
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy) + ivec2(0, rowOffset);
+	if (any(greaterThanEqual(p, size))) {
+		return;
+	}
+
+	setupCloudFrame();
+
+	vec2 planePos = mix(shadowMin, shadowMax, (vec2(p) + 0.5) / vec2(size));
+	Ray ray = Ray(vec3(planePos.x, shadowPlane, planePos.y), lightDir);
+
+	float totalDensity = 0.0;
+#ifdef CLOUD_VOLUMES
+	vec2 spans[MAX_RAY_VOLUMES];
+	int spanCount = findRaySpans(ray, 1e30, spans);
+	for (int i = 0; i < spanCount; i++) {
+		totalDensity += shadowDepth(ray, spans[i]);
+	}
+#else
+	totalDensity = shadowDepth(ray, cloudLayerDst(ray));
+#endif
+
+	imageStore(shadowMap, p, vec4(totalDensity));
+}
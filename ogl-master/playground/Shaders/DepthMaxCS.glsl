@@ -0,0 +1,34 @@
+#version 430
+
+// Farthest depth in each tile of the terrain depth buffer, one tile per
+// invocation. TerrainCuller reads the result back and treats anything whose
+// nearest depth lies behind a tile's farthest depth as hidden.
+
+uniform sampler2D depthTex;
+writeonly uniform image2D maxDepth;
+
+uniform int tileSize;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+void main()
+{
+	ivec2 tile = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(tile, imageSize(maxDepth)))) {
+		return;
+	}
+
+	// Tiles overhanging the screen edge only cover the pixels that exist
+	ivec2 size = textureSize(depthTex, 0);
+	ivec2 start = tile * tileSize;
+	ivec2 end = min(start + tileSize, size);
+
+	float depth = 0.0;
+	for (int y = start.y; y < end.y; y++) {
+		for (int x = start.x; x < end.x; x++) {
+			depth = max(depth, texelFetch(depthTex, ivec2(x, y), 0).r);
+		}
+	}
+
+	imageStore(maxDepth, tile, vec4(depth));
+}
@@ -0,0 +1,70 @@
+#version 430
+
+// Linear depth and a min/max depth pyramid from the terrain depth buffer, so
+// the cloud passes read view distances directly instead of linearising depth
+// per pixel.
+//   level 0  reads depthTex, writes linearDepth at full resolution and the
+//            bounds of each 2x2 pixel block to level 0 of depthBounds, which
+//            is half the resolution rounded up
+//   level n  reduces 2x2 texels of level n - 1 of depthBounds
+// Sky pixels are stored as exactly zFar, which is how the cloud passes tell
+// them apart from the terrain.
+
+uniform int level;
+uniform float zNear;
+uniform float zFar;
+
+uniform sampler2D depthTex;
+uniform sampler2D depthBoundsTex;
+writeonly uniform image2D linearDepth;
+writeonly uniform image2D depthBounds;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+float lineariseDepth(float depth)
+{
+	if (depth == 1.0) {
+		return zFar;
+	}
+	float z_n = 2.0 * depth - 1.0;
+	return 2.0 * zNear * zFar / (zFar + zNear - z_n * (zFar - zNear));
+}
+
+void main()
+{
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, imageSize(depthBounds)))) {
+		return;
+	}
+
+	// Each texel covers a 2x2 block of the level below. Sizes round down, so
+	// the last row and column also take an odd row or column left over.
+	ivec2 size = level == 0 ? textureSize(depthTex, 0) : textureSize(depthBoundsTex, level - 1);
+	ivec2 last = imageSize(depthBounds) - 1;
+	ivec2 start = p * 2;
+	ivec2 end = min(start + 1, size - 1);
+	if (p.x == last.x) {
+		end.x = size.x - 1;
+	}
+	if (p.y == last.y) {
+		end.y = size.y - 1;
+	}
+
+	// x is the nearest distance, y the farthest
+	vec2 bounds = vec2(zFar, 0.0);
+	for (int y = start.y; y <= end.y; y++) {
+		for (int x = start.x; x <= end.x; x++) {
+			if (level == 0) {
+				float depth = lineariseDepth(texelFetch(depthTex, ivec2(x, y), 0).r);
+				imageStore(linearDepth, ivec2(x, y), vec4(depth));
+				bounds = vec2(min(bounds.x, depth), max(bounds.y, depth));
+			}
+			else {
+				vec2 below = texelFetch(depthBoundsTex, ivec2(x, y), level - 1).rg;
+				bounds = vec2(min(bounds.x, below.x), max(bounds.y, below.y));
+			}
+		}
+	}
+
+	imageStore(depthBounds, p, vec4(bounds, 0.0, 0.0));
+}
@@ -0,0 +1,55 @@
+#version 430
+
+// Feature points of the Worley octaves of one noise volume, one invocation per
+// cell (see NoiseGenerator). WorleyCS.glsl reads them from the table instead of
+// hashing all 27 neighbour cells of every voxel, so the hash runs once per cell
+// rather than tens of times per voxel. Octave i owns the entries
+// [octaveCellOffset[i], octaveCellOffset[i] + octaveFrequency[i]^3) with x
+// varying fastest; Perlin octaves own none.
+
+#define MAX_OCTAVES 8
+
+layout(local_size_x = 64) in;
+
+layout(std430, binding = 0) writeonly buffer FeaturePoints {
+	vec4 featurePoints[];
+};
+
+uniform int octaveCount;
+uniform int octaveType[MAX_OCTAVES];
+uniform int octaveFrequency[MAX_OCTAVES];
+uniform int octaveSeed[MAX_OCTAVES];
+uniform int octaveCellOffset[MAX_OCTAVES];
+uniform int cellCount;
+
+uniform float evolution;
+
+#include "NoiseHash.glsl"
+
+// Each feature point loops around its static position, so the noise repeats
+// with every whole step of evolution. It is held inside its cell, as WorleyCS
+// only searches the neighbouring cells for the nearest point.
+vec3 featurePoint(ivec3 cell, int seed)
+{
+	vec3 h = intHash3(cell, seed);
+	vec3 phase = 6.2831853 * h.zxy;
+	return clamp(h + 0.15 * (sin(6.2831853 * evolution + phase) - sin(phase)), 0.0, 1.0);
+}
+
+void main()
+{
+	int index = int(gl_GlobalInvocationID.x);
+	if (index >= cellCount) {
+		return;
+	}
+
+	for (int i = 0; i < octaveCount; i++) {
+		int frequency = octaveFrequency[i];
+		int local = index - octaveCellOffset[i];
+		if (octaveType[i] == 1 && local >= 0 && local < frequency * frequency * frequency) {
+			ivec3 cell = ivec3(local % frequency, (local / frequency) % frequency, local / (frequency * frequency));
+			featurePoints[index] = vec4(featurePoint(cell, octaveSeed[i]), 0.0);
+			return;
+		}
+	}
+}
@@ -0,0 +1,19 @@
+// Integer hashes shared by the noise shaders, included by NoiseCellsCS.glsl,
+// WorleyCS.glsl and WeatherCS.glsl so their cells hash alike.
+
+// PCG3D from Jarzynski and Olano, "Hash Functions for GPU Rendering"
+uvec3 pcg3d(uvec3 v)
+{
+	v = v * 1664525u + 1013904223u;
+	v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+	v ^= v >> 16u;
+	v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+	return v;
+}
+
+// Three values in [0, 1) for an integer cell
+vec3 intHash3(ivec3 cell, int seed)
+{
+	uvec3 h = pcg3d(uvec3(cell) ^ uvec3(uint(seed) * 0x9E3779B9u));
+	return vec3(h >> 8u) * (1.0 / 16777216.0);
+}
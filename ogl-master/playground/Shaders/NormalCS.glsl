@@ -0,0 +1,47 @@
+#version 430
+
+// Terrain normals from the heightmap, one texel per invocation.
+// Output is the X and Y of the unit normal in the layout MountainFS expects
+// (X along U, Y against V, Z up); Z is rebuilt when sampling.
+
+uniform sampler2D heightMap;
+writeonly uniform image2D normalMap;
+
+// Slope scale in heights per UV unit. Matches the normal map that used to be
+// baked offline for the 512x512 heightmap.
+uniform float normalStrength;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// Wraps like the GL_REPEAT sampling of the terrain, so the seams match.
+// Taps are at most one texel outside.
+float height(ivec2 p, ivec2 size)
+{
+	return texelFetch(heightMap, (p + size) % size, 0).r;
+}
+
+void main()
+{
+	ivec2 size = textureSize(heightMap, 0);
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, size))) {
+		return;
+	}
+
+	// 3x3 Sobel, less noisy than plain central differences
+	float h00 = height(p + ivec2(-1, -1), size);
+	float h10 = height(p + ivec2( 0, -1), size);
+	float h20 = height(p + ivec2( 1, -1), size);
+	float h01 = height(p + ivec2(-1,  0), size);
+	float h21 = height(p + ivec2( 1,  0), size);
+	float h02 = height(p + ivec2(-1,  1), size);
+	float h12 = height(p + ivec2( 0,  1), size);
+	float h22 = height(p + ivec2( 1,  1), size);
+
+	float dhdu = ((h20 + 2.0*h21 + h22) - (h00 + 2.0*h01 + h02)) / 8.0 * float(size.x);
+	float dhdv = ((h02 + 2.0*h12 + h22) - (h00 + 2.0*h10 + h20)) / 8.0 * float(size.y);
+
+	vec3 normal = normalize(vec3(normalStrength * dhdu, -normalStrength * dhdv, 1.0));
+
+	imageStore(normalMap, p, vec4(0.5 + 0.5*normal.xy, 0.0, 1.0));
+}
@@ -0,0 +1,21 @@
+#version 430 core
+
+// Chunked LOD terrain, the position is already displaced by the heightmap
+layout(location = 0) in vec3 vertexPosition_modelspace;
+
+// Values that stay constant for the whole mesh.
+uniform mat4 MVP;
+uniform mat4 M;
+
+out vec2 UV;
+out vec3 worldPos;
+
+void main(){
+
+	// Same mapping as terrain.obj once loadOBJ has negated V
+	UV = vec2(vertexPosition_modelspace.x + 1.0, vertexPosition_modelspace.z - 1.0) * 0.5;
+	worldPos = (M * vec4(vertexPosition_modelspace, 1.0)).xyz;
+
+	// Output position of the vertex, in clip space : MVP * position
+	gl_Position = MVP * vec4(vertexPosition_modelspace, 1.0);
+}
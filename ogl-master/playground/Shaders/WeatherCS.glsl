@@ -0,0 +1,65 @@
+#version 430
+
+// Weather map over the XZ extent of the cloud box, one texel per invocation.
+//   red    coverage, 0 where a column holds no cloud at all
+//   green  cloud type, picks the height profile row in heightProfileTex
+// Both are octaves of value noise, coverage thresholded so that more of the
+// map is covered as the coverage setting rises.
+
+writeonly uniform image2D weatherMap;
+
+// How much of the map is under cloud, 0 to 1
+uniform float coverage;
+// Noise cells across the map for the first octave
+uniform float featureScale;
+uniform int seed;
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+#include "NoiseHash.glsl"
+
+float hash(ivec2 cell, int layer)
+{
+	return float(pcg3d(uvec3(ivec3(cell, seed * 2 + layer))).x >> 8u) * (1.0 / 16777216.0);
+}
+
+float valueNoise(vec2 p, int layer)
+{
+	ivec2 pInt = ivec2(floor(p));
+	vec2 f = fract(p);
+	f = f * f * (3.0 - 2.0 * f);
+	return mix(
+		mix(hash(pInt, layer), hash(pInt + ivec2(1, 0), layer), f.x),
+		mix(hash(pInt + ivec2(0, 1), layer), hash(pInt + ivec2(1, 1), layer), f.x),
+		f.y);
+}
+
+float fbm(vec2 p, int layer)
+{
+	float sum = 0.0;
+	float weight = 0.5;
+	for (int i = 0; i < 4; i++) {
+		sum += weight * valueNoise(p, layer);
+		p *= 2.0;
+		weight *= 0.5;
+	}
+	return sum / 0.9375;
+}
+
+void main()
+{
+	ivec2 size = imageSize(weatherMap);
+	ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+	if (any(greaterThanEqual(p, size))) {
+		return;
+	}
+
+	vec2 uv = (vec2(p) + 0.5) / vec2(size) * featureScale;
+
+	// Full and zero coverage push the threshold band past either end of the fbm range
+	float threshold = mix(1.1, -0.1, coverage);
+	float covered = smoothstep(threshold - 0.1, threshold + 0.1, fbm(uv, 0));
+	float type = fbm(uv * 0.5, 1);
+
+	imageStore(weatherMap, p, vec4(covered, type, 0.0, 0.0));
+}
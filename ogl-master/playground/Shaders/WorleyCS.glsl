@@ -1,114 +1,109 @@
 #version 430
 
-writeonly uniform image3D destTex;
-writeonly uniform image3D detailTex;
-layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
-
-mat3 matR = mat3(56., 37., 81., -26., -49., 66., 29., -34., 48.);
-mat3 matG = mat3(73., 39., 28., -14.,  92., 24., -13., -87., 26.);
-mat3 matB = mat3(58., 42., 41., 67., -25., -59., -29., 47., 92.);
-mat3 matRd = mat3(-38., 36., -45., 28., 96., 34., 54., -24., 53.);
-mat3 matGd = mat3(33., -35., 52., 34., 25., -82., 63., 84., -26.);
-mat3 matBd = mat3(-21., 33., -84., 48., -66., -35., -79., 73., 43.);
-
-
-vec3 hash3(int pX, int pY, int pZ, mat3 hashMat)
-{
-	return fract(28.9 * cos(vec3(pX, pY, pZ) * hashMat));
-}
+// One block of a noise volume per dispatch, one voxel per invocation (see NoiseGenerator).
+// The value is a weighted sum of tiling octaves, octave i weighted by
+// persistence^i, normalised and inverted so the Worley cells are bright:
+//   octaveType       0 Perlin, 1 Worley
+//   octaveFrequency  cells across the volume, so the noise tiles and keeps its
+//                    shape at any volume size
+//   octaveSeed       picks the hash; for Worley octaves seeds 0-5 are the
+//                    original hashes
+// Worley feature points come from the table NoiseCellsCS.glsl fills first, and
+// Perlin gradients from an integer hash, so no voxel evaluates a cosine.
+// Each dispatch writes the regionSize block of the volume starting at voxel
+// regionOrigin to destTex at destOffset. Voxels outside the volume wrap, so
+// NoiseEvolver can write a few slices per frame and VirtualNoise single pages
+// with their aprons.
+
+#define MAX_OCTAVES 8
 
-vec3 hash3(vec3 p)
+writeonly uniform image3D destTex;
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+uniform int octaveCount;
+uniform int octaveType[MAX_OCTAVES];
+uniform int octaveFrequency[MAX_OCTAVES];
+uniform int octaveSeed[MAX_OCTAVES];
+uniform int octaveCellOffset[MAX_OCTAVES];
+uniform float persistence;
+
+uniform ivec3 regionOrigin;
+uniform ivec3 regionSize;
+uniform ivec3 destOffset;
+// Voxels along each side of the whole volume
+uniform int volumeSize;
+
+// Written by NoiseCellsCS.glsl for this volume
+layout(std430, binding = 0) readonly buffer FeaturePoints {
+	vec4 featurePoints[];
+};
+
+#include "NoiseHash.glsl"
+
+// Cells are at most one outside the volume
+ivec3 wrapCell(ivec3 cell, int frequency)
 {
-    return hash3(int(p.x), int(p.y), int(p.z), matR);
+	return cell + frequency * (ivec3(lessThan(cell, ivec3(0))) - ivec3(greaterThanEqual(cell, ivec3(frequency))));
 }
 
-float Perlin(vec3 p)
+float Perlin(vec3 p, int frequency, int seed)
 {
-
-    vec3 pInt = floor(p);
-    vec3 pFrac = fract(p);
-
-    vec3 w = pFrac * pFrac * (3.0 - 2.0 * pFrac);
-
-    return 	mix(
-        mix(
-            mix(dot(pFrac - vec3(0, 0, 0), hash3(pInt + vec3(0, 0, 0))),
-                dot(pFrac - vec3(1, 0, 0), hash3(pInt + vec3(1, 0, 0))),
-                w.x),
-            mix(dot(pFrac - vec3(0, 0, 1), hash3(pInt + vec3(0, 0, 1))),
-                dot(pFrac - vec3(1, 0, 1), hash3(pInt + vec3(1, 0, 1))),
-                w.x),
-            w.z),
-        mix(
-            mix(dot(pFrac - vec3(0, 1, 0), hash3(pInt + vec3(0, 1, 0))),
-                dot(pFrac - vec3(1, 1, 0), hash3(pInt + vec3(1, 1, 0))),
-                w.x),
-            mix(dot(pFrac - vec3(0, 1, 1), hash3(pInt + vec3(0, 1, 1))),
-                dot(pFrac - vec3(1, 1, 1), hash3(pInt + vec3(1, 1, 1))),
-                w.x),
-            w.z),
-        w.y);
+	ivec3 pInt = ivec3(floor(p));
+	vec3 pFrac = fract(p);
+
+	vec3 w = pFrac * pFrac * (3.0 - 2.0 * pFrac);
+
+	float corners[8];
+	for (int i = 0; i < 8; i++) {
+		ivec3 corner = ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+		vec3 gradient = 2.0 * intHash3(wrapCell(pInt + corner, frequency), seed) - 1.0;
+		corners[i] = dot(pFrac - vec3(corner), gradient);
+	}
+	return mix(
+		mix(mix(corners[0], corners[1], w.x), mix(corners[4], corners[5], w.x), w.z),
+		mix(mix(corners[2], corners[3], w.x), mix(corners[6], corners[7], w.x), w.z),
+		w.y);
 }
 
-float Worley(vec3 p, mat3 hashMat, int wrapFac)
+float Worley(vec3 p, int frequency, int cellOffset)
 {
-    float scale = 128. / float(wrapFac);
-    p /= scale;
-
-    float dist = 1.0;
-    vec3 pInt = floor(p);
-    vec3 pFrac = fract(p);
-
-    for (int x = -1; x <= 1; x++)
-    for (int y = -1; y <= 1; y++)
-    for (int z = -1; z <= 1; z++)
-    {
-        int newX = int((pInt + vec3(x, y, z)).x);
-        int newY = int((pInt + vec3(x, y, z)).y);
-        int newZ = int((pInt + vec3(x, y, z)).z);
-
-        if (newX < 0) newX = wrapFac-1;
-        if (newY < 0) newY = wrapFac - 1;
-        if (newZ < 0) newZ = wrapFac - 1;
-        if (newX >= wrapFac) newX = 0;
-        if (newY >= wrapFac) newY = 0;
-        if (newZ >= wrapFac) newZ = 0;
-        float pDist = distance(hash3(newX, newY, newZ, hashMat) + vec3(x, y, z), pFrac);
-        dist = min(dist, pDist);
-    }
-    return dist;
+	float dist = 1.0;
+	ivec3 pInt = ivec3(floor(p));
+	vec3 pFrac = fract(p);
+
+	for (int x = -1; x <= 1; x++)
+	for (int y = -1; y <= 1; y++)
+	for (int z = -1; z <= 1; z++)
+	{
+		ivec3 cell = wrapCell(pInt + ivec3(x, y, z), frequency);
+		vec3 point = featurePoints[cellOffset + (cell.z * frequency + cell.y) * frequency + cell.x].xyz;
+		float pDist = distance(point + vec3(x, y, z), pFrac);
+		dist = min(dist, pDist);
+	}
+	return dist;
 }
 
 void main()
 {
-	ivec3 storePos = ivec3(gl_GlobalInvocationID);
-
-    float persistance = 0.75;
-    float maxVal = 1 + (persistance)+(persistance * persistance);
-
-    float noiseSum = 1.0 * Perlin(storePos) +
-        persistance * Worley(storePos, matG, 6) +
-        persistance * persistance * Worley(storePos, matB, 10);
-
-    float noiseSumD = Worley(storePos, matRd, 10) +
-        persistance * Worley(storePos, matGd, 13) +
-        persistance * persistance * Worley(storePos, matBd, 16);
-
-    // keep inside range [0,1] as will be clamped in texture
-    noiseSum /= maxVal;
-    noiseSum = 1 - noiseSum;
-    noiseSum = max(0.0,min(1.0,(noiseSum)));
-
-    noiseSumD /= maxVal;
-    noiseSumD = 1 - noiseSumD;
-    noiseSumD = max(0.0, min(1.0, (noiseSumD)));
-
-	imageStore(destTex, storePos, vec4(vec3(noiseSum), 1.0));
-
-    if (storePos.x % 2 == 1 || storePos.y % 2 == 1 || storePos.z % 2 == 1) {
-        return;
-    }
-    storePos /= 2;
-
-    imageStore(detailTex, storePos, vec4(vec3(noiseSumD), 1.0));
+	ivec3 id = ivec3(gl_GlobalInvocationID);
+	if (any(greaterThanEqual(id, regionSize))) {
+		return;
+	}
+	ivec3 voxel = (regionOrigin + id + volumeSize) % volumeSize;
+
+	float noiseSum = 0.0;
+	float maxVal = 0.0;
+	float weight = 1.0;
+	for (int i = 0; i < octaveCount; i++) {
+		vec3 p = vec3(voxel * octaveFrequency[i]) / float(volumeSize);
+		float octave = octaveType[i] == 0 ? Perlin(p, octaveFrequency[i], octaveSeed[i]) : Worley(p, octaveFrequency[i], octaveCellOffset[i]);
+		noiseSum += weight * octave;
+		maxVal += weight;
+		weight *= persistence;
+	}
+
+	// keep inside range [0,1] as will be clamped in texture
+	noiseSum = clamp(1.0 - noiseSum / maxVal, 0.0, 1.0);
+
+	imageStore(destTex, destOffset + id, vec4(vec3(noiseSum), 1.0));
 }
@@ -7,14 +7,39 @@ uniform sampler2D normalMap;
 
 uniform vec3 lightDir;
 
+// Optical depth of the clouds toward the sun from the plane y = shadowPlane at
+// the bottom of the layer to its top at shadowTop (CloudShadowCS.glsl)
+uniform bool cloudShadows;
+uniform sampler2D cloudShadowMap;
+uniform vec2 shadowMin;
+uniform vec2 shadowMax;
+uniform float shadowPlane;
+uniform float shadowTop;
+// Light that still gets through the thickest cloud, as in lightMarch
+uniform float baseTransmittance;
+
 in vec2 UV;
+in vec3 worldPos;
 
 void main() {
 
-	vec3 normal = -1.0+2.0*texture(normalMap, UV).rgb;
+	// The normal map keeps two components, the third is the positive rest of a unit vector
+	vec2 xy = -1.0+2.0*texture(normalMap, UV).rg;
+	vec3 normal = vec3(xy, sqrt(max(0.0, 1.0-dot(xy, xy))));
 	normal = vec3(-normal.r, normal.bg);
 
 	float sunAngle = 0.5+ 0.5*dot(normalize(normal), vec3(lightDir));
 
-	fragColor = vec4(sunAngle* texture(heightMap, UV).rgb*vec3(0.8,0.5,0.4), 1.0);
+	// Nothing above terrain at or over the top of the layer
+	if (cloudShadows && worldPos.y < shadowTop) {
+		// Where the ray toward the sun crosses the bottom of the cloud layer
+		vec3 planePos = worldPos + lightDir * ((shadowPlane - worldPos.y) / lightDir.y);
+		float depth = texture(cloudShadowMap, (planePos.xz - shadowMin) / (shadowMax - shadowMin)).r;
+		// Inside the layer only the part of the ray above the terrain counts,
+		// taking the density as even along it
+		depth *= min((shadowTop - worldPos.y) / (shadowTop - shadowPlane), 1.0);
+		sunAngle *= baseTransmittance + exp(-depth) * (1.0 - baseTransmittance);
+	}
+
+	fragColor = vec4(sunAngle* texture(heightMap, UV).rrr*vec3(0.8,0.5,0.4), 1.0);
 }
@@ -9,8 +9,10 @@ in vec3 mapPos[];
 
 // Values that stay constant for the whole mesh.
 uniform mat4 MVP;
+uniform mat4 M;
 
 out vec2 UV;
+out vec3 worldPos;
 
 vec2 interpolate2D(vec2 v0, vec2 v1, vec2 v2)
 {
@@ -28,6 +30,7 @@ void main(){
 	vec3 modelSpace = interpolate3D(mapPos[0], mapPos[1], mapPos[2]);
 
 	modelSpace.y += texture(heightMap, UV.xy).x;
+	worldPos = (M * vec4(modelSpace, 1.0)).xyz;
 
 	// Output position of the vertex, in clip space : MVP * position
 	gl_Position =  MVP * vec4(modelSpace,1.0);
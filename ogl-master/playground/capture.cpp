@@ -0,0 +1,238 @@
+#include "capture.h"
+
+#include <string.h>
+#include <chrono>
+
+#include <common/imagewrite.hpp>
+
+FrameCapture::FrameCapture() {
+	for (int i = 0; i < ringSize; i++) {
+		pbos[i] = 0;
+		fences[i] = 0;
+		slotFrame[i] = -1;
+	}
+	nextSlot = 0;
+
+	capturing = false;
+	y4m = false;
+	stream = NULL;
+	width = 0;
+	height = 0;
+	fps = 30;
+
+	framesCaptured = 0;
+	captureMsTotal = 0.0f;
+
+	stopWriter = false;
+	writeFailed = false;
+}
+
+FrameCapture::~FrameCapture() {
+	Stop();
+}
+
+bool FrameCapture::Start(const char* output, int width, int height, int fps) {
+	Stop();
+
+	this->output = output;
+	this->width = width;
+	this->height = height;
+	this->fps = fps;
+
+	y4m = this->output.size() > 4 && this->output.compare(this->output.size() - 4, 4, ".y4m") == 0;
+	if (y4m) {
+		stream = fopen(output, "wb");
+		if (!stream) {
+			printf("%s could not be opened for writing\n", output);
+			return false;
+		}
+		// 4:4:4 keeps full colour resolution and needs no chroma filtering
+		fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+	}
+
+	glGenBuffers(ringSize, pbos);
+	for (int i = 0; i < ringSize; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+		fences[i] = 0;
+		slotFrame[i] = -1;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	nextSlot = 0;
+
+	framesCaptured = 0;
+	captureMsTotal = 0.0f;
+
+	stopWriter = false;
+	writeFailed = false;
+	writer = std::thread(&FrameCapture::WriterLoop, this);
+
+	capturing = true;
+	return true;
+}
+
+bool FrameCapture::Stop() {
+	if (!capturing) {
+		return !writeFailed;
+	}
+	capturing = false;
+
+	// Oldest first so the writer receives frames in order
+	for (int i = 0; i < ringSize; i++) {
+		CollectFrame((nextSlot + i) % ringSize);
+	}
+	glDeleteBuffers(ringSize, pbos);
+
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopWriter = true;
+	}
+	queueChanged.notify_one();
+	writer.join();
+
+	if (stream) {
+		fclose(stream);
+		stream = NULL;
+	}
+	spareBuffers.clear();
+
+	if (writeFailed) {
+		printf("Capture to %s failed, not every frame was written\n", output.c_str());
+		return false;
+	}
+	printf("Captured %d frames to %s, %.3f ms/frame on the render thread\n", framesCaptured, output.c_str(), AverageCaptureMs());
+	return true;
+}
+
+// Maps the finished readback in slot and hands it to the writer.
+// Blocks only if the GPU is more than ringSize frames behind.
+void FrameCapture::CollectFrame(int slot) {
+	if (!fences[slot]) {
+		return;
+	}
+
+	glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	glDeleteSync(fences[slot]);
+	fences[slot] = 0;
+
+	Frame frame;
+	frame.index = slotFrame[slot];
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		if (!spareBuffers.empty()) {
+			frame.pixels.swap(spareBuffers.back());
+			spareBuffers.pop_back();
+		}
+	}
+	frame.pixels.resize(width * height * 4);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+	void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, width * height * 4, GL_MAP_READ_BIT);
+	if (mapped) {
+		memcpy(&frame.pixels[0], mapped, width * height * 4);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		queue.push_back(std::move(frame));
+	}
+	queueChanged.notify_one();
+}
+
+void FrameCapture::CaptureFrame(GLuint framebuffer) {
+	if (!capturing) {
+		return;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// The slot being reused holds the frame from ringSize frames ago, which has
+	// normally finished by now
+	int slot = nextSlot;
+	CollectFrame(slot);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slotFrame[slot] = framesCaptured;
+	nextSlot = (nextSlot + 1) % ringSize;
+
+	framesCaptured++;
+	captureMsTotal += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void FrameCapture::WriterLoop() {
+	while (true) {
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueChanged.wait(lock, [this] { return stopWriter || !queue.empty(); });
+			if (queue.empty()) {
+				return;
+			}
+			frame = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		if (!writeFailed && !WriteFrame(frame)) {
+			writeFailed = true;
+		}
+
+		std::lock_guard<std::mutex> lock(queueMutex);
+		spareBuffers.push_back(std::vector<unsigned char>());
+		spareBuffers.back().swap(frame.pixels);
+	}
+}
+
+bool FrameCapture::WriteFrame(const Frame& frame) {
+	const unsigned char* pixels = &frame.pixels[0];
+
+	if (!y4m) {
+		// Flip to top-down and drop alpha
+		std::vector<unsigned char> rgb(width * height * 3);
+		for (int y = 0; y < height; y++) {
+			const unsigned char* src = pixels + (height - 1 - y) * width * 4;
+			unsigned char* dst = &rgb[y * width * 3];
+			for (int x = 0; x < width; x++) {
+				dst[x * 3 + 0] = src[x * 4 + 0];
+				dst[x * 3 + 1] = src[x * 4 + 1];
+				dst[x * 3 + 2] = src[x * 4 + 2];
+			}
+		}
+
+		char path[512];
+		snprintf(path, sizeof(path), "%s%04d.png", output.c_str(), frame.index);
+		return writePNG(path, width, height, 3, &rgb[0]);
+	}
+
+	// BT.601 limited range, planes top-down
+	std::vector<unsigned char> planes(width * height * 3);
+	unsigned char* yPlane = &planes[0];
+	unsigned char* uPlane = yPlane + width * height;
+	unsigned char* vPlane = uPlane + width * height;
+	for (int y = 0; y < height; y++) {
+		const unsigned char* src = pixels + (height - 1 - y) * width * 4;
+		for (int x = 0; x < width; x++) {
+			int r = src[x * 4 + 0];
+			int g = src[x * 4 + 1];
+			int b = src[x * 4 + 2];
+			int i = y * width + x;
+			yPlane[i] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+			uPlane[i] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			vPlane[i] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+
+	fputs("FRAME\n", stream);
+	if (fwrite(&planes[0], 1, planes.size(), stream) != planes.size()) {
+		printf("%s: write failed\n", output.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+// Records the composited frame without stalling the render thread.
+// glReadPixels goes into a ring of pixel buffer objects and is mapped a few
+// frames later once its fence has signalled; a writer thread then encodes
+// the frames to a PNG sequence or a raw Y4M stream.
+
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <GL/glew.h>
+
+class FrameCapture {
+public:
+	FrameCapture();
+	~FrameCapture();
+
+	// output ending in .y4m writes one YUV 4:4:4 stream, anything else is a
+	// PNG prefix (<output>0000.png, ...). Needs a current GL context.
+	bool Start(const char* output, int width, int height, int fps);
+	// Collects the frames still in flight and waits for the writer to finish.
+	// Returns false if a frame of the last capture could not be written.
+	bool Stop();
+	bool IsCapturing() const { return capturing; };
+
+	// Queues a readback of the given framebuffer (0 is the back buffer).
+	// Call once per frame after the scene is composited.
+	void CaptureFrame(GLuint framebuffer);
+
+	// Render thread cost of CaptureFrame
+	float AverageCaptureMs() const { return framesCaptured ? captureMsTotal / framesCaptured : 0.0f; };
+	int FramesCaptured() const { return framesCaptured; };
+protected:
+	struct Frame {
+		int index;
+		std::vector<unsigned char> pixels;	// RGBA, rows bottom to top
+	};
+
+	void CollectFrame(int slot);
+	void WriterLoop();
+	bool WriteFrame(const Frame& frame);
+
+	static const int ringSize = 3;
+	GLuint pbos[ringSize];
+	GLsync fences[ringSize];
+	int slotFrame[ringSize];
+	int nextSlot;
+
+	bool capturing;
+	bool y4m;
+	std::string output;
+	FILE* stream;
+	int width;
+	int height;
+	int fps;
+
+	int framesCaptured;
+	float captureMsTotal;
+
+	std::thread writer;
+	std::mutex queueMutex;
+	std::condition_variable queueChanged;
+	std::deque<Frame> queue;
+	std::vector<std::vector<unsigned char> > spareBuffers;
+	bool stopWriter;
+	bool writeFailed;
+};
@@ -0,0 +1,693 @@
+#include "cloudreference.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+// Rays are shaded in packets of four with SSE2, which every x64 target has
+#include <emmintrin.h>
+
+#include <glm/gtc/constants.hpp>
+
+#include <common/imagewrite.hpp>
+
+#include "noisegen.h"
+
+CloudParams::CloudParams() {
+	time = 0.0f;
+
+	// Same defaults as Renderer::Initialize
+	numSteps = 0.25f;
+	numLightSteps = 8;
+	densityMult = 12.0f;
+	densityOfst = 0.7f;
+	baseTransmittance = 0.25f;
+	lightCol = glm::vec3(1.0f);
+	lightDir = glm::normalize(glm::vec3(0.5f, 1.0f, 0.5f));
+	cloudScale = glm::vec3(2.0f, 1.0f, 2.0f);
+	detailScale = 1.0f;
+	cloudSpeed = glm::vec3(0.01f, 0.0f, 0.007f);
+	detailSpeed = glm::vec3(-0.008f, 0.0f, 0.005f);
+	optFactor = 0.4f;
+
+	cloudMin = glm::vec3(-20.0, 0, -20.0);
+	cloudMax = glm::vec3(20.0, 8.0, 20.0);
+
+	skyCol = glm::vec3(0.58f, 0.66f, 0.81f);
+	cloudCol = glm::vec3(1.0f);
+
+	forwardScattering = 0.6f;
+	backScattering = 0.5f;
+	baseBrightness = 1.0f;
+	phaseFactor = 0.9f;
+
+	detailNoise = true;
+	geometryTail = true;
+
+	zNear = 0.1f;
+	zFar = 100.0f;
+
+	SetCamera(glm::vec3(3, 3, 3), 0.0f, 3.14f);
+}
+
+void CloudParams::SetCamera(glm::vec3 position, float verticalAngle, float horizontalAngle) {
+	// Matches computeMatricesFromInputs
+	camPos = position;
+	camDir = glm::vec3(
+		cos(verticalAngle) * sin(horizontalAngle),
+		sin(verticalAngle),
+		cos(verticalAngle) * cos(horizontalAngle)
+	);
+	camRight = glm::vec3(
+		sin(horizontalAngle - 3.14f / 2.0f),
+		0,
+		cos(horizontalAngle - 3.14f / 2.0f)
+	);
+}
+
+//-----------------------------------------------------------------------------
+// Noise generation, a direct port of NoiseCellsCS.glsl and WorleyCS.glsl for the
+// volumes NoiseGenerator makes by default
+
+static inline glm::uvec3 pcg3d(glm::uvec3 v) {
+	v = v * 1664525u + 1013904223u;
+	v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+	v ^= v >> 16u;
+	v.x += v.y * v.z; v.y += v.z * v.x; v.z += v.x * v.y;
+	return v;
+}
+
+static inline glm::vec3 intHash3(glm::ivec3 cell, int seed) {
+	glm::uvec3 h = pcg3d(glm::uvec3(cell) ^ glm::uvec3(unsigned(seed) * 0x9E3779B9u));
+	return glm::vec3(h >> 8u) * (1.0f / 16777216.0f);
+}
+
+// Static feature point, as NoiseCellsCS.glsl writes it at evolution 0
+static glm::vec3 featurePoint(glm::ivec3 cell, int seed) {
+	return intHash3(cell, seed);
+}
+
+// Cells are at most one outside the volume
+static inline glm::ivec3 wrapCell(glm::ivec3 cell, int frequency) {
+	for (int i = 0; i < 3; i++) {
+		if (cell[i] < 0) cell[i] += frequency;
+		if (cell[i] >= frequency) cell[i] -= frequency;
+	}
+	return cell;
+}
+
+static float Perlin(glm::vec3 p, int frequency, int seed) {
+	glm::ivec3 pInt = glm::ivec3(glm::floor(p));
+	glm::vec3 pFrac = glm::fract(p);
+
+	glm::vec3 w = pFrac * pFrac * (3.0f - 2.0f * pFrac);
+
+	float corners[8];
+	for (int i = 0; i < 8; i++) {
+		glm::ivec3 corner(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+		glm::vec3 gradient = 2.0f * intHash3(wrapCell(pInt + corner, frequency), seed) - 1.0f;
+		corners[i] = glm::dot(pFrac - glm::vec3(corner), gradient);
+	}
+	return glm::mix(
+		glm::mix(glm::mix(corners[0], corners[1], w.x), glm::mix(corners[4], corners[5], w.x), w.z),
+		glm::mix(glm::mix(corners[2], corners[3], w.x), glm::mix(corners[6], corners[7], w.x), w.z),
+		w.y);
+}
+
+static float Worley(glm::vec3 p, int frequency, const glm::vec3* points) {
+	float dist = 1.0f;
+	glm::ivec3 pInt = glm::ivec3(glm::floor(p));
+	glm::vec3 pFrac = glm::fract(p);
+
+	for (int x = -1; x <= 1; x++)
+	for (int y = -1; y <= 1; y++)
+	for (int z = -1; z <= 1; z++)
+	{
+		glm::ivec3 cell = wrapCell(pInt + glm::ivec3(x, y, z), frequency);
+		const glm::vec3& point = points[(cell.z * frequency + cell.y) * frequency + cell.x];
+		float pDist = glm::distance(point + glm::vec3(x, y, z), pFrac);
+		dist = glm::min(dist, pDist);
+	}
+	return dist;
+}
+
+// Feature points of every Worley octave, laid out like the table NoiseGenerator builds
+struct NoiseCells {
+	std::vector<glm::vec3> points;
+	std::vector<int> offsets;
+};
+
+static void BuildNoiseCells(const NoiseVolumeDesc& desc, NoiseCells& cells) {
+	cells.points.clear();
+	cells.offsets.clear();
+	for (size_t i = 0; i < desc.octaves.size(); i++) {
+		const NoiseOctave& octave = desc.octaves[i];
+		cells.offsets.push_back((int)cells.points.size());
+		if (octave.type != NOISE_WORLEY) {
+			continue;
+		}
+		int f = octave.frequency;
+		for (int z = 0; z < f; z++) {
+			for (int y = 0; y < f; y++) {
+				for (int x = 0; x < f; x++) {
+					cells.points.push_back(featurePoint(glm::ivec3(x, y, z), octave.seed));
+				}
+			}
+		}
+	}
+}
+
+static float NoiseValue(const NoiseVolumeDesc& desc, const NoiseCells& cells, glm::ivec3 storePos) {
+	float noiseSum = 0.0f;
+	float maxVal = 0.0f;
+	float weight = 1.0f;
+	for (size_t i = 0; i < desc.octaves.size(); i++) {
+		const NoiseOctave& octave = desc.octaves[i];
+		glm::vec3 p = glm::vec3(storePos * octave.frequency) / float(desc.size);
+		noiseSum += weight * (octave.type == NOISE_PERLIN ? Perlin(p, octave.frequency, octave.seed) :
+			Worley(p, octave.frequency, &cells.points[cells.offsets[i]]));
+		maxVal += weight;
+		weight *= desc.persistence;
+	}
+	return glm::clamp(1.0f - noiseSum / maxVal, 0.0f, 1.0f);
+}
+
+static void GenerateNoiseSlices(const NoiseVolumeDesc& desc, const NoiseCells& cells, NoiseVolume& volume, std::atomic<int>& nextSlice) {
+	for (int z = nextSlice++; z < volume.size; z = nextSlice++) {
+		for (int y = 0; y < volume.size; y++) {
+			for (int x = 0; x < volume.size; x++) {
+				volume.data[(z * volume.size + y) * volume.size + x] = NoiseValue(desc, cells, glm::ivec3(x, y, z));
+			}
+		}
+	}
+}
+
+static void GenerateNoiseVolume(const NoiseVolumeDesc& desc, NoiseVolume& volume, int threads) {
+	volume.size = desc.size;
+	volume.data.assign((size_t)desc.size * desc.size * desc.size, 0.0f);
+
+	NoiseCells cells;
+	BuildNoiseCells(desc, cells);
+
+	std::atomic<int> nextSlice(0);
+	std::vector<std::thread> workers;
+	for (int i = 1; i < threads; i++) {
+		workers.push_back(std::thread(GenerateNoiseSlices, std::cref(desc), std::cref(cells), std::ref(volume), std::ref(nextSlice)));
+	}
+	GenerateNoiseSlices(desc, cells, volume, nextSlice);
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+void GenerateReferenceNoise(NoiseVolume& worley, NoiseVolume& detail, int threads) {
+	GenerateNoiseVolume(defaultBaseNoise(), worley, threads);
+	GenerateNoiseVolume(defaultDetailNoise(), detail, threads);
+}
+
+static inline int wrapTexel(int i, int size) {
+	i %= size;
+	return i < 0 ? i + size : i;
+}
+
+float NoiseVolume::Sample(const glm::vec3& uvw) const {
+	glm::vec3 t = uvw * float(size) - 0.5f;
+	glm::vec3 t0 = glm::floor(t);
+	glm::vec3 f = t - t0;
+
+	int x0 = wrapTexel(int(t0.x), size), x1 = wrapTexel(x0 + 1, size);
+	int y0 = wrapTexel(int(t0.y), size), y1 = wrapTexel(y0 + 1, size);
+	int z0 = wrapTexel(int(t0.z), size), z1 = wrapTexel(z0 + 1, size);
+
+	const float* d = &data[0];
+	float c00 = glm::mix(d[(z0 * size + y0) * size + x0], d[(z0 * size + y0) * size + x1], f.x);
+	float c10 = glm::mix(d[(z0 * size + y1) * size + x0], d[(z0 * size + y1) * size + x1], f.x);
+	float c01 = glm::mix(d[(z1 * size + y0) * size + x0], d[(z1 * size + y0) * size + x1], f.x);
+	float c11 = glm::mix(d[(z1 * size + y1) * size + x0], d[(z1 * size + y1) * size + x1], f.x);
+	return glm::mix(glm::mix(c00, c10, f.y), glm::mix(c01, c11, f.y), f.z);
+}
+
+//-----------------------------------------------------------------------------
+// Four-wide SIMD types. Lanes are independent rays; masks select which lanes
+// an operation applies to, standing in for the shader's per-pixel branches.
+
+struct Mask4 {
+	__m128 v;
+	Mask4(__m128 m) : v(m) {}
+};
+
+struct Float4 {
+	__m128 v;
+	Float4() : v(_mm_setzero_ps()) {}
+	Float4(__m128 m) : v(m) {}
+	Float4(float s) : v(_mm_set1_ps(s)) {}
+};
+
+static inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+static inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+static inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+static inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+static inline Float4 min4(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+static inline Float4 max4(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+static inline Float4 sqrt4(Float4 a) { return _mm_sqrt_ps(a.v); }
+
+static inline Mask4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+static inline Mask4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+static inline Mask4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+static inline Mask4 operator==(Float4 a, Float4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+static inline Mask4 operator&(Mask4 a, Mask4 b) { return _mm_and_ps(a.v, b.v); }
+static inline Mask4 operator|(Mask4 a, Mask4 b) { return _mm_or_ps(a.v, b.v); }
+static inline Mask4 andNot(Mask4 a, Mask4 b) { return _mm_andnot_ps(a.v, b.v); }	// b & ~a
+static inline bool any(Mask4 m) { return _mm_movemask_ps(m.v) != 0; }
+static inline bool lane(Mask4 m, int i) { return (_mm_movemask_ps(m.v) >> i) & 1; }
+
+// m ? a : b per lane
+static inline Float4 select(Mask4 m, Float4 a, Float4 b) {
+	return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v));
+}
+
+// Transcendentals have no SSE2 instruction, evaluate them per lane
+template <typename F>
+static inline Float4 perLane(Float4 a, F f) {
+	alignas(16) float l[4];
+	_mm_store_ps(l, a.v);
+	for (int i = 0; i < 4; i++) {
+		l[i] = f(l[i]);
+	}
+	return _mm_load_ps(l);
+}
+
+static inline Float4 exp4(Float4 a) { return perLane(a, [](float x) { return expf(x); }); }
+
+struct Vec3x4 {
+	Float4 x, y, z;
+	Vec3x4() {}
+	Vec3x4(Float4 x_, Float4 y_, Float4 z_) : x(x_), y(y_), z(z_) {}
+	Vec3x4(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+};
+
+static inline Vec3x4 operator+(const Vec3x4& a, const Vec3x4& b) { return Vec3x4(a.x + b.x, a.y + b.y, a.z + b.z); }
+static inline Vec3x4 operator-(const Vec3x4& a, const Vec3x4& b) { return Vec3x4(a.x - b.x, a.y - b.y, a.z - b.z); }
+static inline Vec3x4 operator*(const Vec3x4& a, const Vec3x4& b) { return Vec3x4(a.x * b.x, a.y * b.y, a.z * b.z); }
+static inline Vec3x4 operator*(const Vec3x4& a, Float4 s) { return Vec3x4(a.x * s, a.y * s, a.z * s); }
+static inline Vec3x4 min4(const Vec3x4& a, const Vec3x4& b) { return Vec3x4(min4(a.x, b.x), min4(a.y, b.y), min4(a.z, b.z)); }
+static inline Vec3x4 max4(const Vec3x4& a, const Vec3x4& b) { return Vec3x4(max4(a.x, b.x), max4(a.y, b.y), max4(a.z, b.z)); }
+static inline Float4 dot4(const Vec3x4& a, const Vec3x4& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+// Trilinear lookup for four positions; the gathers are scalar, the blending is SIMD
+static Float4 SampleVolume4(const NoiseVolume& volume, const Vec3x4& uvw) {
+	const int size = volume.size;
+	const float* d = &volume.data[0];
+
+	Vec3x4 t = uvw * Float4(float(size)) - Vec3x4(glm::vec3(0.5f));
+	alignas(16) float tx[4], ty[4], tz[4];
+	_mm_store_ps(tx, t.x.v);
+	_mm_store_ps(ty, t.y.v);
+	_mm_store_ps(tz, t.z.v);
+
+	alignas(16) float fx[4], fy[4], fz[4];
+	alignas(16) float c[8][4];
+	for (int i = 0; i < 4; i++) {
+		float x0f = floorf(tx[i]), y0f = floorf(ty[i]), z0f = floorf(tz[i]);
+		fx[i] = tx[i] - x0f;
+		fy[i] = ty[i] - y0f;
+		fz[i] = tz[i] - z0f;
+
+		int x0 = wrapTexel(int(x0f), size), x1 = wrapTexel(x0 + 1, size);
+		int y0 = wrapTexel(int(y0f), size), y1 = wrapTexel(y0 + 1, size);
+		int z0 = wrapTexel(int(z0f), size), z1 = wrapTexel(z0 + 1, size);
+
+		c[0][i] = d[(z0 * size + y0) * size + x0];
+		c[1][i] = d[(z0 * size + y0) * size + x1];
+		c[2][i] = d[(z0 * size + y1) * size + x0];
+		c[3][i] = d[(z0 * size + y1) * size + x1];
+		c[4][i] = d[(z1 * size + y0) * size + x0];
+		c[5][i] = d[(z1 * size + y0) * size + x1];
+		c[6][i] = d[(z1 * size + y1) * size + x0];
+		c[7][i] = d[(z1 * size + y1) * size + x1];
+	}
+
+	Float4 wx = _mm_load_ps(fx), wy = _mm_load_ps(fy), wz = _mm_load_ps(fz);
+	Float4 corner[8];
+	for (int k = 0; k < 8; k++) {
+		corner[k] = _mm_load_ps(c[k]);
+	}
+	Float4 c00 = corner[0] + (corner[1] - corner[0]) * wx;
+	Float4 c10 = corner[2] + (corner[3] - corner[2]) * wx;
+	Float4 c01 = corner[4] + (corner[5] - corner[4]) * wx;
+	Float4 c11 = corner[6] + (corner[7] - corner[6]) * wx;
+	Float4 c0 = c00 + (c10 - c00) * wy;
+	Float4 c1 = c01 + (c11 - c01) * wy;
+	return c0 + (c1 - c0) * wz;
+}
+
+//-----------------------------------------------------------------------------
+// Raymarcher, mirroring CloudRaymarch.glsl
+
+// Per-frame values, the uniforms and globals of the shader
+struct MarchContext {
+	const CloudParams* params;
+	const NoiseVolume* worley;
+	const NoiseVolume* detail;
+	const ReferenceBackground* background;
+	int width;
+	int height;
+
+	glm::vec3 cloudScale;
+	glm::vec3 sampleAdjust;
+	glm::vec3 sampleAdjustDetail;
+	glm::vec3 camUp;
+	float fov;
+};
+
+// Returns (dstToBox, dstInsideBox). If ray misses box, dstInsideBox will be zero
+static void rayBoxDst4(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const Vec3x4& origin, const Vec3x4& direction,
+	Float4& dstToBox, Float4& dstInsideBox) {
+	Vec3x4 invDir(Float4(1.0f) / direction.x, Float4(1.0f) / direction.y, Float4(1.0f) / direction.z);
+	Vec3x4 t0 = (Vec3x4(boundsMin) - origin) * invDir;
+	Vec3x4 t1 = (Vec3x4(boundsMax) - origin) * invDir;
+	Vec3x4 tmin = min4(t0, t1);
+	Vec3x4 tmax = max4(t0, t1);
+
+	Float4 dstA = max4(max4(tmin.x, tmin.y), tmin.z);
+	Float4 dstB = min4(tmax.x, min4(tmax.y, tmax.z));
+
+	dstToBox = max4(Float4(0.0f), dstA);
+	dstInsideBox = max4(Float4(0.0f), dstB - dstToBox);
+}
+
+static Float4 sampleDensity4(const MarchContext& c, Vec3x4 samplePos, Mask4 active) {
+	const CloudParams& p = *c.params;
+
+	Vec3x4 edgeDst = min4(samplePos - Vec3x4(p.cloudMin), Vec3x4(p.cloudMax) - samplePos);
+	Float4 edgeFade = min4(min4(edgeDst.x, min4(edgeDst.y, edgeDst.z)), Float4(1.0f));
+
+	samplePos = samplePos * Vec3x4(c.cloudScale);
+	Vec3x4 detPos = samplePos;
+
+	samplePos = samplePos * Float4(0.03f) + Vec3x4(c.sampleAdjust);
+	Float4 sampled = min4(Float4(1.0f), (SampleVolume4(*c.worley, samplePos) - Float4(p.densityOfst)) * Float4(p.densityMult));
+	sampled = sampled * edgeFade;
+	if (p.detailNoise) {
+		Mask4 dense = active & (sampled > Float4(0.01f));
+		if (any(dense)) {
+			detPos = detPos * Float4(0.15f * p.detailScale) + Vec3x4(c.sampleAdjustDetail);
+			Float4 eroded = min4(Float4(1.0f), max4(Float4(0.0f), sampled - SampleVolume4(*c.detail, detPos)));
+			sampled = select(dense, eroded, sampled);
+		}
+	}
+	return sampled;
+}
+
+static Float4 lightMarch4(const MarchContext& c, Vec3x4 cloudPos, Mask4 active) {
+	const CloudParams& p = *c.params;
+
+	Float4 dstToBox, dstInBox;
+	rayBoxDst4(p.cloudMin, p.cloudMax, cloudPos, Vec3x4(p.lightDir), dstToBox, dstInBox);
+
+	Float4 stepSize = dstInBox / Float4(float(p.numLightSteps));
+	Float4 totalDensity(0.0f);
+
+	Vec3x4 lightStep = Vec3x4(p.lightDir) * stepSize;
+	for (int step = 0; step < p.numLightSteps; step++) {
+		cloudPos = cloudPos + lightStep;
+		totalDensity = totalDensity + max4(Float4(0.0f), sampleDensity4(c, cloudPos, active) * stepSize);
+	}
+
+	Float4 transmittance = exp4(Float4(0.0f) - totalDensity);
+	return Float4(p.baseTransmittance) + transmittance * Float4(1.0f - p.baseTransmittance);
+}
+
+// Henyey-Greenstein
+static float hg(float a, float g) {
+	float g2 = g * g;
+	return (1 - g2) / (4 * 3.1415f * powf(1 + g2 - 2 * g * (a), 1.5f));
+}
+
+static float phase(const CloudParams& p, const glm::vec3& rayDir) {
+	float a = glm::dot(rayDir, p.lightDir);
+	float blend = .5f;
+	float hgBlend = hg(a, p.forwardScattering) * (1 - blend) + hg(a, -p.backScattering) * blend;
+	return p.baseBrightness + hgBlend * p.phaseFactor;
+}
+
+static glm::vec3 skySample(const CloudParams& p, const glm::vec3& rayDir) {
+	float sun = glm::dot(rayDir, p.lightDir) * 0.5f + 0.5f;
+	sun = 0.5f + 0.5f * tanhf(100.0f * sun - 98.5f);
+	return glm::vec3(sun) * p.lightCol + glm::vec3(1 - sun) * p.skyCol;
+}
+
+// Shades four pixels given by their fragment coordinates (pixel centres, y up)
+static void shadePacket(const MarchContext& c, const float fragX[4], const float fragY[4], glm::vec3 result[4]) {
+	const CloudParams& p = *c.params;
+
+	// setupCloudRay
+	alignas(16) float nonLinDepth[4];
+	alignas(16) float rayDirX[4], rayDirY[4], rayDirZ[4];
+	glm::vec3 rayDirs[4];
+	glm::vec3 bufferCol[4];
+	for (int i = 0; i < 4; i++) {
+		nonLinDepth[i] = 1.0f;
+		bufferCol[i] = glm::vec3(0.0f);
+		if (c.background) {
+			const ReferenceBackground& bg = *c.background;
+			int bx = glm::clamp(int(fragX[i] / c.width * bg.width), 0, bg.width - 1);
+			int by = glm::clamp(int(fragY[i] / c.height * bg.height), 0, bg.height - 1);
+			nonLinDepth[i] = bg.depth[by * bg.width + bx];
+			bufferCol[i] = bg.colour[by * bg.width + bx];
+		}
+
+		glm::vec2 res(c.width, c.height);
+		glm::vec2 pp = (-res + 2.0f * glm::vec2(fragX[i], fragY[i])) / res.y;
+		pp *= c.fov;
+		pp.x *= (4.0f / 3.0f) / (res.x / res.y);
+
+		rayDirs[i] = glm::normalize(p.camRight * pp.x + c.camUp * -pp.y + p.camDir);
+		rayDirX[i] = rayDirs[i].x;
+		rayDirY[i] = rayDirs[i].y;
+		rayDirZ[i] = rayDirs[i].z;
+	}
+
+	Float4 zn = Float4(2.0f) * Float4(_mm_load_ps(nonLinDepth)) - Float4(1.0f);
+	Float4 depth = Float4(2.0f * p.zNear * p.zFar) / (Float4(p.zFar + p.zNear) - zn * Float4(p.zFar - p.zNear));
+
+	Vec3x4 rayDir(_mm_load_ps(rayDirX), _mm_load_ps(rayDirY), _mm_load_ps(rayDirZ));
+	Float4 cosTheta = dot4(Vec3x4(p.camDir), rayDir);
+
+	// shadeClouds
+	Float4 boxX, boxY;
+	rayBoxDst4(p.cloudMin, p.cloudMax, Vec3x4(p.camPos), rayDir, boxX, boxY);
+	Mask4 marching = andNot((boxY <= Float4(0.0f)) | (boxX * cosTheta > depth), Mask4(_mm_castsi128_ps(_mm_set1_epi32(-1))));
+
+	Float4 transmittance(1.0f);
+	Float4 lightEnergy(0.0f);
+
+	if (any(marching)) {
+		alignas(16) float phaseLanes[4];
+		for (int i = 0; i < 4; i++) {
+			phaseLanes[i] = phase(p, rayDirs[i]);
+		}
+		Float4 phaseVal = _mm_load_ps(phaseLanes);
+
+		Float4 stepSize(p.numSteps);
+		Float4 dstLimit = min4(depth - boxX * cosTheta, boxY);
+
+		Float4 dstTravelled(0.0f);
+		Float4 lastStepRoot(0.0f);
+
+		Mask4 running = marching;
+		while (true) {
+			running = running & (dstTravelled < dstLimit);
+			if (!any(running)) {
+				break;
+			}
+
+			Vec3x4 texPos = Vec3x4(p.camPos) + rayDir * (boxX + dstTravelled);
+			Float4 density = sampleDensity4(c, texPos, running);
+
+			lastStepRoot = select(density * lastStepRoot < Float4(0.0f), Float4(0.0f), lastStepRoot);
+
+			Mask4 dense = running & (density > Float4(0.01f));
+			if (any(dense)) {
+				Float4 lightTransmittance = lightMarch4(c, texPos, dense);
+				Float4 segment = stepSize + lastStepRoot * lastStepRoot;
+				lightEnergy = select(dense, lightEnergy + density * segment * transmittance * lightTransmittance * phaseVal, lightEnergy);
+				transmittance = select(dense, transmittance * exp4(Float4(0.0f) - density * segment), transmittance);
+
+				running = andNot(dense & (transmittance < Float4(0.01f)), running);
+			}
+
+			lastStepRoot = select(running, Float4(p.optFactor) * density, lastStepRoot);
+			dstTravelled = select(running, dstTravelled + stepSize + lastStepRoot * lastStepRoot, dstTravelled);
+		}
+
+		//geometry intersection
+		Mask4 tail = marching & (dstLimit < boxY);
+		if (p.geometryTail && any(tail)) {
+			Float4 tailStep = dstLimit - (dstTravelled - stepSize);
+
+			Vec3x4 texPos = Vec3x4(p.camPos) + rayDir * (boxX + dstLimit);
+			Float4 density = sampleDensity4(c, texPos, tail);
+
+			Mask4 dense = tail & (density > Float4(0.01f));
+			if (any(dense)) {
+				Float4 lightTransmittance = lightMarch4(c, texPos, dense);
+				lightEnergy = select(dense, lightEnergy + density * tailStep * transmittance * lightTransmittance, lightEnergy);
+				transmittance = select(dense, transmittance * exp4(Float4(0.0f) - density * tailStep), transmittance);
+			}
+		}
+	}
+
+	alignas(16) float transmittanceLanes[4], energyLanes[4];
+	_mm_store_ps(transmittanceLanes, transmittance.v);
+	_mm_store_ps(energyLanes, lightEnergy.v);
+	for (int i = 0; i < 4; i++) {
+		glm::vec3 bgCol = nonLinDepth[i] == 1.0f ? skySample(p, rayDirs[i]) : bufferCol[i];
+		if (!lane(marching, i)) {
+			result[i] = bgCol;
+			continue;
+		}
+		glm::vec3 cloudColFinal = energyLanes[i] * p.cloudCol;
+		result[i] = glm::clamp(bgCol * transmittanceLanes[i] + cloudColFinal, glm::vec3(0.0f), glm::vec3(1.0f));
+	}
+}
+
+// Tiles of 16x16 pixels, shaded as 2x2 quads so the rays in a packet stay coherent
+static const int referenceTileSize = 16;
+
+static void RenderTiles(const MarchContext& c, std::vector<glm::vec3>& image, std::atomic<int>& nextTile) {
+	int tilesX = (c.width + referenceTileSize - 1) / referenceTileSize;
+	int tilesY = (c.height + referenceTileSize - 1) / referenceTileSize;
+
+	for (int tile = nextTile++; tile < tilesX * tilesY; tile = nextTile++) {
+		int originX = (tile % tilesX) * referenceTileSize;
+		int originY = (tile / tilesX) * referenceTileSize;
+
+		for (int y = originY; y < originY + referenceTileSize && y < c.height; y += 2) {
+			for (int x = originX; x < originX + referenceTileSize && x < c.width; x += 2) {
+				float fragX[4], fragY[4];
+				int px[4], py[4];
+				for (int i = 0; i < 4; i++) {
+					px[i] = glm::min(x + (i & 1), c.width - 1);
+					py[i] = glm::min(y + (i >> 1), c.height - 1);
+					fragX[i] = px[i] + 0.5f;
+					fragY[i] = py[i] + 0.5f;
+				}
+
+				glm::vec3 result[4];
+				shadePacket(c, fragX, fragY, result);
+
+				// Image rows run top to bottom, fragment coordinates bottom to top
+				for (int i = 0; i < 4; i++) {
+					image[(c.height - 1 - py[i]) * c.width + px[i]] = result[i];
+				}
+			}
+		}
+	}
+}
+
+void RenderCloudReference(const CloudParams& params, const NoiseVolume& worley, const NoiseVolume& detail,
+	const ReferenceBackground* background, int width, int height, std::vector<glm::vec3>& image, int threads) {
+	MarchContext c;
+	c.params = &params;
+	c.worley = &worley;
+	c.detail = &detail;
+	c.background = background;
+	c.width = width;
+	c.height = height;
+
+	c.cloudScale = 1.0f / params.cloudScale;
+	c.sampleAdjust = params.time * params.cloudSpeed;
+	c.sampleAdjustDetail = params.time * params.detailSpeed;
+	c.camUp = glm::cross(params.camDir, params.camRight);
+	c.fov = tan(45.0f * 0.5f * (glm::pi<float>() / 180.0f));
+
+	image.assign(width * height, glm::vec3(0.0f));
+
+	std::atomic<int> nextTile(0);
+	std::vector<std::thread> workers;
+	for (int i = 1; i < threads; i++) {
+		workers.push_back(std::thread(RenderTiles, std::cref(c), std::ref(image), std::ref(nextTile)));
+	}
+	RenderTiles(c, image, nextTile);
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+int RunCloudReference(int argc, char* argv[]) {
+	if (argc < 1) {
+		printf("Usage: playground --reference <out.png|out.exr> [width height] [view 1-3]\n");
+		return 1;
+	}
+
+	const char* outputPath = argv[0];
+	int width = 640;
+	int height = 360;
+	int view = 0;
+	if (argc >= 3) {
+		width = atoi(argv[1]);
+		height = atoi(argv[2]);
+	}
+	if (argc >= 4) {
+		view = atoi(argv[3]);
+	}
+	if (width <= 0 || height <= 0) {
+		printf("Invalid size %dx%d\n", width, height);
+		return 1;
+	}
+
+	// Same camera presets as the View buttons in the settings menu
+	CloudParams params;
+	// There is no terrain, so match the renderer with "Draw Mountains" off,
+	// which also leaves out GEOMETRY_TAIL
+	params.geometryTail = false;
+	if (view == 1) {
+		params.SetCamera(glm::vec3(0, 5, 0), 0, 0);
+	}
+	else if (view == 2) {
+		params.SetCamera(glm::vec3(6, 0, 4), glm::pi<float>() / 8.0f, -5.0f * glm::pi<float>() / 8.0f);
+	}
+	else if (view == 3) {
+		params.SetCamera(glm::vec3(35, 40, 15), -2.0f * glm::pi<float>() / 8.0f, -5.0f * glm::pi<float>() / 8.0f);
+	}
+
+	int threads = glm::max(1, (int)std::thread::hardware_concurrency());
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	NoiseVolume worley, detail;
+	GenerateReferenceNoise(worley, detail, threads);
+	std::chrono::steady_clock::time_point noiseDone = std::chrono::steady_clock::now();
+
+	std::vector<glm::vec3> image;
+	RenderCloudReference(params, worley, detail, NULL, width, height, image, threads);
+	std::chrono::steady_clock::time_point renderDone = std::chrono::steady_clock::now();
+
+	printf("Noise %.2f s, render %dx%d %.2f s on %d threads\n",
+		std::chrono::duration<float>(noiseDone - start).count(), width, height,
+		std::chrono::duration<float>(renderDone - noiseDone).count(), threads);
+
+	std::string path = outputPath;
+	bool written;
+	if (path.size() > 4 && path.compare(path.size() - 4, 4, ".exr") == 0) {
+		written = writeEXR(outputPath, width, height, &image[0].x);
+	}
+	else {
+		// Quantise like the RGBA8 framebuffer
+		std::vector<unsigned char> pixels(width * height * 3);
+		for (size_t i = 0; i < image.size(); i++) {
+			for (int k = 0; k < 3; k++) {
+				pixels[i * 3 + k] = (unsigned char)(glm::clamp(image[i][k], 0.0f, 1.0f) * 255.0f + 0.5f);
+			}
+		}
+		written = writePNG(outputPath, width, height, 3, &pixels[0]);
+	}
+	return written ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+// CPU reference implementation of the cloud pipeline (WorleyCS.glsl and
+// CloudRaymarch.glsl). It needs no OpenGL, so golden images for checking GPU
+// optimizations can be rendered on machines without a GPU.
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Cloud settings, mirroring the Renderer's uniform values and defaults
+struct CloudParams {
+	CloudParams();
+
+	glm::vec3 camPos;
+	glm::vec3 camDir;
+	glm::vec3 camRight;
+	float time;
+
+	float numSteps;
+	int numLightSteps;
+	float densityMult;
+	float densityOfst;
+	float baseTransmittance;
+	glm::vec3 lightCol;
+	glm::vec3 lightDir;
+	glm::vec3 skyCol;
+	glm::vec3 cloudCol;
+	glm::vec3 cloudScale;	// UI value, the shader receives 1 / cloudScale
+	float detailScale;
+	glm::vec3 cloudSpeed;
+	glm::vec3 detailSpeed;
+	float optFactor;
+	float forwardScattering;
+	float backScattering;
+	float baseBrightness;
+	float phaseFactor;
+	glm::vec3 cloudMin;
+	glm::vec3 cloudMax;
+
+	// Shader permutations (see Renderer::CloudVariantDefines)
+	bool detailNoise;
+	bool geometryTail;
+
+	float zNear;
+	float zFar;
+
+	// Camera angles as used by the controls
+	void SetCamera(glm::vec3 position, float verticalAngle, float horizontalAngle);
+};
+
+// Cubic RGBA32F noise volume, only the red channel is stored
+struct NoiseVolume {
+	int size;
+	std::vector<float> data;
+
+	// Trilinear lookup with GL_REPEAT wrapping, like texture() on the GPU
+	float Sample(const glm::vec3& uvw) const;
+};
+
+// Generates the default 128^3 base and 64^3 detail noise of NoiseGenerator
+void GenerateReferenceNoise(NoiseVolume& worley, NoiseVolume& detail, int threads);
+
+// Scene behind the clouds. depth holds window-space depth in [0,1], 1 is sky.
+// Rows are bottom to top, like glReadPixels.
+struct ReferenceBackground {
+	int width;
+	int height;
+	std::vector<float> depth;
+	std::vector<glm::vec3> colour;
+};
+
+// Renders the clouds into image (RGB, rows top to bottom). Without a background
+// the whole frame is sky, as with "Draw Mountains" turned off.
+void RenderCloudReference(const CloudParams& params, const NoiseVolume& worley, const NoiseVolume& detail,
+	const ReferenceBackground* background, int width, int height, std::vector<glm::vec3>& image, int threads);
+
+// Command line front end: playground --reference <out.png|out.exr> [width height] [view]
+// Renders without a background and without the geometry tail, like the live
+// renderer with "Draw Mountains" turned off.
+int RunCloudReference(int argc, char* argv[]);
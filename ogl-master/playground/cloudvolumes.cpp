@@ -0,0 +1,127 @@
+#include "cloudvolumes.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+// Uniform in [0, 1) from a 32 bit LCG, so a seed always scatters the same banks
+static float NextRandom(unsigned int& state) {
+	state = state * 1664525u + 1013904223u;
+	return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+CloudVolumes::CloudVolumes() {
+	volumeBuffer = 0;
+	nodeBuffer = 0;
+	volumeCount = 0;
+}
+
+CloudVolumes::~CloudVolumes() {
+	Release();
+}
+
+void CloudVolumes::Release() {
+	if (!volumeBuffer) {
+		return;
+	}
+	glDeleteBuffers(1, &volumeBuffer);
+	glDeleteBuffers(1, &nodeBuffer);
+	volumeBuffer = 0;
+	nodeBuffer = 0;
+	nodes.clear();
+	volumeCount = 0;
+}
+
+void CloudVolumes::BuildNode(int index, int first, int count, std::vector<int>& order, const std::vector<CloudVolume>& volumes) {
+	glm::vec3 boundsMin(1e30f), boundsMax(-1e30f);
+	for (int i = first; i < first + count; i++) {
+		boundsMin = glm::min(boundsMin, volumes[order[i]].boundsMin);
+		boundsMax = glm::max(boundsMax, volumes[order[i]].boundsMax);
+	}
+	nodes[index].boundsMin = boundsMin;
+	nodes[index].boundsMax = boundsMax;
+	nodes[index].first = first;
+	nodes[index].count = count;
+	if (count <= leafSize) {
+		return;
+	}
+
+	// Median of the volume centres along the longest axis
+	glm::vec3 extent = boundsMax - boundsMin;
+	int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+	int half = count / 2;
+	std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+		[&](int a, int b) {
+			return volumes[a].boundsMin[axis] + volumes[a].boundsMax[axis] < volumes[b].boundsMin[axis] + volumes[b].boundsMax[axis];
+		});
+
+	int left = (int)nodes.size();
+	nodes.resize(left + 2);
+	nodes[index].first = left;
+	nodes[index].count = 0;
+	BuildNode(left, first, half, order, volumes);
+	BuildNode(left + 1, first + half, count - half, order, volumes);
+}
+
+bool CloudVolumes::Build(const std::vector<CloudVolume>& volumes) {
+	Release();
+
+	if (volumes.empty()) {
+		printf("Cloud volumes: nothing to build from\n");
+		return false;
+	}
+
+	volumeCount = (int)volumes.size();
+	std::vector<int> order(volumeCount);
+	for (int i = 0; i < volumeCount; i++) {
+		order[i] = i;
+	}
+	nodes.resize(1);
+	BuildNode(0, 0, volumeCount, order, volumes);
+
+	// Leaves index the volumes in tree order
+	std::vector<CloudVolume> sorted(volumeCount);
+	for (int i = 0; i < volumeCount; i++) {
+		sorted[i] = volumes[order[i]];
+	}
+
+	glGenBuffers(1, &volumeBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, volumeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sorted.size() * sizeof(CloudVolume), sorted.data(), GL_STATIC_DRAW);
+	glGenBuffers(1, &nodeBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, nodes.size() * sizeof(Node), nodes.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return true;
+}
+
+void CloudVolumes::Bind() const {
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, volumeBinding, volumeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, nodeBinding, nodeBuffer);
+}
+
+std::vector<CloudVolume> CloudVolumes::Scatter(int count, const glm::vec3& fieldMin, const glm::vec3& fieldMax, unsigned int seed) {
+	std::vector<CloudVolume> volumes(count);
+	unsigned int state = seed * 747796405u + 2891336453u;
+	glm::vec3 field = fieldMax - fieldMin;
+	for (int i = 0; i < count; i++) {
+		CloudVolume& volume = volumes[i];
+		// Between a tenth and a quarter of the field across, so neighbours overlap now and then
+		glm::vec3 size;
+		size.x = field.x * (0.1f + 0.15f * NextRandom(state));
+		size.z = field.z * (0.1f + 0.15f * NextRandom(state));
+		size.y = field.y * (0.5f + 0.5f * NextRandom(state));
+		glm::vec3 corner;
+		corner.x = fieldMin.x + (field.x - size.x) * NextRandom(state);
+		corner.z = fieldMin.z + (field.z - size.z) * NextRandom(state);
+		corner.y = fieldMin.y;
+		volume.boundsMin = corner;
+		volume.boundsMax = corner + size;
+		volume.density = 0.6f + 0.6f * NextRandom(state);
+		volume.noiseScale = 0.8f + 0.45f * NextRandom(state);
+		volume.noiseOffset.x = NextRandom(state);
+		volume.noiseOffset.y = NextRandom(state);
+		volume.noiseOffset.z = NextRandom(state);
+		volume.padding = 0.0f;
+	}
+	return volumes;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Many cloud banks in one scene instead of the single cloudMin/cloudMax box.
+// Every volume has its own box, density and noise placement. The volumes are
+// sorted into a bounding volume hierarchy on the CPU and both are uploaded as
+// shader storage buffers; the CLOUD_VOLUMES variant of CloudRaymarch.glsl walks
+// the tree per view ray and marches only the volumes the ray passes through,
+// nearest first, so the cost follows the banks a ray hits rather than the
+// number in the scene.
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+// Same std430 layout as CloudVolume in CloudRaymarch.glsl
+struct CloudVolume {
+	glm::vec3 boundsMin;
+	float density;				// multiplies the sampled density
+	glm::vec3 boundsMax;
+	float noiseScale;			// multiplies the noise frequency
+	glm::vec3 noiseOffset;		// in noise texture space, so banks don't repeat each other
+	float padding;
+};
+
+class CloudVolumes {
+public:
+	CloudVolumes();
+	~CloudVolumes();
+
+	// Builds the hierarchy over the volumes and uploads both in tree order
+	bool Build(const std::vector<CloudVolume>& volumes);
+	bool IsBuilt() const { return volumeBuffer != 0; };
+	void Release();
+
+	// Binds the volumes and the hierarchy to the storage buffer bindings the
+	// cloud shaders read them from
+	void Bind() const;
+
+	int VolumeCount() const { return volumeCount; };
+	int NodeCount() const { return (int)nodes.size(); };
+
+	// count banks scattered over the XZ extent of fieldMin to fieldMax, standing
+	// on fieldMin.y and reaching at least halfway up the field
+	static std::vector<CloudVolume> Scatter(int count, const glm::vec3& fieldMin, const glm::vec3& fieldMax, unsigned int seed);
+
+	static const int volumeBinding = 1;
+	static const int nodeBinding = 2;
+protected:
+	// Same std430 layout as BVHNode in CloudRaymarch.glsl
+	struct Node {
+		glm::vec3 boundsMin;
+		int first;				// left child of an inner node, the right child follows; first volume of a leaf
+		glm::vec3 boundsMax;
+		int count;				// 0 for an inner node
+	};
+
+	void BuildNode(int index, int first, int count, std::vector<int>& order, const std::vector<CloudVolume>& volumes);
+
+	static const int leafSize = 2;			// volumes
+
+	std::vector<Node> nodes;				// nodes[0] is the root
+	GLuint volumeBuffer;
+	GLuint nodeBuffer;
+	int volumeCount;
+};
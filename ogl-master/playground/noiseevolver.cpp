@@ -0,0 +1,105 @@
+#include "noiseevolver.h"
+
+#include <stdio.h>
+#include <math.h>
+
+NoiseEvolver::NoiseEvolver() {
+	generator = NULL;
+	staticWorley = 0;
+	staticDetail = 0;
+	for (int i = 0; i < setCount; i++) {
+		worley[i] = 0;
+		detail[i] = 0;
+	}
+	setsBuilt = 0;
+	slicesDone = 0;
+	evolution = 0.0f;
+}
+
+NoiseEvolver::~NoiseEvolver() {
+	Release();
+}
+
+bool NoiseEvolver::Create(NoiseGenerator* noiseGenerator, const NoiseVolumeDesc& worleyVolume, const NoiseVolumeDesc& detailVolume,
+	GLuint baseWorley, GLuint baseDetail) {
+	Release();
+	if (!noiseGenerator || !noiseGenerator->IsLoaded() || !baseWorley || !baseDetail) {
+		printf("Evolving noise needs the noise generator and the static noise volumes\n");
+		return false;
+	}
+
+	generator = noiseGenerator;
+	worleyDesc = worleyVolume;
+	detailDesc = detailVolume;
+	//Single channel halves are plenty for density and keep three sets small
+	worleyDesc.format = GL_R16F;
+	detailDesc.format = GL_R16F;
+	staticWorley = baseWorley;
+	staticDetail = baseDetail;
+	for (int i = 0; i < setCount; i++) {
+		worley[i] = generator->CreateVolume(worleyDesc);
+		detail[i] = generator->CreateVolume(detailDesc);
+	}
+	setsBuilt = 0;
+	slicesDone = 0;
+	evolution = 0.0f;
+	return true;
+}
+
+void NoiseEvolver::Release() {
+	if (!worley[0]) {
+		return;
+	}
+	glDeleteTextures(setCount, worley);
+	glDeleteTextures(setCount, detail);
+	for (int i = 0; i < setCount; i++) {
+		worley[i] = 0;
+		detail[i] = 0;
+	}
+}
+
+void NoiseEvolver::Update(int slices, float evolutionStep) {
+	if (!IsCreated()) {
+		return;
+	}
+
+	//A new set takes its phase when it is started, so changing the step never mixes two phases in one set
+	if (slicesDone == 0) {
+		evolution = fmodf(evolution + evolutionStep, 1.0f);
+	}
+
+	int building = setsBuilt % setCount;
+	int first = slicesDone;
+	int last = first + (slices > 1 ? slices : 1);
+	if (last > worleyDesc.size) {
+		last = worleyDesc.size;
+	}
+	generator->Generate(worley[building], worleyDesc, evolution, first, last - first);
+
+	//The detail slices covering the same fraction of the volume
+	int detailFirst = first * detailDesc.size / worleyDesc.size;
+	int detailLast = last * detailDesc.size / worleyDesc.size;
+	generator->Generate(detail[building], detailDesc, evolution, detailFirst, detailLast - detailFirst);
+
+	slicesDone = last;
+	if (slicesDone >= worleyDesc.size) {
+		slicesDone = 0;
+		setsBuilt++;
+	}
+}
+
+GLuint NoiseEvolver::OlderWorley() const {
+	return setsBuilt >= 2 ? worley[(setsBuilt - 2) % setCount] : staticWorley;
+}
+
+GLuint NoiseEvolver::OlderDetail() const {
+	return setsBuilt >= 2 ? detail[(setsBuilt - 2) % setCount] : staticDetail;
+}
+
+GLuint NoiseEvolver::NewerWorley() const {
+	return setsBuilt >= 1 ? worley[(setsBuilt - 1) % setCount] : staticWorley;
+}
+
+GLuint NoiseEvolver::NewerDetail() const {
+	return setsBuilt >= 1 ? detail[(setsBuilt - 1) % setCount] : staticDetail;
+}
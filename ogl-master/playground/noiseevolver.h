@@ -0,0 +1,51 @@
+#pragma once
+
+// Evolving cloud noise. Instead of regenerating the noise volumes in one
+// dispatch, NoiseGenerator rebuilds them a few slices per frame with a new
+// evolution phase, so the cost is spread evenly and never shows up as a spike.
+// Three sets of volumes rotate: the clouds crossfade from the older to the
+// newer complete set while the third is being written, and the fade reaches
+// the newer set just as the next one completes. Until two sets have been built
+// the static volumes stand in for the missing ones.
+
+#include <GL/glew.h>
+
+#include "noisegen.h"
+
+class NoiseEvolver {
+public:
+	NoiseEvolver();
+	~NoiseEvolver();
+
+	// staticWorley and staticDetail are the volumes from CreateNoiseTex, the
+	// same noise as evolution 0. The sets copy their sizes and octaves.
+	bool Create(NoiseGenerator* generator, const NoiseVolumeDesc& worleyDesc, const NoiseVolumeDesc& detailDesc,
+		GLuint staticWorley, GLuint staticDetail);
+	bool IsCreated() const { return worley[0] != 0; };
+	void Release();
+
+	// Writes the next slices of the base volume under construction and the
+	// matching part of its detail volume. evolutionStep is the difference in
+	// evolution between consecutive sets.
+	void Update(int slices, float evolutionStep);
+
+	// Older and newer complete sets, and how far the fade between them is
+	GLuint OlderWorley() const;
+	GLuint OlderDetail() const;
+	GLuint NewerWorley() const;
+	GLuint NewerDetail() const;
+	float Blend() const { return slicesDone / (float)worleyDesc.size; };
+protected:
+	static const int setCount = 3;
+
+	NoiseGenerator* generator;
+	NoiseVolumeDesc worleyDesc;
+	NoiseVolumeDesc detailDesc;
+	GLuint staticWorley;
+	GLuint staticDetail;
+	GLuint worley[setCount];
+	GLuint detail[setCount];
+	int setsBuilt;
+	int slicesDone;
+	float evolution;
+};
@@ -0,0 +1,240 @@
+#include "noisegen.h"
+
+#include <stdio.h>
+
+#include <common/shader.hpp>
+
+static int BytesPerVoxel(GLenum format) {
+	switch (format) {
+	case GL_RGBA32F: return 16;
+	case GL_RGBA16F: return 8;
+	case GL_R32F: return 4;
+	case GL_RGBA8: return 4;
+	case GL_R16F: return 2;
+	case GL_R8: return 1;
+	default: return 4;
+	}
+}
+
+int NoiseVolumeDesc::Levels() const {
+	int levels = 1;
+	for (int s = size; s > 1; s >>= 1) {
+		levels++;
+	}
+	return levels;
+}
+
+size_t NoiseVolumeDesc::MemorySize() const {
+	size_t bytes = 0;
+	for (int level = 0; level < Levels(); level++) {
+		size_t s = size >> level;
+		bytes += s * s * s * BytesPerVoxel(format);
+	}
+	return bytes;
+}
+
+NoiseVolumeDesc defaultBaseNoise(int size, GLenum format) {
+	NoiseVolumeDesc desc;
+	desc.size = size;
+	desc.format = format;
+	desc.persistence = 0.75f;
+	//The original generator sampled its Perlin octave at one cell per voxel,
+	//where Perlin noise is zero. Kept so the Worley octaves weigh the same.
+	NoiseOctave octaves[3] = {
+		{ NOISE_PERLIN, size, 0 },
+		{ NOISE_WORLEY, 6, 1 },
+		{ NOISE_WORLEY, 10, 2 }
+	};
+	desc.octaves.assign(octaves, octaves + 3);
+	return desc;
+}
+
+NoiseVolumeDesc defaultDetailNoise(int size, GLenum format) {
+	NoiseVolumeDesc desc;
+	desc.size = size;
+	desc.format = format;
+	desc.persistence = 0.75f;
+	NoiseOctave octaves[3] = {
+		{ NOISE_WORLEY, 10, 3 },
+		{ NOISE_WORLEY, 13, 4 },
+		{ NOISE_WORLEY, 16, 5 }
+	};
+	desc.octaves.assign(octaves, octaves + 3);
+	return desc;
+}
+
+NoiseGenerator::NoiseGenerator() {
+	program = 0;
+	cellProgram = 0;
+	for (int i = 0; i < cellTableCount; i++) {
+		cellTables[i].buffer = 0;
+		cellTables[i].capacity = 0;
+		cellTables[i].evolution = 0.0f;
+		cellTables[i].lastUsed = 0;
+	}
+	cellTableUses = 0;
+}
+
+NoiseGenerator::~NoiseGenerator() {
+	Release();
+}
+
+bool NoiseGenerator::Load() {
+	Release();
+	program = LoadComputeShader("Shaders/WorleyCS.glsl");
+	cellProgram = LoadComputeShader("Shaders/NoiseCellsCS.glsl");
+	if (!program || !cellProgram) {
+		Release();
+		return false;
+	}
+	for (int i = 0; i < cellTableCount; i++) {
+		glGenBuffers(1, &cellTables[i].buffer);
+	}
+	return true;
+}
+
+void NoiseGenerator::Release() {
+	if (program) {
+		glDeleteProgram(program);
+	}
+	if (cellProgram) {
+		glDeleteProgram(cellProgram);
+	}
+	program = 0;
+	cellProgram = 0;
+	for (int i = 0; i < cellTableCount; i++) {
+		if (cellTables[i].buffer) {
+			glDeleteBuffers(1, &cellTables[i].buffer);
+		}
+		cellTables[i].buffer = 0;
+		cellTables[i].capacity = 0;
+		cellTables[i].octaves.clear();
+		cellTables[i].lastUsed = 0;
+	}
+	cellTableUses = 0;
+}
+
+GLuint NoiseGenerator::CreateVolume(const NoiseVolumeDesc& desc) const {
+	GLuint volume;
+	glGenTextures(1, &volume);
+	glBindTexture(GL_TEXTURE_3D, volume);
+	glTexStorage3D(GL_TEXTURE_3D, desc.Levels(), desc.format, desc.size, desc.size, desc.size);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	return volume;
+}
+
+bool NoiseGenerator::CellsMatch(const CellTable& table, const NoiseVolumeDesc& desc, float evolution) {
+	if (table.octaves.empty() || table.octaves.size() != desc.octaves.size() || table.evolution != evolution) {
+		return false;
+	}
+	for (size_t i = 0; i < table.octaves.size(); i++) {
+		if (table.octaves[i].type != desc.octaves[i].type || table.octaves[i].frequency != desc.octaves[i].frequency ||
+			table.octaves[i].seed != desc.octaves[i].seed) {
+			return false;
+		}
+	}
+	return true;
+}
+
+NoiseGenerator::CellTable& NoiseGenerator::FindCellTable(const NoiseVolumeDesc& desc, float evolution) {
+	int oldest = 0;
+	for (int i = 0; i < cellTableCount; i++) {
+		if (CellsMatch(cellTables[i], desc, evolution)) {
+			return cellTables[i];
+		}
+		if (cellTables[i].lastUsed < cellTables[oldest].lastUsed) {
+			oldest = i;
+		}
+	}
+	return cellTables[oldest];
+}
+
+void NoiseGenerator::Generate(GLuint volume, const NoiseVolumeDesc& desc, float evolution,
+	int firstSlice, int sliceCount) {
+	if (sliceCount < 0 || firstSlice + sliceCount > desc.size) {
+		sliceCount = desc.size - firstSlice;
+	}
+	if (!program || sliceCount <= 0) {
+		return;
+	}
+
+	GenerateRegion(volume, desc.format, desc, evolution, glm::ivec3(0, 0, firstSlice),
+		glm::ivec3(desc.size, desc.size, sliceCount), glm::ivec3(0, 0, firstSlice));
+
+	if (firstSlice + sliceCount == desc.size) {
+		glBindTexture(GL_TEXTURE_3D, volume);
+		glGenerateMipmap(GL_TEXTURE_3D);
+	}
+}
+
+void NoiseGenerator::GenerateRegion(GLuint dest, GLenum destFormat, const NoiseVolumeDesc& desc, float evolution,
+	const glm::ivec3& origin, const glm::ivec3& size, const glm::ivec3& destOffset) {
+	if (!program) {
+		return;
+	}
+
+	int count = (int)desc.octaves.size();
+	if (count > maxOctaves) {
+		printf("Noise volumes take at most %d octaves, ignoring the other %d\n", maxOctaves, count - maxOctaves);
+		count = maxOctaves;
+	}
+	//Each Worley octave owns frequency^3 consecutive entries of the feature point table
+	GLint types[maxOctaves], frequencies[maxOctaves], seeds[maxOctaves], cellOffsets[maxOctaves];
+	int cellCount = 0;
+	for (int i = 0; i < count; i++) {
+		types[i] = desc.octaves[i].type;
+		frequencies[i] = desc.octaves[i].frequency;
+		seeds[i] = desc.octaves[i].seed;
+		cellOffsets[i] = cellCount;
+		if (types[i] == NOISE_WORLEY) {
+			cellCount += frequencies[i] * frequencies[i] * frequencies[i];
+		}
+	}
+
+	CellTable& table = FindCellTable(desc, evolution);
+	table.lastUsed = ++cellTableUses;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, table.buffer);
+	if (cellCount > table.capacity) {
+		glBufferData(GL_SHADER_STORAGE_BUFFER, cellCount * 4 * sizeof(float), NULL, GL_DYNAMIC_COPY);
+		table.capacity = cellCount;
+		table.octaves.clear();
+	}
+	if (cellCount > 0 && !CellsMatch(table, desc, evolution)) {
+		glUseProgram(cellProgram);
+		glUniform1i(glGetUniformLocation(cellProgram, "octaveCount"), count);
+		glUniform1iv(glGetUniformLocation(cellProgram, "octaveType"), count, types);
+		glUniform1iv(glGetUniformLocation(cellProgram, "octaveFrequency"), count, frequencies);
+		glUniform1iv(glGetUniformLocation(cellProgram, "octaveSeed"), count, seeds);
+		glUniform1iv(glGetUniformLocation(cellProgram, "octaveCellOffset"), count, cellOffsets);
+		glUniform1i(glGetUniformLocation(cellProgram, "cellCount"), cellCount);
+		glUniform1f(glGetUniformLocation(cellProgram, "evolution"), evolution);
+		glDispatchCompute((cellCount + 63) / 64, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		table.octaves = desc.octaves;
+		table.evolution = evolution;
+	}
+
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "destTex"), 0);
+	glUniform1i(glGetUniformLocation(program, "octaveCount"), count);
+	glUniform1iv(glGetUniformLocation(program, "octaveType"), count, types);
+	glUniform1iv(glGetUniformLocation(program, "octaveFrequency"), count, frequencies);
+	glUniform1iv(glGetUniformLocation(program, "octaveSeed"), count, seeds);
+	glUniform1iv(glGetUniformLocation(program, "octaveCellOffset"), count, cellOffsets);
+	glUniform1f(glGetUniformLocation(program, "persistence"), desc.persistence);
+	glUniform3iv(glGetUniformLocation(program, "regionOrigin"), 1, &origin[0]);
+	glUniform3iv(glGetUniformLocation(program, "regionSize"), 1, &size[0]);
+	glUniform3iv(glGetUniformLocation(program, "destOffset"), 1, &destOffset[0]);
+	glUniform1i(glGetUniformLocation(program, "volumeSize"), desc.size);
+
+	glBindImageTexture(0, dest, 0, GL_TRUE, 0, GL_WRITE_ONLY, destFormat);
+	glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, size.z);
+	//The next call may rewrite the table
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+	glUseProgram(0);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// Tiling noise volumes for the clouds, generated by WorleyCS.glsl. A volume is
+// described by its size, texture format and a list of octaves, so memory can
+// be traded for quality without touching the shader. Each volume gets its own
+// dispatch with one invocation per voxel, after NoiseCellsCS.glsl has written
+// the feature points of its Worley cells to a table.
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+enum NoiseType {
+	NOISE_PERLIN = 0,
+	NOISE_WORLEY = 1
+};
+
+struct NoiseOctave {
+	NoiseType type;
+	int frequency;			// cells across the volume
+	int seed;				// octaves with different seeds hash their cells differently
+};
+
+struct NoiseVolumeDesc {
+	int size;				// voxels along each side
+	GLenum format;			// any image format, only red is sampled
+	float persistence;		// octave i is weighted persistence^i
+	std::vector<NoiseOctave> octaves;
+
+	// Mip levels down to 1^3, and bytes of texture memory for all of them
+	int Levels() const;
+	size_t MemorySize() const;
+};
+
+// The noise the clouds were tuned with: base noise of two Worley octaves and
+// detail noise of three, at 128^3 and 64^3 by default
+NoiseVolumeDesc defaultBaseNoise(int size = 128, GLenum format = GL_RGBA32F);
+NoiseVolumeDesc defaultDetailNoise(int size = 64, GLenum format = GL_RGBA32F);
+
+class NoiseGenerator {
+public:
+	NoiseGenerator();
+	~NoiseGenerator();
+
+	bool Load();
+	bool IsLoaded() const { return program != 0; };
+	void Release();
+
+	// Allocates an empty volume with a full mip chain, repeat wrapping and
+	// trilinear filtering
+	GLuint CreateVolume(const NoiseVolumeDesc& desc) const;
+	// Fills slices [firstSlice, firstSlice + sliceCount) of volume, or all of
+	// them when sliceCount is negative. evolution moves the Worley cells. The
+	// mips are rebuilt once the last slice has been written.
+	void Generate(GLuint volume, const NoiseVolumeDesc& desc, float evolution = 0.0f,
+		int firstSlice = 0, int sliceCount = -1);
+	// Fills the size block of the volume desc describes, starting at voxel
+	// origin, into dest at destOffset. Voxels outside the volume wrap around.
+	// dest can be any 3D texture of destFormat, it doesn't rebuild mips.
+	void GenerateRegion(GLuint dest, GLenum destFormat, const NoiseVolumeDesc& desc, float evolution,
+		const glm::ivec3& origin, const glm::ivec3& size, const glm::ivec3& destOffset);
+protected:
+	static const int maxOctaves = 8;		// MAX_OCTAVES in the shaders
+
+	// Feature point table of one volume, grown to the largest volume it has held
+	struct CellTable {
+		GLuint buffer;
+		int capacity;
+		// What the table holds, so regions of the volume hash their cells once
+		std::vector<NoiseOctave> octaves;
+		float evolution;
+		unsigned int lastUsed;
+	};
+
+	// True if table already holds the cells of desc at evolution
+	static bool CellsMatch(const CellTable& table, const NoiseVolumeDesc& desc, float evolution);
+	// The table holding the cells of desc at evolution, else the least recently used one
+	CellTable& FindCellTable(const NoiseVolumeDesc& desc, float evolution);
+
+	// Volumes generated in turn, such as the evolving set and the virtual
+	// noise pages, each keep their own table
+	static const int cellTableCount = 4;
+
+	GLuint program;
+	GLuint cellProgram;
+	CellTable cellTables[cellTableCount];
+	unsigned int cellTableUses;
+};
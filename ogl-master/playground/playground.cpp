@@ -1,7 +1,129 @@
+#include <string.h>
+
 #include "renderer.h"
+#include "cloudreference.h"
+
+#include <common/texturecompress.hpp>
+
+// Renderer without a window, through EGL or else OSMesa
+static Renderer* CreateOffscreenRenderer(int width, int height)
+{
+	Renderer* renderer = new Renderer(CONTEXT_EGL, width, height);
+	if (!renderer->isRunning()) {
+		delete renderer;
+		renderer = new Renderer(CONTEXT_OSMESA, width, height);
+	}
+	if (!renderer->isRunning()) {
+		delete renderer;
+		return NULL;
+	}
+	return renderer;
+}
 
-int main(void)
+// playground --render <outputPrefix|out.y4m> <frames> [width height] [view]
+// Renders a sequence without a window
+static int RunBatchRender(int argc, char* argv[])
 {
+	if (argc < 2) {
+		printf("Usage: playground --render <outputPrefix|out.y4m> <frames> [width height] [view 1-3]\n");
+		return 1;
+	}
+
+	int frames = atoi(argv[1]);
+	int width = WINDOWWIDTH;
+	int height = WINDOWHEIGHT;
+	int view = 0;
+	if (argc >= 4) {
+		width = atoi(argv[2]);
+		height = atoi(argv[3]);
+	}
+	if (argc >= 5) {
+		view = atoi(argv[4]);
+	}
+	if (frames <= 0) {
+		printf("Invalid frame count %s\n", argv[1]);
+		return 1;
+	}
+	if (width <= 0 || height <= 0) {
+		printf("Invalid size %dx%d\n", width, height);
+		return 1;
+	}
+
+	Renderer* renderer = CreateOffscreenRenderer(width, height);
+	if (!renderer) {
+		return 1;
+	}
+
+	renderer->SetView(view);
+	bool rendered = renderer->RenderFrames(argv[0], frames, 1.0f / 30.0f);
+
+	delete renderer;
+
+	return rendered ? 0 : 1;
+}
+
+// playground --export-noise [directory]
+// Saves the generated noise volumes so later runs load them instead of running WorleyCS
+static int RunExportNoise(int argc, char* argv[])
+{
+	const char* directory = argc >= 1 ? argv[0] : "Textures";
+
+	Renderer* renderer = CreateOffscreenRenderer(WINDOWWIDTH, WINDOWHEIGHT);
+	if (!renderer) {
+		return 1;
+	}
+	bool exported = renderer->ExportNoiseTex(directory);
+	delete renderer;
+
+	return exported ? 0 : 1;
+}
+
+// playground --export-svol [out.svol]
+// Bakes the default cloud box into the sparse volume the renderer loads
+static int RunExportSparseVolume(int argc, char* argv[])
+{
+	const char* path = argc >= 1 ? argv[0] : "Textures/cloud.svol";
+
+	Renderer* renderer = CreateOffscreenRenderer(WINDOWWIDTH, WINDOWHEIGHT);
+	if (!renderer) {
+		return 1;
+	}
+	bool exported = renderer->ExportSparseVolume(path);
+	delete renderer;
+
+	return exported ? 0 : 1;
+}
+
+// playground --compress <in.png> <out.dds>
+// The renderer picks up Textures/heightmap.dds in place of the PNG
+static int RunCompress(int argc, char* argv[])
+{
+	if (argc < 2) {
+		printf("Usage: playground --compress <in.png> <out.dds>\n");
+		return 1;
+	}
+	return compressTexture(argv[0], argv[1]) ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+	// Offline CPU render of the clouds, no window or GL context needed
+	if (argc > 1 && strcmp(argv[1], "--reference") == 0) {
+		return RunCloudReference(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "--render") == 0) {
+		return RunBatchRender(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "--export-noise") == 0) {
+		return RunExportNoise(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "--export-svol") == 0) {
+		return RunExportSparseVolume(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "--compress") == 0) {
+		return RunCompress(argc - 2, argv + 2);
+	}
+
 	Renderer* renderer = new Renderer();
 
 	while (renderer->isRunning()){
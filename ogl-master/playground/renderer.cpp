@@ -1,6 +1,21 @@
 #include "renderer.h"
 
-Renderer::Renderer() {
+#include <string.h>
+
+#include <common/imagewrite.hpp>
+
+#include "cloudreference.h"
+
+static bool FileExists(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+	fclose(file);
+	return true;
+}
+
+Renderer::Renderer(ContextType contextType, int width, int height) {
 	exitWindow = false;
 
 	inMenu = false;
@@ -9,40 +24,101 @@ Renderer::Renderer() {
 	paused = false;
 
 	usingCompute = false;
+	detailNoise = true;
+	drawMountains = true;
+	chunkedTerrain = false;
+	terrainPixelError = 2.0f;
+	frustumCulling = true;
+	occlusionCulling = false;
+	evolvingClouds = false;
+	evolveSlices = 8;
+	evolveStep = 0.02f;
+	noiseLod = false;
+	detailDistanceVal = 25.0f;
+	stepGrowthVal = 0.05f;
+	weatherMap = false;
+	weatherCoverageVal = 0.5f;
+	weatherScaleVal = 4.0f;
+	weatherSeed = 0;
+	sphericalShell = false;
+	planetRadiusVal = 1000.0f;
+	shellDistanceVal = 150.0f;
+	maxViewStepsVal = 256.0f;
+	cloudBanks = false;
+	cloudBankCount = 32;
+	sparseClouds = false;
+	sparseDensityVal = 1.0f;
+	sparseVolumePath = "Textures/cloud.svol";
+	virtualNoise = false;
+	virtualPagesPerFrame = 8;
+	cloudShadows = false;
+	shadowUpdateFrames = 4;
+	shadowRow = 0;
+	shadowMapReady = false;
+	cloudShadowTex = 0;
+	cloudShadowID = 0;
+	farImpostor = false;
+	farSplitVal = 30.0f;
+	impostorFace = 0;
+	impostorCentre = vec3(0.0f);
+	impostorTex = 0;
+	impostorID = 0;
+	progressiveRefine = true;
+	refining = false;
+	refineFrames = 64;
+	refineLightStepsVal = 32.0f;
+	accumulatedFrames = 0;
+	refineCamPos = vec3(0.0f);
+	refineCamDir = vec3(0.0f);
+	refineTime = 0.0f;
+	refineTerrain = false;
+	historyTex = 0;
+	recordFailed = false;
+	worleyDesc = defaultBaseNoise();
+	detailDesc = defaultDetailNoise();
+	noiseSizeIndex = 1;
+	noiseFormatIndex = 0;
+	numLightStepsVal = 8.0f;
 
-	// Initialise GLFW
-	if (!glfwInit())
-	{
-		fprintf(stderr, "Failed to initialize GLFW\n");
-		getchar();
-		exitWindow = true;
-		return;
-	}
-
-	glfwWindowHint(GLFW_SAMPLES, 4);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	offscreen = contextType != CONTEXT_WINDOW;
+
+	//Initialize can stop part way, the destructor deletes whatever was created by then
+	worleyTex = 0;
+	detailTex = 0;
+	weatherTex = 0;
+	heightProfileTex = 0;
+	bufferColourTex = 0;
+	bufferDepthTex = 0;
+	bufferFBO = 0;
+	linearDepthTex = 0;
+	depthBoundsTex = 0;
+	outputColourTex = 0;
+	outputFBO = 0;
+	finalTex = 0;
+	cloudTimerQuery = 0;
+	terrainTimerQuery = 0;
+	vertexbuffer = 0;
+	uvbuffer = 0;
+	cloudVertexbuffer = 0;
+	programID = 0;
+	terrainProgramID = 0;
+	normalShaderID = 0;
+	depthPyramidID = 0;
+	weatherShaderID = 0;
+	texture = 0;
+	normTexture = 0;
+	vertexArrayID = 0;
 
-	// Open a window and create its OpenGL context
-	window = glfwCreateWindow(WINDOWWIDTH, WINDOWHEIGHT, "Cloud Playground", NULL, NULL);
-	if (window == NULL) {
-		fprintf(stderr, "Failed to open GLFW window.\n");
-		getchar();
-		glfwTerminate();
+	WINDOWWIDTH = width;
+	WINDOWHEIGHT = height;
+	if (!createContext(context, contextType, width, height, "Cloud Playground")) {
 		exitWindow = true;
 		return;
 	}
-	glfwMakeContextCurrent(window);
+	window = context.window;
 
-	// Initialize GLEW
-	glewExperimental = true; // Needed for core profile
-	if (glewInit() != GLEW_OK) {
-		fprintf(stderr, "Failed to initialize GLEW\n");
-		getchar();
-		glfwTerminate();
-		exitWindow = true;
+	if (offscreen) {
+		Initialize();
 		return;
 	}
 
@@ -56,36 +132,71 @@ Renderer::Renderer() {
 	ImGui_ImplGlfw_InitForOpenGL(window, true);
 	ImGui_ImplOpenGL3_Init("#version 430");
 
-	glfwSwapInterval(0);
-
 	Initialize();
 	return;
 }
 
 Renderer::~Renderer() {
-	ImGui_ImplOpenGL3_Shutdown();
-	ImGui_ImplGlfw_Shutdown();
-	ImGui::DestroyContext();
+	//Context creation failed, nothing was created
+	if (!context.window && !context.context) {
+		return;
+	}
+
+	//Needs the context for the last readbacks
+	capture.Stop();
+
+	if (!offscreen) {
+		ImGui_ImplOpenGL3_Shutdown();
+		ImGui_ImplGlfw_Shutdown();
+		ImGui::DestroyContext();
+	}
 
 	// Cleanup Textures and Buffers
 	glDeleteTextures(1, &worleyTex);
 	glDeleteTextures(1, &detailTex);
+	glDeleteTextures(1, &weatherTex);
+	glDeleteTextures(1, &heightProfileTex);
+	glDeleteTextures(1, &cloudShadowTex);
+	glDeleteTextures(1, &impostorTex);
 
 	glDeleteTextures(1, &bufferColourTex);
 	glDeleteTextures(1, &bufferDepthTex);
 	glDeleteFramebuffers(1, &bufferFBO);
+	glDeleteTextures(1, &linearDepthTex);
+	glDeleteTextures(1, &depthBoundsTex);
+
+	glDeleteTextures(1, &outputColourTex);
+	glDeleteFramebuffers(1, &outputFBO);
 
 	glDeleteTextures(1, &finalTex);
+	glDeleteTextures(1, &historyTex);
+
+	glDeleteQueries(1, &cloudTimerQuery);
+	glDeleteQueries(1, &terrainTimerQuery);
+
+	DeleteShaderPermutations();
 
 	glDeleteBuffers(1, &vertexbuffer);
 	glDeleteBuffers(1, &uvbuffer);
 	glDeleteBuffers(1, &cloudVertexbuffer);
 	glDeleteProgram(programID);
+	glDeleteProgram(terrainProgramID);
+	glDeleteProgram(normalShaderID);
+	glDeleteProgram(depthPyramidID);
+	glDeleteProgram(weatherShaderID);
 	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &normTexture);
 	glDeleteVertexArrays(1, &vertexArrayID);
-
-	// Close OpenGL window and terminate GLFW
-	glfwTerminate();
+	terrainLOD.Release();
+	noiseEvolver.Release();
+	noiseGenerator.Release();
+	terrainCuller.Release();
+	cloudVolumes.Release();
+	sparseVolume.Release();
+	virtualVolume.Release();
+
+	shutdownTextureLoader();
+	destroyContext(context);
 }
 
 void WindowResize(GLFWwindow* window, int width, int height)
@@ -96,13 +207,15 @@ void WindowResize(GLFWwindow* window, int width, int height)
 }
 
 void Renderer::Initialize() {
-	glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
-	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+	if (!offscreen) {
+		glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
+		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-	glfwSetWindowSizeCallback(window, WindowResize);
+		glfwSetWindowSizeCallback(window, WindowResize);
 
-	glfwPollEvents();
-	glfwSetCursorPos(window, WINDOWWIDTH / 2, WINDOWHEIGHT / 2);
+		glfwPollEvents();
+		glfwSetCursorPos(window, WINDOWWIDTH / 2, WINDOWHEIGHT / 2);
+	}
 
 	glClearColor(0.5f, 0.5f, 0.5f, 0.0f);
 
@@ -129,9 +242,33 @@ void Renderer::Initialize() {
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bufferColourTex, 0);
 
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE || !bufferDepthTex || !bufferColourTex) {
+		fprintf(stderr, "Failed to create the scene framebuffer\n");
+		exitWindow = true;
 		return;
 	}
 
+	CreateDepthPyramid();
+
+	//Offscreen there is no window to present to, the final image goes here instead
+	if (offscreen) {
+		glGenTextures(1, &outputColourTex);
+		glBindTexture(GL_TEXTURE_2D, outputColourTex);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, WINDOWWIDTH, WINDOWHEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+		glGenFramebuffers(1, &outputFBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, outputColourTex, 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "Failed to create the offscreen framebuffer\n");
+			exitWindow = true;
+			return;
+		}
+		glViewport(0, 0, WINDOWWIDTH, WINDOWHEIGHT);
+	}
+
 	glEnable(GL_CULL_FACE);
 	glEnable(GL_DEPTH_TEST);
 
@@ -140,28 +277,38 @@ void Renderer::Initialize() {
 
 	glPatchParameteri(GL_PATCH_VERTICES, 3);
 
-	// Create and compile shaders
-	programID = LoadShaders("Shaders/TexturedVS.glsl", "Shaders/MountainFS.glsl", "Shaders/TexturedTCS.glsl", "Shaders/TexturedTES.glsl");
-	cloudFragmentID = LoadShaders("Shaders/PassthroughVS.glsl", "Shaders/CloudDensityFS.glsl");
-	passthroughID = LoadShaders("Shaders/PassthroughTexVS.glsl", "Shaders/TexturedFS.glsl");
-	worleyShaderID = LoadComputeShader("Shaders/WorleyCS.glsl");
-	cloudComputeID = LoadComputeShader("Shaders/CloudDensityCS.glsl");
-
-	if (usingCompute) {
-		currentCloudID = cloudComputeID;
+	//Block compressed heightmap (playground --compress) if it has been generated,
+	//otherwise decode the PNG on a worker thread while the shaders compile.
+	//The normal map is derived from it once it is ready (GenerateNormalMap).
+	if (FileExists("Textures/heightmap.dds")) {
+		texture = loadDDS("Textures/heightmap.dds");
 	}
 	else {
-		currentCloudID = cloudFragmentID;
+		texture = loadImageAsync("Textures/heightmap.png");
 	}
+	normTexture = 0;
 
-	matrixID = glGetUniformLocation(programID, "MVP");
-	cloudMatrixID = glGetUniformLocation(currentCloudID, "MVP");
-
-	texture = loadImage("Textures/heightmap.png");
-	normTexture = loadImage("Textures/terrainNormals.png");
+	// Create and compile shaders
+	programID = LoadShaders("Shaders/TexturedVS.glsl", "Shaders/MountainFS.glsl", "Shaders/TexturedTCS.glsl", "Shaders/TexturedTES.glsl");
+	terrainProgramID = LoadShaders("Shaders/TerrainVS.glsl", "Shaders/MountainFS.glsl");
+	normalShaderID = LoadComputeShader("Shaders/NormalCS.glsl");
+	depthPyramidID = LoadComputeShader("Shaders/DepthPyramidCS.glsl");
+	weatherShaderID = LoadComputeShader("Shaders/WeatherCS.glsl");
+	passthroughID = LoadShaders("Shaders/PassthroughTexVS.glsl", "Shaders/TexturedFS.glsl");
+	noiseGenerator.Load();
+	cloudFragmentID = 0;
+	cloudComputeID = 0;
+	SelectCloudVariant();
+
+	//GPU timers for the terrain and cloud passes, read back a frame late to avoid stalling
+	glGenQueries(1, &cloudTimerQuery);
+	cloudTimerActive = false;
+	cloudPassMs = 0.0f;
+	glGenQueries(1, &terrainTimerQuery);
+	terrainTimerActive = false;
+	terrainPassMs = 0.0f;
 
-	textureID = glGetUniformLocation(programID, "heightMap");
-	normTextureID = glGetUniformLocation(programID, "normalMap");
+	cloudMatrixID = glGetUniformLocation(currentCloudID, "MVP");
 
 	//Generate compute texture
 	glGenTextures(1, &finalTex);
@@ -170,12 +317,17 @@ void Renderer::Initialize() {
 	glBindTexture(GL_TEXTURE_2D, finalTex);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, WINDOWWIDTH, WINDOWHEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
 
+	worleyTex = 0;
+	detailTex = 0;
 	CreateNoiseTex();
+	weatherTex = 0;
+	heightProfileTex = 0;
+	CreateWeatherTex();
 
 	worleyTexID = glGetUniformLocation(currentCloudID, "worleyTex");
 	detailTexID = glGetUniformLocation(currentCloudID, "detailTex");
 	bufferTexID = glGetUniformLocation(currentCloudID, "bufferTex");
-	depthTexID = glGetUniformLocation(currentCloudID, "depthTex");
+	linearDepthTexID = glGetUniformLocation(currentCloudID, "linearDepthTex");
 
 	// Read our .obj file
 	bool res = loadOBJ("Models/terrain.obj", vertices, uvs, normals);
@@ -227,11 +379,9 @@ void Renderer::Initialize() {
 	glUseProgram(currentCloudID);
 	glUniform2f(glGetUniformLocation(cloudFragmentID, "iResolution"), WINDOWWIDTH, WINDOWHEIGHT);
 	glUniform2f(glGetUniformLocation(cloudComputeID, "iResolution"), WINDOWWIDTH, WINDOWHEIGHT);
-	glUniform1f(glGetUniformLocation(currentCloudID, "zNear"), 0.1f);
 	glUniform1f(glGetUniformLocation(currentCloudID, "zFar"), 100.0f);
 
 	numStepsVal = 0.25f;
-	numLightStepsVal = 8.0f;
 	densityMultVal = 12.0f;
 	densityOfstVal = 0.7f;
 	baseTransmittanceVal = 0.25f;
@@ -245,6 +395,10 @@ void Renderer::Initialize() {
 
 	cloudMinVal = vec3(-20.0, 0, -20.0);
 	cloudMaxVal = vec3(20.0, 8.0, 20.0);
+	CreateCloudBanks();
+	if (sparseClouds) {
+		sparseClouds = sparseVolume.Load(sparseVolumePath);
+	}
 
 	skyColVal = vec3(0.58f, 0.66f, 0.81f);
 	cloudColVal = vec3(1.0f);
@@ -259,51 +413,313 @@ void Renderer::Initialize() {
 
 	//Setup non-cloud initial values
 	mountainHeight = -0.5f;
-	drawMountains = true;
 	timePassed = 0;
 	return;
 }
 
-void Renderer::CreateNoiseTex() {
-	glUseProgram(worleyShaderID);
-	glUniform1i(glGetUniformLocation(worleyShaderID, "destTex"), 0);
-	glUniform1i(glGetUniformLocation(worleyShaderID, "detailTex"), 1);
+// Terrain normals from the heightmap, so a new heightmap needs no baked normal map.
+// Two channels are enough, MountainFS rebuilds the third.
+void Renderer::GenerateNormalMap() {
+	GLint width, height;
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+	int levels = 1;
+	while (((width > height ? width : height) >> levels) > 0) {
+		levels++;
+	}
 
-	glGenTextures(1, &worleyTex);
-	glGenTextures(1, &detailTex);
+	glGenTextures(1, &normTexture);
+	glBindTexture(GL_TEXTURE_2D, normTexture);
+	glTexStorage2D(GL_TEXTURE_2D, levels, GL_RG8, width, height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, worleyTex);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, 128, 128, 128, 0, GL_RGBA, GL_FLOAT, NULL);
+	glUseProgram(normalShaderID);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glUniform1i(glGetUniformLocation(normalShaderID, "heightMap"), 0);
+	glUniform1i(glGetUniformLocation(normalShaderID, "normalMap"), 0);
+	glUniform1f(glGetUniformLocation(normalShaderID, "normalStrength"), 50.0f / 512.0f);
+	glBindImageTexture(0, normTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG8);
 
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
 
-	glBindImageTexture(0, worleyTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	glBindTexture(GL_TEXTURE_2D, normTexture);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glUseProgram(0);
+}
+
+//Linear depth at full resolution and its min/max pyramid, from half resolution down to 1x1
+void Renderer::CreateDepthPyramid() {
+	glDeleteTextures(1, &linearDepthTex);
+	glDeleteTextures(1, &depthBoundsTex);
+
+	glGenTextures(1, &linearDepthTex);
+	glBindTexture(GL_TEXTURE_2D, linearDepthTex);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, WINDOWWIDTH, WINDOWHEIGHT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+	int width = (WINDOWWIDTH + 1) / 2;
+	int height = (WINDOWHEIGHT + 1) / 2;
+	depthBoundsLevels = 1;
+	while (((width > height ? width : height) >> depthBoundsLevels) > 0) {
+		depthBoundsLevels++;
+	}
+
+	glGenTextures(1, &depthBoundsTex);
+	glBindTexture(GL_TEXTURE_2D, depthBoundsTex);
+	glTexStorage2D(GL_TEXTURE_2D, depthBoundsLevels, GL_RG32F, width, height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+}
+
+//One dispatch per level, each reading the level written before it
+void Renderer::BuildDepthPyramid() {
+	glUseProgram(depthPyramidID);
+	glUniform1f(glGetUniformLocation(depthPyramidID, "zNear"), 0.1f);
+	glUniform1f(glGetUniformLocation(depthPyramidID, "zFar"), 100.0f);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, detailTex);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, 64, 64, 64, 0, GL_RGBA, GL_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_2D, bufferDepthTex);
+	glUniform1i(glGetUniformLocation(depthPyramidID, "depthTex"), 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, depthBoundsTex);
+	glUniform1i(glGetUniformLocation(depthPyramidID, "depthBoundsTex"), 1);
+
+	glUniform1i(glGetUniformLocation(depthPyramidID, "linearDepth"), 0);
+	glUniform1i(glGetUniformLocation(depthPyramidID, "depthBounds"), 1);
+	glBindImageTexture(0, linearDepthTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+	int width = (WINDOWWIDTH + 1) / 2;
+	int height = (WINDOWHEIGHT + 1) / 2;
+	for (int level = 0; level < depthBoundsLevels; level++) {
+		int levelWidth = max(1, width >> level);
+		int levelHeight = max(1, height >> level);
+		glUniform1i(glGetUniformLocation(depthPyramidID, "level"), level);
+		glBindImageTexture(1, depthBoundsTex, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+		glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+	glUseProgram(0);
+}
 
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+// Precomputed volumes from ExportNoiseTex, uploaded straight from the file mapping
+bool Renderer::LoadNoiseTex() {
+	if (!FileExists("Textures/worley.dds") || !FileExists("Textures/worleyDetail.dds")) {
+		return false;
+	}
+
+	GLenum worleyTarget, detailTarget;
+	worleyTex = loadDDS("Textures/worley.dds", &worleyTarget);
+	detailTex = loadDDS("Textures/worleyDetail.dds", &detailTarget);
+	if (!worleyTex || !detailTex || worleyTarget != GL_TEXTURE_3D || detailTarget != GL_TEXTURE_3D) {
+		printf("Precomputed noise volumes are unusable, generating them instead\n");
+		glDeleteTextures(1, &worleyTex);
+		glDeleteTextures(1, &detailTex);
+		return false;
+	}
 
-	glBindImageTexture(1, detailTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	//Exported at other settings, or without the mips the noise LOD samples
+	GLint worleySize, detailSize, worleyFormat, detailFormat, worleyLevels, detailLevels;
+	glBindTexture(GL_TEXTURE_3D, worleyTex);
+	glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_WIDTH, &worleySize);
+	glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_INTERNAL_FORMAT, &worleyFormat);
+	glGetTexParameteriv(GL_TEXTURE_3D, GL_TEXTURE_IMMUTABLE_LEVELS, &worleyLevels);
+	glBindTexture(GL_TEXTURE_3D, detailTex);
+	glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_WIDTH, &detailSize);
+	glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_INTERNAL_FORMAT, &detailFormat);
+	glGetTexParameteriv(GL_TEXTURE_3D, GL_TEXTURE_IMMUTABLE_LEVELS, &detailLevels);
+	if (worleySize != worleyDesc.size || detailSize != detailDesc.size ||
+		worleyFormat != (GLint)worleyDesc.format || detailFormat != (GLint)detailDesc.format ||
+		worleyLevels != worleyDesc.Levels() || detailLevels != detailDesc.Levels()) {
+		glDeleteTextures(1, &worleyTex);
+		glDeleteTextures(1, &detailTex);
+		return false;
+	}
+	return true;
+}
 
-	glDispatchCompute(128 / 8, 128 / 8, 128 / 8);
+void Renderer::CreateNoiseTex() {
+	glDeleteTextures(1, &worleyTex);
+	glDeleteTextures(1, &detailTex);
+	worleyTex = 0;
+	detailTex = 0;
+
+	if (!LoadNoiseTex()) {
+		glActiveTexture(GL_TEXTURE0);
+		worleyTex = noiseGenerator.CreateVolume(worleyDesc);
+		detailTex = noiseGenerator.CreateVolume(detailDesc);
+
+		//GPU time of both volumes, table passes and mips included
+		GLuint timers[2];
+		glGenQueries(2, timers);
+		glQueryCounter(timers[0], GL_TIMESTAMP);
+		noiseGenerator.Generate(worleyTex, worleyDesc);
+		noiseGenerator.Generate(detailTex, detailDesc);
+		glQueryCounter(timers[1], GL_TIMESTAMP);
+		GLuint64 start = 0, end = 0;
+		glGetQueryObjectui64v(timers[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(timers[1], GL_QUERY_RESULT, &end);
+		glDeleteQueries(2, timers);
+		printf("Generated %d^3 and %d^3 noise volumes in %.3f ms on the GPU\n", worleyDesc.size, detailDesc.size, (end - start) / 1000000.0f);
+	}
 
 	glActiveTexture(GL_TEXTURE4);
 	glBindTexture(GL_TEXTURE_3D, worleyTex);
 	glActiveTexture(GL_TEXTURE5);
 	glBindTexture(GL_TEXTURE_3D, detailTex);
 
-	return;
+	//The evolving sets and the virtual volume copy the volume sizes, so they are rebuilt with them
+	noiseEvolver.Release();
+	virtualVolume.Release();
+}
+
+// Cloud density against height as a fraction of the box, rising from the base
+// and falling off between fadeStart and fadeEnd
+static float HeightProfile(float height, float baseEnd, float fadeStart, float fadeEnd) {
+	float rise = glm::smoothstep(0.0f, baseEnd, height);
+	float fall = 1.0f - glm::smoothstep(fadeStart, fadeEnd, height);
+	return rise * fall;
+}
+
+// Weather map over the box and the height profiles it selects between.
+// Rows of the profile texture, bottom to top: stratus, stratocumulus, cumulus.
+void Renderer::CreateWeatherTex() {
+	const int profileWidth = 64;
+	static const float profiles[3][3] = {
+		{ 0.05f, 0.15f, 0.3f },
+		{ 0.1f, 0.35f, 0.6f },
+		{ 0.1f, 0.7f, 1.0f }
+	};
+	unsigned char profileTexels[3][profileWidth];
+	for (int row = 0; row < 3; row++) {
+		for (int i = 0; i < profileWidth; i++) {
+			float height = (i + 0.5f) / profileWidth;
+			float density = HeightProfile(height, profiles[row][0], profiles[row][1], profiles[row][2]);
+			profileTexels[row][i] = (unsigned char)(density * 255.0f + 0.5f);
+		}
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+	if (!heightProfileTex) {
+		glGenTextures(1, &heightProfileTex);
+		glBindTexture(GL_TEXTURE_2D, heightProfileTex);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, profileWidth, 3);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	}
+	glBindTexture(GL_TEXTURE_2D, heightProfileTex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, profileWidth, 3, GL_RED, GL_UNSIGNED_BYTE, profileTexels);
+
+	const int weatherSize = 256;
+	if (!weatherTex) {
+		glGenTextures(1, &weatherTex);
+		glBindTexture(GL_TEXTURE_2D, weatherTex);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG8, weatherSize, weatherSize);
+		//Mirrored so a spherical shell wider than the box sees the map repeat without seams
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	}
+
+	glUseProgram(weatherShaderID);
+	glUniform1i(glGetUniformLocation(weatherShaderID, "weatherMap"), 0);
+	glUniform1f(glGetUniformLocation(weatherShaderID, "coverage"), weatherCoverageVal);
+	glUniform1f(glGetUniformLocation(weatherShaderID, "featureScale"), weatherScaleVal);
+	glUniform1i(glGetUniformLocation(weatherShaderID, "seed"), weatherSeed);
+	glBindImageTexture(0, weatherTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG8);
+	glDispatchCompute((weatherSize + 7) / 8, (weatherSize + 7) / 8, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	glUseProgram(0);
+}
+
+//Cloud banks over four times the width and depth of the cloud box, as tall as it
+void Renderer::CreateCloudBanks() {
+	vec3 centre = (cloudMinVal + cloudMaxVal) * 0.5f;
+	vec3 halfField = (cloudMaxVal - cloudMinVal) * vec3(2.0f, 0.5f, 2.0f);
+	cloudVolumes.Build(CloudVolumes::Scatter(cloudBankCount, centre - halfField, centre + halfField, 1));
+}
+
+// Compile-time specialisation of the cloud shaders for the current settings.
+// Light step counts without a variant fall back to the numLightSteps uniform.
+// progressive selects the variant drawn while refinement accumulates frames.
+std::string Renderer::CloudVariantDefines(bool progressive) {
+	std::string defines;
+	int lightSteps = (int)(numLightStepsVal + 0.5f);
+	//Refinement trades the fast paths for quality, which the averaging then pays for
+	if (!progressive && (lightSteps == 4 || lightSteps == 8 || lightSteps == 16)) {
+		defines += "#define LIGHT_STEPS " + std::to_string(lightSteps) + "\n";
+	}
+	if (detailNoise) {
+		defines += "#define DETAIL_NOISE\n";
+	}
+	if (drawMountains) {
+		defines += "#define GEOMETRY_TAIL\n";
+	}
+	if (evolvingClouds) {
+		defines += "#define EVOLVING_NOISE\n";
+	}
+	if (noiseLod && !progressive) {
+		defines += "#define NOISE_LOD\n";
+	}
+	if (weatherMap) {
+		defines += "#define WEATHER_MAP\n";
+	}
+	if (virtualNoise) {
+		defines += "#define VIRTUAL_NOISE\n";
+	}
+	if (farImpostor && !progressive) {
+		defines += "#define FAR_IMPOSTOR\n";
+	}
+	if (progressive) {
+		defines += "#define PROGRESSIVE\n";
+	}
+	if (sparseClouds) {
+		defines += "#define SPARSE_VOLUME\n";
+	}
+	else if (cloudBanks) {
+		defines += "#define CLOUD_VOLUMES\n";
+	}
+	else if (sphericalShell) {
+		defines += "#define SPHERICAL_SHELL\n";
+	}
+	return defines;
+}
+
+// Switches both cloud shaders to the variant matching the settings, compiling it on first use.
+// Returns true if the programs changed and the uniforms need setting again.
+bool Renderer::SelectCloudVariant() {
+	passVariant = CloudVariantDefines(false);
+	std::string defines = CloudVariantDefines(refining);
+	if (cloudFragmentID != 0 && defines == cloudVariant) {
+		return false;
+	}
+	cloudVariant = defines;
+
+	cloudFragmentID = LoadShaderPermutation("Shaders/PassthroughVS.glsl", "Shaders/CloudDensityFS.glsl", defines.c_str());
+	cloudComputeID = LoadComputePermutation("Shaders/CloudDensityCS.glsl", defines.c_str());
+	glGetProgramiv(cloudComputeID, GL_COMPUTE_WORK_GROUP_SIZE, cloudGroupSize);
+
+	if (usingCompute) {
+		currentCloudID = cloudComputeID;
+	}
+	else {
+		currentCloudID = cloudFragmentID;
+	}
+	return true;
 }
 
 void Renderer::UpdateCloudUniforms() {
@@ -342,18 +758,19 @@ void Renderer::UpdateCloudUniforms() {
 	baseBrightness = glGetUniformLocation(currentCloudID, "baseBrightness");
 	phaseFactor = glGetUniformLocation(currentCloudID, "phaseFactor");
 
+	cloudMin = glGetUniformLocation(currentCloudID, "cloudMin");
+	cloudMax = glGetUniformLocation(currentCloudID, "cloudMax");
+
 	glUniform2f(glGetUniformLocation(currentCloudID, "iResolution"), WINDOWWIDTH, WINDOWHEIGHT);
-	glUniform1f(glGetUniformLocation(currentCloudID, "zNear"), 0.1f);
 	glUniform1f(glGetUniformLocation(currentCloudID, "zFar"), 100.0f);
 
 	worleyTexID = glGetUniformLocation(currentCloudID, "worleyTex");
 	detailTexID = glGetUniformLocation(currentCloudID, "detailTex");
 	bufferTexID = glGetUniformLocation(currentCloudID, "bufferTex");
-	depthTexID = glGetUniformLocation(currentCloudID, "depthTex");
+	linearDepthTexID = glGetUniformLocation(currentCloudID, "linearDepthTex");
 
 	//Set uniform values
-	glUniform1i(worleyTexID, 4);
-	glUniform1i(detailTexID, 5);
+	SetCloudSamplers(currentCloudID);
 
 	glUniform1f(numSteps, numStepsVal);
 	glUniform1f(numLightSteps, numLightStepsVal);
@@ -375,11 +792,225 @@ void Renderer::UpdateCloudUniforms() {
 	glUniform1f(phaseFactor, phaseFactorVal);
 	glUniform3fv(cloudMin, 1, (float*)&cloudMinVal[0]);
 	glUniform3fv(cloudMax, 1, (float*)&cloudMaxVal[0]);
+	glUniform1f(glGetUniformLocation(currentCloudID, "detailDistance"), detailDistanceVal);
+	glUniform1f(glGetUniformLocation(currentCloudID, "stepGrowth"), stepGrowthVal);
+	UpdateShellUniforms(currentCloudID);
+
+	glUseProgram(0);
+}
+
+//Texture units of the noise, weather and variant inputs, bound by BindCloudInputs
+void Renderer::SetCloudSamplers(GLuint program) {
+	glUniform1i(glGetUniformLocation(program, "worleyTex"), 4);
+	glUniform1i(glGetUniformLocation(program, "detailTex"), 5);
+	glUniform1i(glGetUniformLocation(program, "worleyNextTex"), 6);
+	glUniform1i(glGetUniformLocation(program, "detailNextTex"), 7);
+	glUniform1i(glGetUniformLocation(program, "weatherTex"), 8);
+	glUniform1i(glGetUniformLocation(program, "heightProfileTex"), 9);
+	glUniform1i(glGetUniformLocation(program, "brickTable"), 10);
+	glUniform1i(glGetUniformLocation(program, "brickAtlas"), 11);
+	glUniform1i(glGetUniformLocation(program, "pageTable"), 12);
+	glUniform1i(glGetUniformLocation(program, "pageCache"), 13);
+	glUniform1i(glGetUniformLocation(program, "virtualFallback"), 14);
+	glUniform1i(glGetUniformLocation(program, "farClouds"), 15);
+}
+
+//The shell's inner sphere touches the bottom of the cloud box under the origin and is as thick as the box is tall
+void Renderer::UpdateShellUniforms(GLuint program) {
+	float thickness = cloudMaxVal.y - cloudMinVal.y;
+	vec3 centre = vec3(0.0f, cloudMinVal.y - planetRadiusVal, 0.0f);
+	glUniform3fv(glGetUniformLocation(program, "planetCentre"), 1, (float*)&centre[0]);
+	glUniform1f(glGetUniformLocation(program, "shellInner"), planetRadiusVal);
+	glUniform1f(glGetUniformLocation(program, "shellOuter"), planetRadiusVal + thickness);
+	glUniform1f(glGetUniformLocation(program, "shellDistance"), shellDistanceVal);
+	glUniform1f(glGetUniformLocation(program, "maxViewSteps"), maxViewStepsVal);
+}
+
+//Inputs of sampleDensity and lightMarch for the passes that march the clouds besides the cloud shaders.
+//The program must be in use.
+void Renderer::SetCloudPassUniforms(GLuint program) {
+	SetCloudSamplers(program);
+	BindCloudInputs(program);
+	UpdateShellUniforms(program);
+	glUniform1f(glGetUniformLocation(program, "iTime"), timePassed);
+	glUniform3fv(glGetUniformLocation(program, "lightDir"), 1, (float*)&normalize(lightDirVal)[0]);
+	glUniform1f(glGetUniformLocation(program, "numLightSteps"), numLightStepsVal);
+	glUniform1f(glGetUniformLocation(program, "baseTransmittance"), baseTransmittanceVal);
+	glUniform1f(glGetUniformLocation(program, "densityMult"), densityMultVal);
+	glUniform1f(glGetUniformLocation(program, "densityOfst"), densityOfstVal);
+	glUniform3fv(glGetUniformLocation(program, "cloudScale"), 1, (float*)&(1.0f / cloudScaleVal)[0]);
+	glUniform1f(glGetUniformLocation(program, "detailScale"), detailScaleVal);
+	glUniform3fv(glGetUniformLocation(program, "cloudSpeed"), 1, (float*)&cloudSpeedVal[0]);
+	glUniform3fv(glGetUniformLocation(program, "detailSpeed"), 1, (float*)&detailSpeedVal[0]);
+	glUniform3fv(glGetUniformLocation(program, "cloudMin"), 1, (float*)&cloudMinVal[0]);
+	glUniform3fv(glGetUniformLocation(program, "cloudMax"), 1, (float*)&cloudMaxVal[0]);
+}
+
+//Cloud optical depth toward the sun over the plane at the bottom of the cloud layer, for the terrain.
+//A band of rows is marched per frame, so the whole map follows the clouds every shadowUpdateFrames frames.
+void Renderer::UpdateCloudShadows() {
+	const int shadowSize = 256;
+	vec3 sun = normalize(lightDirVal);
+	shadowMapReady = false;
+	//The terrain's projection onto the plane runs away as the sun sets
+	if (sun.y < 0.05f) {
+		return;
+	}
+
+	bool refreshAll = false;
+	if (!cloudShadowTex) {
+		glGenTextures(1, &cloudShadowTex);
+		glBindTexture(GL_TEXTURE_2D, cloudShadowTex);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R16F, shadowSize, shadowSize);
+		//Terrain whose sun ray misses the layer has no cloud over it
+		float lit[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, lit);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		refreshAll = true;
+	}
+	if (!cloudShadowID || cloudShadowVariant != passVariant) {
+		cloudShadowID = LoadComputePermutation("Shaders/CloudShadowCS.glsl", passVariant.c_str());
+		cloudShadowVariant = passVariant;
+		refreshAll = true;
+	}
+	if (!cloudShadowID) {
+		cloudShadows = false;
+		return;
+	}
+
+	//The map covers the plane points whose sun ray passes through the layer's footprint
+	vec3 layerMin = sparseClouds ? sparseVolume.BoundsMin() : cloudMinVal;
+	vec3 layerMax = sparseClouds ? sparseVolume.BoundsMax() : cloudMaxVal;
+	vec2 offset = vec2(sun.x, sun.z) / sun.y * (layerMax.y - layerMin.y);
+	shadowMinVal = min(vec2(layerMin.x, layerMin.z), vec2(layerMin.x, layerMin.z) - offset);
+	shadowMaxVal = max(vec2(layerMax.x, layerMax.z), vec2(layerMax.x, layerMax.z) - offset);
+	shadowPlaneVal = layerMin.y;
+	shadowTopVal = layerMax.y;
+
+	glUseProgram(cloudShadowID);
+	SetCloudPassUniforms(cloudShadowID);
+	glUniform2fv(glGetUniformLocation(cloudShadowID, "shadowMin"), 1, (float*)&shadowMinVal[0]);
+	glUniform2fv(glGetUniformLocation(cloudShadowID, "shadowMax"), 1, (float*)&shadowMaxVal[0]);
+	glUniform1f(glGetUniformLocation(cloudShadowID, "shadowPlane"), shadowPlaneVal);
+
+	//Bands are whole workgroup rows
+	int rows = shadowSize;
+	if (!refreshAll) {
+		rows = ((shadowSize / max(1, shadowUpdateFrames)) + 7) / 8 * 8;
+	}
+	else {
+		shadowRow = 0;
+	}
+	glUniform1i(glGetUniformLocation(cloudShadowID, "rowOffset"), shadowRow);
+	glBindImageTexture(0, cloudShadowTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R16F);
+	glDispatchCompute(shadowSize / 8, rows / 8, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	glUseProgram(0);
 
+	shadowRow += rows;
+	if (shadowRow >= shadowSize) {
+		shadowRow = 0;
+	}
+	shadowMapReady = true;
+}
+
+//Clouds past farSplit in a cubemap around the camera for FAR_IMPOSTOR. They change little from frame
+//to frame, so one face is marched per frame and all six when the cubemap or the variant is new.
+void Renderer::UpdateCloudImpostor() {
+	const int faceSize = 128;
+	bool refreshAll = false;
+	if (!impostorTex) {
+		glGenTextures(1, &impostorTex);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, impostorTex);
+		glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_RG16F, faceSize, faceSize);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+		refreshAll = true;
+	}
+	if (!impostorID || impostorVariant != passVariant) {
+		impostorID = LoadComputePermutation("Shaders/CloudImpostorCS.glsl", passVariant.c_str());
+		impostorVariant = passVariant;
+		refreshAll = true;
+	}
+	if (!impostorID) {
+		farImpostor = false;
+		return;
+	}
+	//Faces drawn one at a time share a centre, so they stay seamless. Far enough from it
+	//the far clouds would visibly shift, so the whole cubemap moves with the camera.
+	vec3 camPos = getCameraPosition();
+	if (length(camPos - impostorCentre) > 0.1f * farSplitVal) {
+		refreshAll = true;
+	}
+	if (refreshAll) {
+		impostorCentre = camPos;
+	}
+
+	glUseProgram(impostorID);
+	SetCloudPassUniforms(impostorID);
+	glUniform3fv(glGetUniformLocation(impostorID, "camPos"), 1, &impostorCentre[0]);
+	glUniform1f(glGetUniformLocation(impostorID, "zFar"), 100.0f);
+	glUniform1f(glGetUniformLocation(impostorID, "numSteps"), numStepsVal);
+	glUniform1f(glGetUniformLocation(impostorID, "optFactor"), optFactorVal);
+	glUniform1f(glGetUniformLocation(impostorID, "forwardScattering"), forwardScatteringVal);
+	glUniform1f(glGetUniformLocation(impostorID, "backScattering"), backScatteringVal);
+	glUniform1f(glGetUniformLocation(impostorID, "baseBrightness"), baseBrightnessVal);
+	glUniform1f(glGetUniformLocation(impostorID, "phaseFactor"), phaseFactorVal);
+	glUniform1f(glGetUniformLocation(impostorID, "detailDistance"), detailDistanceVal);
+	glUniform1f(glGetUniformLocation(impostorID, "stepGrowth"), stepGrowthVal);
+	glUniform1f(glGetUniformLocation(impostorID, "farSplit"), farSplitVal);
+
+	int faces = refreshAll ? 6 : 1;
+	for (int i = 0; i < faces; i++) {
+		int face = refreshAll ? i : impostorFace;
+		glUniform1i(glGetUniformLocation(impostorID, "face"), face);
+		glBindImageTexture(0, impostorTex, 0, GL_FALSE, face, GL_WRITE_ONLY, GL_RG16F);
+		glDispatchCompute(faceSize / 8, faceSize / 8, 1);
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
 	glUseProgram(0);
+
+	if (!refreshAll) {
+		impostorFace = (impostorFace + 1) % 6;
+	}
+}
+
+//Refines while paused and nothing on screen has changed since the last frame, restarting the average otherwise
+void Renderer::UpdateRefinement() {
+	vec3 camPos = getCameraPosition();
+	vec3 camDir = getCameraDirection();
+	bool terrainReady = normTexture != 0;
+
+	bool still = progressiveRefine && paused && camPos == refineCamPos && camDir == refineCamDir &&
+		timePassed == refineTime && terrainReady == refineTerrain;
+	//A held widget may be changing any setting, and a click may have just changed one
+	if (!offscreen && (ImGui::IsAnyItemActive() || ImGui::IsMouseDown(0) || ImGui::IsMouseReleased(0))) {
+		still = false;
+	}
+
+	refineCamPos = camPos;
+	refineCamDir = camDir;
+	refineTime = timePassed;
+	refineTerrain = terrainReady;
+
+	if (!still) {
+		accumulatedFrames = 0;
+	}
+	refining = still;
 }
 
 void Renderer::UpdateResolution() {
+	//A recording has a fixed frame size
+	if (capture.IsCapturing()) {
+		recordFailed = !capture.Stop();
+	}
+
 	int width, height;
 	glfwGetFramebufferSize(window, &width, &height);
 	glViewport(0, 0, width, height);
@@ -414,6 +1045,8 @@ void Renderer::UpdateResolution() {
 		return;
 	}
 
+	CreateDepthPyramid();
+
 	//Generate compute texture
 	glDeleteTextures(1, &finalTex);
 	glGenTextures(1, &finalTex);
@@ -422,31 +1055,72 @@ void Renderer::UpdateResolution() {
 	glBindTexture(GL_TEXTURE_2D, finalTex);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, WINDOWWIDTH, WINDOWHEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
 
+	//Made again at the new size when refinement next starts
+	glDeleteTextures(1, &historyTex);
+	historyTex = 0;
+	accumulatedFrames = 0;
+
 	glUniform2f(glGetUniformLocation(cloudFragmentID, "iResolution"), WINDOWWIDTH, WINDOWHEIGHT);
 	glUniform2f(glGetUniformLocation(cloudComputeID, "iResolution"), WINDOWWIDTH, WINDOWHEIGHT);
 }
 
 void Renderer::UpdateScene() {
-	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS ||
-		glfwWindowShouldClose(window) != 0) {
+	if (!offscreen && (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS ||
+		glfwWindowShouldClose(window) != 0)) {
 		exitWindow = true;
 		return;
 	}
 
+	updateTextureLoads();
+	//Nothing to draw the terrain from
+	if (drawMountains && isTextureFailed(texture)) {
+		printf("Heightmap failed to load, not drawing the mountains\n");
+		drawMountains = false;
+	}
+	if (!normTexture && isTextureReady(texture)) {
+		GenerateNormalMap();
+	}
+	//Built the first time the backend is selected
+	if (chunkedTerrain && !terrainLOD.IsBuilt() && isTextureReady(texture)) {
+		terrainLOD.Build(texture);
+	}
+	if ((frustumCulling || occlusionCulling) && !terrainCuller.IsBuilt() && isTextureReady(texture)) {
+		terrainCuller.Build(vertices, uvs, texture);
+	}
+	if (evolvingClouds && !noiseEvolver.IsCreated()) {
+		noiseEvolver.Create(&noiseGenerator, worleyDesc, detailDesc, worleyTex, detailTex);
+	}
+	//Eight times the base noise across in 32 voxel pages, 512 of them cached
+	if (virtualNoise && !virtualVolume.IsCreated()) {
+		virtualNoise = virtualVolume.Create(&noiseGenerator, worleyDesc, 8, 32, 512);
+	}
+
 	if (windowChanged) {
 		windowChanged = false;
 		UpdateResolution();
 		UpdateCloudUniforms();
 	}
 
-	glUseProgram(currentCloudID);
 	// Compute the MVP matrix from keyboard and mouse input
-	computeMatricesFromInputs(window, inMenu);
+	if (offscreen) {
+		computeMatrices();
+	}
+	else {
+		computeMatricesFromInputs(window, inMenu);
+	}
 	ProjectionMatrix = getProjectionMatrix();
 	ViewMatrix = getViewMatrix();
 
+	//Once the camera has moved, as refinement picks the variant
+	UpdateRefinement();
+	if (SelectCloudVariant()) {
+		UpdateCloudUniforms();
+	}
+
+	glUseProgram(currentCloudID);
+
 	//Handle settings menu
-	if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS) {
+	if (!offscreen && glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS) {
 		if (!pausePress) {
 			pausePress = true;
 			if (inMenu) {
@@ -472,6 +1146,7 @@ void Renderer::UpdateScene() {
 		glUniform3fv(detailSpeed, 1, (float*)&detailSpeedVal[0]);
 		glUniform3fv(cloudMin, 1, (float*)&cloudMinVal[0]);
 		glUniform3fv(cloudMax, 1, (float*)&cloudMaxVal[0]);
+		UpdateShellUniforms(currentCloudID);
 	}
 	if (subMenu == 2) {
 		glUniform3fv(lightCol, 1, (float*)&lightColVal[0]);
@@ -488,9 +1163,12 @@ void Renderer::UpdateScene() {
 		glUniform1f(backScattering, backScatteringVal);
 		glUniform1f(baseBrightness, baseBrightnessVal);
 		glUniform1f(phaseFactor, phaseFactorVal);
+		glUniform1f(glGetUniformLocation(currentCloudID, "detailDistance"), detailDistanceVal);
+		glUniform1f(glGetUniformLocation(currentCloudID, "stepGrowth"), stepGrowthVal);
 	}
 	
-	if (!paused) {
+	//Offscreen the clock is set by RenderFrames
+	if (!paused && !offscreen) {
 		timePassed += ImGui::GetIO().DeltaTime;
 	}
 	glUseProgram(0);
@@ -502,34 +1180,253 @@ void Renderer::RenderScene() {
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	if (drawMountains) {
+	//Nothing changes once refinement has converged, so the average is all that is drawn
+	bool converged = refining && accumulatedFrames >= refineFrames;
+
+	//The terrain appears once its textures have finished loading
+	if (drawMountains && normTexture && !converged) {
+		//Before the terrain reads it, and still valid while the view is
+		if (cloudShadows && !refining) {
+			UpdateCloudShadows();
+		}
+
+		if (terrainTimerActive) {
+			GLint available = 0;
+			glGetQueryObjectiv(terrainTimerQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint64 elapsed;
+				glGetQueryObjectui64v(terrainTimerQuery, GL_QUERY_RESULT, &elapsed);
+				terrainPassMs = elapsed / 1000000.0f;
+				terrainTimerActive = false;
+			}
+		}
+		if (!terrainTimerActive) {
+			glBeginQuery(GL_TIME_ELAPSED, terrainTimerQuery);
+		}
+
 		RenderMountain();
+
+		if (!terrainTimerActive) {
+			glEndQuery(GL_TIME_ELAPSED);
+			terrainTimerActive = true;
+		}
 	}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+
+	if (!converged) {
+		//This frame's terrain depth hides patches in the frames after it
+		if (drawMountains && normTexture && occlusionCulling && !(chunkedTerrain && terrainLOD.IsBuilt())) {
+			terrainCuller.UpdateOcclusion(bufferDepthTex, WINDOWWIDTH, WINDOWHEIGHT, MVP);
+		}
+		BuildDepthPyramid();
+	}
+
+	//A few slices of the next noise volume each frame, held while paused
+	if (evolvingClouds && (!paused || offscreen) && !refining) {
+		noiseEvolver.Update(evolveSlices, evolveStep);
+	}
 
 	// Start the Dear ImGui frame
-	ImGui_ImplOpenGL3_NewFrame();
-	ImGui_ImplGlfw_NewFrame();
-	ImGui::NewFrame();
-	RenderUI();
-	ImGui::Render();
+	if (!offscreen) {
+		ImGui_ImplOpenGL3_NewFrame();
+		ImGui_ImplGlfw_NewFrame();
+		ImGui::NewFrame();
+		RenderUI();
+		ImGui::Render();
+	}
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	if (usingCompute) {
-		RenderComputeClouds();
+	if (cloudTimerActive) {
+		GLint available = 0;
+		glGetQueryObjectiv(cloudTimerQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed;
+			glGetQueryObjectui64v(cloudTimerQuery, GL_QUERY_RESULT, &elapsed);
+			cloudPassMs = elapsed / 1000000.0f;
+			cloudTimerActive = false;
+		}
+	}
+	if (!cloudTimerActive) {
+		glBeginQuery(GL_TIME_ELAPSED, cloudTimerQuery);
+	}
+
+	if (converged) {
+		DrawFullscreen(historyTex);
 	}
 	else {
-		RenderClouds();
+		if (farImpostor && !refining) {
+			UpdateCloudImpostor();
+		}
+		if (usingCompute) {
+			RenderComputeClouds();
+		}
+		else {
+			RenderClouds();
+		}
+		if (refining) {
+			//The next frame reads the average back
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+			accumulatedFrames++;
+		}
 	}
 
-	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-	glfwSwapBuffers(window);
-	glfwPollEvents();
+	if (!cloudTimerActive) {
+		glEndQuery(GL_TIME_ELAPSED);
+		cloudTimerActive = true;
+	}
+
+	//Pages requested by this frame are generated once its requests are read back, changing the image
+	if (virtualNoise && virtualVolume.Update(virtualPagesPerFrame) > 0) {
+		accumulatedFrames = 0;
+	}
+
+	//Recorded before the UI is drawn on top
+	capture.CaptureFrame(outputFBO);
+
+	if (!offscreen) {
+		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+	}
+	swapContext(context);
 	return;
 }
 
+void Renderer::SetView(int view) {
+	paused = true;
+	timePassed = 0;
+	if (view == 1) {
+		setCameraPosition(vec3(0, 5, 0));
+		setCameraDirection(0,0);
+	}
+	else if (view == 2) {
+		setCameraPosition(vec3(6, 0, 4));
+		setCameraDirection(pi<float>() / 8.0f, -5.0f*pi<float>()/8.0f);
+	}
+	else if (view == 3) {
+		setCameraPosition(vec3(35, 40, 15));
+		setCameraDirection(-2.0f*pi<float>() / 8.0f, -5.0f * pi<float>() / 8.0f);
+	}
+	UpdateCloudUniforms();
+}
+
+bool Renderer::ExportNoiseTex(const char* directory) {
+	GLuint volumes[2] = { worleyTex, detailTex };
+	const char* names[2] = { "worley.dds", "worleyDetail.dds" };
+
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	for (int i = 0; i < 2; i++) {
+		GLint width, height, depth, levels;
+		//Units 4 and 5 already hold the volumes
+		glActiveTexture(GL_TEXTURE4 + i);
+		glBindTexture(GL_TEXTURE_3D, volumes[i]);
+		glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_HEIGHT, &height);
+		glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_DEPTH, &depth);
+		glGetTexParameteriv(GL_TEXTURE_3D, GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
+
+		//Every mip level, one after the other
+		std::vector<float> voxels;
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		for (int level = 0; level < levels; level++) {
+			size_t offset = voxels.size();
+			voxels.resize(offset + (size_t)max(width >> level, 1) * max(height >> level, 1) * max(depth >> level, 1) * 4);
+			glGetTexImage(GL_TEXTURE_3D, level, GL_RGBA, GL_FLOAT, &voxels[offset]);
+		}
+
+		std::string path = std::string(directory) + "/" + names[i];
+		if (!writeDDSVolume(path.c_str(), width, height, depth, &voxels[0], levels)) {
+			return false;
+		}
+		printf("Wrote %s (%dx%dx%d)\n", path.c_str(), width, height, depth);
+	}
+	return true;
+}
+
+bool Renderer::ExportSparseVolume(const char* path) {
+	//Sampled on the CPU like the reference renderer does
+	GLuint textures[2] = { worleyTex, detailTex };
+	NoiseVolume noise[2];
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	for (int i = 0; i < 2; i++) {
+		GLint size;
+		//Units 4 and 5 already hold the volumes
+		glActiveTexture(GL_TEXTURE4 + i);
+		glBindTexture(GL_TEXTURE_3D, textures[i]);
+		glGetTexLevelParameteriv(GL_TEXTURE_3D, 0, GL_TEXTURE_WIDTH, &size);
+		noise[i].size = size;
+		noise[i].data.resize((size_t)size * size * size);
+		glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, &noise[i].data[0]);
+	}
+
+	//Eight voxels per unit, so the default box is 40 x 8 x 40 bricks
+	const float voxelSize = 0.125f;
+	ivec3 voxels = ivec3(ceil((cloudMaxVal - cloudMinVal) / voxelSize));
+	vec3 scale = 1.0f / cloudScaleVal;
+	std::vector<unsigned char> densities((size_t)voxels.x * voxels.y * voxels.z);
+	for (int z = 0; z < voxels.z; z++) {
+		for (int y = 0; y < voxels.y; y++) {
+			for (int x = 0; x < voxels.x; x++) {
+				//sampleDensity without the weather map
+				vec3 pos = cloudMinVal + (vec3(x, y, z) + 0.5f) * voxelSize;
+				vec3 edgeDst = min(pos - cloudMinVal, cloudMaxVal - pos);
+				float edgeFade = min(min(edgeDst.x, min(edgeDst.y, edgeDst.z)), 1.0f);
+				float density = min(1.0f, (noise[0].Sample(pos * scale * 0.03f) - densityOfstVal) * densityMultVal) * edgeFade;
+				if (detailNoise && density > 0.01f) {
+					density -= noise[1].Sample(pos * scale * 0.15f * detailScaleVal);
+				}
+				densities[((size_t)z * voxels.y + y) * voxels.x + x] = (unsigned char)(clamp(density, 0.0f, 1.0f) * 255.0f + 0.5f);
+			}
+		}
+	}
+	return SparseVolume::Write(path, densities, voxels, voxelSize, cloudMinVal);
+}
+
+bool Renderer::RenderFrames(const char* outputPrefix, int frames, float frameTime) {
+	//The capture's frame rate is its inverse
+	if (frameTime <= 0.0f) {
+		printf("Invalid frame time %f\n", frameTime);
+		return false;
+	}
+	float startTime = timePassed;
+	float cloudTotalMs = 0.0f;
+	float terrainTotalMs = 0.0f;
+	paused = true;
+
+	//Every frame of a sequence needs the terrain
+	finishTextureLoads();
+	if (isTextureFailed(texture)) {
+		printf("Heightmap failed to load, nothing rendered\n");
+		return false;
+	}
+
+	if (!capture.Start(outputPrefix, WINDOWWIDTH, WINDOWHEIGHT, (int)(1.0f / frameTime + 0.5f))) {
+		return false;
+	}
+	for (int frame = 0; frame < frames && isRunning(); frame++) {
+		timePassed = startTime + frame * frameTime;
+		UpdateScene();
+		RenderScene();
+
+		//Offline, so waiting for the timer here is fine
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(cloudTimerQuery, GL_QUERY_RESULT, &elapsed);
+		cloudTotalMs += elapsed / 1000000.0f;
+		if (terrainTimerActive) {
+			glGetQueryObjectui64v(terrainTimerQuery, GL_QUERY_RESULT, &elapsed);
+			terrainTotalMs += elapsed / 1000000.0f;
+		}
+	}
+	if (!capture.Stop()) {
+		return false;
+	}
+
+	printf("Rendered %d frames at %dx%d, clouds %.3f ms/frame, terrain %.3f ms/frame (%s)\n", frames, WINDOWWIDTH, WINDOWHEIGHT,
+		cloudTotalMs / max(1, frames), terrainTotalMs / max(1, frames), chunkedTerrain ? "chunked LOD" : "tessellated");
+	return true;
+}
+
 void Renderer::RenderUI() {
 	ImGuiWindowFlags window_flags = 0;
 	window_flags |= ImGuiWindowFlags_NoTitleBar;
@@ -540,13 +1437,13 @@ void Renderer::RenderUI() {
 	if (inMenu) {
 		//Setup UI size depending on submenu
 		if (subMenu == 0) {
-			ImGui::SetNextWindowSize(ImVec2(400.0f, 270.0f));
+			ImGui::SetNextWindowSize(ImVec2(400.0f, 457.0f));
 		}
 		else if (subMenu == 1) {
-			ImGui::SetNextWindowSize(ImVec2(400.0f, 360.0f));
+			ImGui::SetNextWindowSize(ImVec2(400.0f, 982.0f));
 		}
 		else if (subMenu == 2) {
-			ImGui::SetNextWindowSize(ImVec2(420.0f, 360.0f));
+			ImGui::SetNextWindowSize(ImVec2(420.0f, 521.0f));
 		}
 
 		ImGui::Begin("Options", (bool*)0, window_flags);
@@ -564,6 +1461,13 @@ void Renderer::RenderUI() {
 			ImGui::Text("\n");
 			ImGui::Checkbox("Show FPS", &fpsCount);
 			ImGui::Checkbox("Paused", &paused);
+			ImGui::Checkbox("Progressive Refinement", &progressiveRefine);
+			if (refining) {
+				ImGui::SameLine();
+				ImGui::Text("%d / %d frames", min(accumulatedFrames, refineFrames), refineFrames);
+			}
+			ImGui::SliderInt("Refine Frames", &refineFrames, 8, 256);
+			ImGui::SliderFloat("Refine Light Steps", &refineLightStepsVal, 8.0f, 64.0f, "%.0f");
 			if (ImGui::Button("Toggle Shader")) {
 				usingCompute = !usingCompute;
 				if (usingCompute) {
@@ -582,33 +1486,51 @@ void Renderer::RenderUI() {
 				ImGui::Text("Current Shader: Fragment");
 			}
 
+			if (ImGui::Button(capture.IsCapturing() ? "Stop Recording" : "Record")) {
+				if (capture.IsCapturing()) {
+					recordFailed = !capture.Stop();
+				}
+				else {
+					//Stamped with the rate the app is running at, so playback keeps real time
+					int fps = max(1, (int)(ImGui::GetIO().Framerate + 0.5f));
+					recordFailed = !capture.Start("capture.y4m", WINDOWWIDTH, WINDOWHEIGHT, fps);
+				}
+			}
+			ImGui::SameLine();
+			if (capture.IsCapturing()) {
+				ImGui::Text("Recording to capture.y4m");
+			}
+			else if (recordFailed) {
+				ImGui::Text("Recording failed, see the console");
+			}
+
 			ImGui::Text("\n");
 			ImGui::Checkbox("Draw Mountains", &drawMountains);
 			ImGui::SliderFloat("Mountain Height", &mountainHeight, -3.0f, 0.0f, "%2.1f");
+			ImGui::Checkbox("Chunked LOD Terrain", &chunkedTerrain);
+			if (chunkedTerrain) {
+				ImGui::SameLine();
+				ImGui::Text("%d chunks, %dk tris", terrainLOD.ChunksDrawn(), terrainLOD.TrianglesDrawn() / 1000);
+			}
+			ImGui::SliderFloat("LOD Pixel Error", &terrainPixelError, 0.5f, 16.0f, "%2.1f");
+			ImGui::Checkbox("Frustum Culling", &frustumCulling);
+			ImGui::SameLine();
+			ImGui::Checkbox("Occlusion Culling", &occlusionCulling);
+			if ((frustumCulling || occlusionCulling) && !chunkedTerrain) {
+				ImGui::Text("%d / %d patches", terrainCuller.PatchesDrawn(), terrainCuller.PatchCount());
+			}
 
 			ImGui::Text("\n");
 			if (ImGui::Button("View 1")) {
-				paused = true;
-				timePassed = 0;
-				setCameraPosition(vec3(0, 5, 0));
-				setCameraDirection(0,0);
-				UpdateCloudUniforms();
+				SetView(1);
 			}
 			ImGui::SameLine();
 			if (ImGui::Button("View 2")) {
-				paused = true;
-				timePassed = 0;
-				setCameraPosition(vec3(6, 0, 4));
-				setCameraDirection(pi<float>() / 8.0f, -5.0f*pi<float>()/8.0f);
-				UpdateCloudUniforms();
+				SetView(2);
 			}
 			ImGui::SameLine();
 			if (ImGui::Button("View 3")) {
-				paused = true;
-				timePassed = 0;
-				setCameraPosition(vec3(35, 40, 15));
-				setCameraDirection(-2.0f*pi<float>() / 8.0f, -5.0f * pi<float>() / 8.0f);
-				UpdateCloudUniforms();
+				SetView(3);
 			}
 
 			if (ImGui::Button("Clouds 1")) {
@@ -642,15 +1564,68 @@ void Renderer::RenderUI() {
 			ImGui::Text("\nCloud Shape");
 			ImGui::SliderFloat3("Scale", (float*)&cloudScaleVal, 0.0f, 5.0f);
 			ImGui::SliderFloat("Detail Scale", &detailScaleVal, 0.0f, 5.0f, "%2.1f");
+			ImGui::Checkbox("Detail Noise", &detailNoise);
+			bool noiseSize = ImGui::Combo("Noise Size", &noiseSizeIndex, "64 / 32\0" "128 / 64\0" "256 / 128\0");
+			bool noiseFormat = ImGui::Combo("Noise Format", &noiseFormatIndex, "RGBA32F\0" "R16F\0" "R8\0");
+			if (noiseSize || noiseFormat) {
+				static const GLenum formats[3] = { GL_RGBA32F, GL_R16F, GL_R8 };
+				int size = 64 << noiseSizeIndex;
+				worleyDesc = defaultBaseNoise(size, formats[noiseFormatIndex]);
+				detailDesc = defaultDetailNoise(size / 2, formats[noiseFormatIndex]);
+				CreateNoiseTex();
+			}
+			ImGui::Text("%.1f MB of noise", (worleyDesc.MemorySize() + detailDesc.MemorySize()) / (1024.0f * 1024.0f));
+			ImGui::Checkbox("Virtual Noise", &virtualNoise);
+			ImGui::SliderInt("Pages / Frame", &virtualPagesPerFrame, 1, 64);
+			if (virtualVolume.IsCreated()) {
+				ImGui::Text("%d / %d pages cached, %d requested, %.1f MB", virtualVolume.CachedPages(), virtualVolume.PageCount(),
+					virtualVolume.RequestedPages(), virtualVolume.MemorySize() / (1024.0f * 1024.0f));
+			}
 			ImGui::Text("\nCloud Speed");
 			ImGui::SliderFloat3("Main", (float*)&cloudSpeedVal, -0.05f, 0.05f);
 			ImGui::SliderFloat3("Detail", (float*)&detailSpeedVal, -0.05f, 0.05f);
+			ImGui::Checkbox("Evolving Noise", &evolvingClouds);
+			ImGui::SliderInt("Slices / Frame", &evolveSlices, 8, 128);
+			ImGui::SliderFloat("Evolution Step", &evolveStep, 0.0f, 0.1f, "%4.3f");
 			ImGui::Text("\nDensity Texture Sampling");
 			ImGui::SliderFloat("Multiplier", &densityMultVal, -10.0f, 20.0f, "%2.1f");
 			ImGui::SliderFloat("Offset", &densityOfstVal, 0.0f, 1.0f, "%3.2f");
 			ImGui::Text("\nCloud Boundaries");
-			ImGui::SliderFloat3("Minimum", (float*)&cloudMinVal, -50.0f, 0.0f);
-			ImGui::SliderFloat3("Maximum", (float*)&cloudMaxVal, 0.0f, 50.0f);
+			bool boundsMin = ImGui::SliderFloat3("Minimum", (float*)&cloudMinVal, -50.0f, 0.0f);
+			bool boundsMax = ImGui::SliderFloat3("Maximum", (float*)&cloudMaxVal, 0.0f, 50.0f);
+			ImGui::Checkbox("Spherical Shell", &sphericalShell);
+			ImGui::SliderFloat("Planet Radius", &planetRadiusVal, 100.0f, 10000.0f, "%.0f");
+			ImGui::SliderFloat("Cloud Distance", &shellDistanceVal, 20.0f, 1000.0f, "%.0f");
+			ImGui::SliderFloat("Max View Steps", &maxViewStepsVal, 32.0f, 512.0f, "%.0f");
+			ImGui::Checkbox("Cloud Banks", &cloudBanks);
+			bool bankCount = ImGui::SliderInt("Bank Count", &cloudBankCount, 1, 256);
+			if (boundsMin || boundsMax || bankCount) {
+				CreateCloudBanks();
+			}
+			ImGui::Text("%d banks, %d tree nodes", cloudVolumes.VolumeCount(), cloudVolumes.NodeCount());
+			ImGui::Text("\nAuthored Volume");
+			if (ImGui::Checkbox("Sparse Volume", &sparseClouds) && sparseClouds && !sparseVolume.IsLoaded()) {
+				sparseClouds = sparseVolume.Load(sparseVolumePath);
+			}
+			ImGui::SliderFloat("Volume Density", &sparseDensityVal, 0.0f, 10.0f, "%2.1f");
+			if (sparseVolume.IsLoaded()) {
+				ImGui::Text("%d bricks, %.1f MB", sparseVolume.BrickCount(), sparseVolume.MemorySize() / (1024.0f * 1024.0f));
+			}
+			else {
+				ImGui::Text("%s not loaded", sparseVolumePath);
+				ImGui::SameLine();
+				if (ImGui::Button("Bake From Noise") && ExportSparseVolume(sparseVolumePath)) {
+					sparseClouds = sparseVolume.Load(sparseVolumePath);
+				}
+			}
+			ImGui::Text("\nWeather");
+			ImGui::Checkbox("Weather Map", &weatherMap);
+			bool coverage = ImGui::SliderFloat("Coverage", &weatherCoverageVal, 0.0f, 1.0f, "%3.2f");
+			bool scale = ImGui::SliderFloat("Weather Scale", &weatherScaleVal, 1.0f, 16.0f, "%2.1f");
+			bool seed = ImGui::SliderInt("Weather Seed", &weatherSeed, 0, 15);
+			if (coverage || scale || seed) {
+				CreateWeatherTex();
+			}
 		}
 		else if (subMenu == 2) {
 			ImGui::Text("\nProperties");
@@ -667,10 +1642,17 @@ void Renderer::RenderUI() {
 			);
 			ImGui::SliderFloat3("Direction", (float*)&lightDirVal, -1.0f, 1.0f);
 			ImGui::SliderFloat("Base Transmittance", &baseTransmittanceVal, 0.0f, 1.0f, "%3.2f");
+			ImGui::Checkbox("Cloud Shadows", &cloudShadows);
+			ImGui::SliderInt("Shadow Update Frames", &shadowUpdateFrames, 1, 32);
 
 			ImGui::Text("\nRaymarching Step Size");
 			ImGui::SliderFloat("Camera -> Cloud", &numStepsVal, 0.01f, 1.0f, "%5.4f");
 			ImGui::SliderFloat("Cloud -> Light", &numLightStepsVal, 0.0f, 50.0f, "%.0f");
+			ImGui::Checkbox("Noise LOD", &noiseLod);
+			ImGui::SliderFloat("Detail Distance", &detailDistanceVal, 1.0f, 100.0f, "%.0f");
+			ImGui::SliderFloat("Step Growth", &stepGrowthVal, 0.0f, 0.2f, "%4.3f");
+			ImGui::Checkbox("Far Impostor", &farImpostor);
+			ImGui::SliderFloat("Far Split", &farSplitVal, 5.0f, 100.0f, "%.0f");
 
 			ImGui::Text("\n");
 			ImGui::SliderFloat("Step Optimization", &optFactorVal, 0.0f, 1.0f, "%3.2f");
@@ -689,32 +1671,64 @@ void Renderer::RenderUI() {
 
 	if (fpsCount) {
 		ImGui::SetNextWindowPos(ImVec2(WINDOWWIDTH-160, 0));
-		ImGui::SetNextWindowSize(ImVec2(160.0f, 60.0f));
+		ImGui::SetNextWindowSize(ImVec2(160.0f, capture.IsCapturing() ? 115.0f : 95.0f));
 		ImGui::Begin("FPS", (bool*)0, window_flags);
 		ImGui::Text("Application average \n%.3f ms/frame \n(%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+		ImGui::Text("Terrain: %.3f ms", terrainPassMs);
+		ImGui::Text("Clouds: %.3f ms", cloudPassMs);
+		if (capture.IsCapturing()) {
+			ImGui::Text("Capture: %.3f ms", capture.AverageCaptureMs());
+		}
 		ImGui::End();
 	}
 }
 
 void Renderer::RenderMountain() {
-	glUseProgram(programID);
-	glUniform1f(glGetUniformLocation(programID, "iTime"), timePassed);
-	glUniform3fv(glGetUniformLocation(programID, "lightDir"), 1, (float*)&normalize(lightDirVal)[0]);
+	bool chunked = chunkedTerrain && terrainLOD.IsBuilt();
+	GLuint program = chunked ? terrainProgramID : programID;
+
+	glUseProgram(program);
+	glUniform1f(glGetUniformLocation(program, "iTime"), timePassed);
+	glUniform3fv(glGetUniformLocation(program, "lightDir"), 1, (float*)&normalize(lightDirVal)[0]);
 
 	ModelMatrix = glm::translate(
 		glm::scale(glm::mat4(1.0),glm::vec3(20.0,15.0,20.0)),
 		glm::vec3(0.0,mountainHeight,0.0));
 	MVP = ProjectionMatrix * ViewMatrix * ModelMatrix;
 
-	glUniformMatrix4fv(matrixID, 1, GL_FALSE, &MVP[0][0]);
+	glUniformMatrix4fv(glGetUniformLocation(program, "MVP"), 1, GL_FALSE, &MVP[0][0]);
+	glUniformMatrix4fv(glGetUniformLocation(program, "M"), 1, GL_FALSE, &ModelMatrix[0][0]);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, texture);
-	glUniform1i(textureID, 0);
+	glUniform1i(glGetUniformLocation(program, "heightMap"), 0);
 
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, normTexture);
-	glUniform1i(normTextureID, 1);
+	glUniform1i(glGetUniformLocation(program, "normalMap"), 1);
+
+	bool shadows = cloudShadows && shadowMapReady;
+	glUniform1i(glGetUniformLocation(program, "cloudShadows"), shadows);
+	if (shadows) {
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D, cloudShadowTex);
+		glUniform1i(glGetUniformLocation(program, "cloudShadowMap"), 2);
+		glUniform2fv(glGetUniformLocation(program, "shadowMin"), 1, (float*)&shadowMinVal[0]);
+		glUniform2fv(glGetUniformLocation(program, "shadowMax"), 1, (float*)&shadowMaxVal[0]);
+		glUniform1f(glGetUniformLocation(program, "shadowPlane"), shadowPlaneVal);
+		glUniform1f(glGetUniformLocation(program, "shadowTop"), shadowTopVal);
+		glUniform1f(glGetUniformLocation(program, "baseTransmittance"), baseTransmittanceVal);
+	}
+
+	if (chunked) {
+		terrainLOD.Draw(ModelMatrix, ViewMatrix, ProjectionMatrix, WINDOWHEIGHT, terrainPixelError);
+		return;
+	}
+
+	if ((frustumCulling || occlusionCulling) && terrainCuller.IsBuilt()) {
+		terrainCuller.Draw(MVP, occlusionCulling);
+		return;
+	}
 
 	glEnableVertexAttribArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
@@ -732,6 +1746,57 @@ void Renderer::RenderMountain() {
 	return;
 }
 
+//Noise, weather and variant inputs shared by the cloud shaders and the shadow pass
+void Renderer::BindCloudInputs(GLuint program) {
+	if (evolvingClouds && noiseEvolver.IsCreated()) {
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_3D, noiseEvolver.OlderWorley());
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_3D, noiseEvolver.OlderDetail());
+		glActiveTexture(GL_TEXTURE6);
+		glBindTexture(GL_TEXTURE_3D, noiseEvolver.NewerWorley());
+		glActiveTexture(GL_TEXTURE7);
+		glBindTexture(GL_TEXTURE_3D, noiseEvolver.NewerDetail());
+		glUniform1f(glGetUniformLocation(program, "noiseBlend"), noiseEvolver.Blend());
+	}
+	else {
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_3D, worleyTex);
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_3D, detailTex);
+	}
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_2D, weatherTex);
+	glActiveTexture(GL_TEXTURE9);
+	glBindTexture(GL_TEXTURE_2D, heightProfileTex);
+
+	if (cloudBanks) {
+		cloudVolumes.Bind();
+		glUniform1i(glGetUniformLocation(program, "cloudVolumeCount"), cloudVolumes.VolumeCount());
+	}
+	if (sparseClouds) {
+		glActiveTexture(GL_TEXTURE10);
+		glBindTexture(GL_TEXTURE_3D, sparseVolume.TableTexture());
+		glActiveTexture(GL_TEXTURE11);
+		glBindTexture(GL_TEXTURE_3D, sparseVolume.AtlasTexture());
+		glUniform3fv(glGetUniformLocation(program, "sparseMin"), 1, &sparseVolume.BoundsMin()[0]);
+		glUniform3fv(glGetUniformLocation(program, "sparseMax"), 1, &sparseVolume.BoundsMax()[0]);
+		glUniform1f(glGetUniformLocation(program, "sparseVoxelSize"), sparseVolume.VoxelSize());
+		glUniform1f(glGetUniformLocation(program, "sparseDensity"), sparseDensityVal);
+	}
+	if (virtualNoise) {
+		glActiveTexture(GL_TEXTURE12);
+		glBindTexture(GL_TEXTURE_3D, virtualVolume.PageTable());
+		glActiveTexture(GL_TEXTURE13);
+		glBindTexture(GL_TEXTURE_3D, virtualVolume.PageCache());
+		glActiveTexture(GL_TEXTURE14);
+		glBindTexture(GL_TEXTURE_3D, virtualVolume.Fallback());
+		virtualVolume.BindRequests();
+		glUniform1i(glGetUniformLocation(program, "virtualTiles"), virtualVolume.Tiles());
+		glUniform1i(glGetUniformLocation(program, "virtualPageSize"), virtualVolume.PageSize());
+	}
+}
+
 void Renderer::PrepareCloudTextures() {
 	glUseProgram(currentCloudID);
 
@@ -742,8 +1807,33 @@ void Renderer::PrepareCloudTextures() {
 	glUniform1i(bufferTexID, 1);
 
 	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, bufferDepthTex);
-	glUniform1i(depthTexID, 2);
+	glBindTexture(GL_TEXTURE_2D, linearDepthTex);
+	glUniform1i(linearDepthTexID, 2);
+
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, depthBoundsTex);
+	glUniform1i(glGetUniformLocation(currentCloudID, "depthBoundsTex"), 3);
+
+	BindCloudInputs(currentCloudID);
+	if (farImpostor) {
+		glActiveTexture(GL_TEXTURE15);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, impostorTex);
+		glUniform1f(glGetUniformLocation(currentCloudID, "farSplit"), farSplitVal);
+	}
+	if (refining) {
+		if (!historyTex) {
+			glGenTextures(1, &historyTex);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, historyTex);
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, WINDOWWIDTH, WINDOWHEIGHT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		}
+		glBindImageTexture(1, historyTex, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+		glUniform1i(glGetUniformLocation(currentCloudID, "historyTex"), 1);
+		glUniform1i(glGetUniformLocation(currentCloudID, "accumulatedFrames"), accumulatedFrames);
+		glUniform1f(glGetUniformLocation(currentCloudID, "numLightSteps"), refineLightStepsVal);
+	}
 
 	glUniform3fv(cameraPos, 1, &getCameraPosition()[0]);
 	glUniform3fv(cameraDir, 1, &getCameraDirection()[0]);
@@ -779,13 +1869,20 @@ void Renderer::RenderComputeClouds() {
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, WINDOWWIDTH, WINDOWHEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
 	glBindImageTexture(0, finalTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
-	glDispatchCompute(WINDOWWIDTH / 8, WINDOWHEIGHT / 8, 1);
+	//Round up so partial tiles at the edges are still shaded
+	glDispatchCompute((WINDOWWIDTH + cloudGroupSize[0] - 1) / cloudGroupSize[0],
+		(WINDOWHEIGHT + cloudGroupSize[1] - 1) / cloudGroupSize[1], 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+	DrawFullscreen(finalTex);
+}
 
+void Renderer::DrawFullscreen(GLuint tex) {
 	glUseProgram(passthroughID);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D, finalTex);
-	glUniform1i(glGetUniformLocation(cloudComputeID, "tex"), 0);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glUniform1i(glGetUniformLocation(passthroughID, "tex"), 0);
 
 	glEnableVertexAttribArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, cloudVertexbuffer);
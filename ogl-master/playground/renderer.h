@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <vector>
+#include <string>
 
 // Include GLEW
 #include <GL/glew.h>
@@ -24,6 +25,16 @@ using namespace glm;
 #include <common/texture.hpp>
 #include <common/controls.h>
 #include <common/objloader.hpp>
+#include <common/context.hpp>
+
+#include "capture.h"
+#include "terrainlod.h"
+#include "terraincull.h"
+#include "noisegen.h"
+#include "noiseevolver.h"
+#include "cloudvolumes.h"
+#include "sparsevolume.h"
+#include "virtualnoise.h"
 
 static const GLfloat cloudVertices[] = {
 		-1.0f, -1.0f, 0.0f,
@@ -38,25 +49,57 @@ static bool windowChanged = false;
 
 class Renderer {
 public:
-	Renderer();
+	Renderer(ContextType contextType = CONTEXT_WINDOW, int width = WINDOWWIDTH, int height = WINDOWHEIGHT);
 	~Renderer();
 
 	bool isRunning() { return !exitWindow; };
 
 	void UpdateScene();
 	void RenderScene();
+
+	// Camera presets, as on the View buttons
+	void SetView(int view);
+
+	// Batch mode: renders frames at fixed time steps to <outputPrefix>0000.png, ...
+	// or to a single stream if outputPrefix ends in .y4m
+	bool RenderFrames(const char* outputPrefix, int frames, float frameTime);
+	// Writes the generated noise volumes to <directory>/worley.dds and
+	// worleyDetail.dds, which CreateNoiseTex loads instead of recomputing
+	// when their size and format match
+	bool ExportNoiseTex(const char* directory);
+	// Bakes the density of the cloud box, from the noise volumes at time 0, into
+	// a sparse volume file that the "Sparse Volume" setting can load
+	bool ExportSparseVolume(const char* path);
 protected:
 	void Initialize();
 	void UpdateCloudUniforms();
+	std::string CloudVariantDefines(bool progressive);
+	bool SelectCloudVariant();
+	void GenerateNormalMap();
+	void CreateDepthPyramid();
+	void BuildDepthPyramid();
 	void CreateNoiseTex();
+	void CreateWeatherTex();
+	void SetCloudSamplers(GLuint program);
+	void UpdateShellUniforms(GLuint program);
+	void SetCloudPassUniforms(GLuint program);
+	void UpdateCloudShadows();
+	void UpdateCloudImpostor();
+	void UpdateRefinement();
+	void CreateCloudBanks();
+	bool LoadNoiseTex();
 	void RenderUI();
 	void RenderMountain();
+	void BindCloudInputs(GLuint program);
 	void PrepareCloudTextures();
 	void RenderClouds();
 	void RenderComputeClouds();
+	void DrawFullscreen(GLuint tex);
 	void UpdateResolution();
 
+	RenderContext context;
 	GLFWwindow* window;
+	bool offscreen;
 	bool exitWindow;
 
 	bool inMenu;
@@ -66,38 +109,142 @@ protected:
 	bool paused;
 
 	bool usingCompute;
+	bool detailNoise;
+	std::string cloudVariant;
+	//Variant of the shadow and impostor passes, which never refine
+	std::string passVariant;
 	bool drawMountains;
 	float mountainHeight;
+	//Terrain backend: tessellated patches, or chunked LOD meshes for GPUs where tessellation is slow
+	bool chunkedTerrain;
+	float terrainPixelError;
+	TerrainLOD terrainLOD;
+	//Patch culling for the tessellated backend, against the frustum and optionally last frame's depth
+	bool frustumCulling;
+	bool occlusionCulling;
+	TerrainCuller terrainCuller;
+	//Noise rebuilt a few slices per frame with a moving seed, crossfaded between complete sets
+	bool evolvingClouds;
+	int evolveSlices;
+	float evolveStep;
+	NoiseEvolver noiseEvolver;
+	//Far samples read coarser noise mips, skip the detail noise past detailDistanceVal and take longer steps
+	bool noiseLod;
+	float detailDistanceVal;
+	float stepGrowthVal;
+	//Coverage and cloud type over the box, scaling density by a height profile per type
+	bool weatherMap;
+	float weatherCoverageVal;
+	float weatherScaleVal;
+	int weatherSeed;
+	GLuint weatherTex;
+	GLuint heightProfileTex;
+	GLuint weatherShaderID;
+	//Clouds in a layer around a planet below the box instead of the box itself, reaching to the horizon
+	bool sphericalShell;
+	float planetRadiusVal;
+	float shellDistanceVal;
+	float maxViewStepsVal;
+	//Many cloud banks found per ray through a BVH instead of the single box
+	bool cloudBanks;
+	int cloudBankCount;
+	CloudVolumes cloudVolumes;
+	//Authored clouds from a sparse brick volume in place of the noise, loaded when first enabled
+	bool sparseClouds;
+	float sparseDensityVal;
+	const char* sparseVolumePath;
+	SparseVolume sparseVolume;
+	//Base noise from a paged volume that doesn't repeat, generated as the clouds request pages
+	bool virtualNoise;
+	int virtualPagesPerFrame;
+	VirtualNoise virtualVolume;
+	//Terrain shaded through a map of the clouds' transmittance toward the sun, refreshed over shadowUpdateFrames frames
+	bool cloudShadows;
+	int shadowUpdateFrames;
+	int shadowRow;
+	bool shadowMapReady;
+	vec2 shadowMinVal;
+	vec2 shadowMaxVal;
+	float shadowPlaneVal;
+	float shadowTopVal;
+	GLuint cloudShadowTex;
+	GLuint cloudShadowID;
+	std::string cloudShadowVariant;
+	//Sky pixels take the clouds past farSplitVal from a cubemap around the camera, refreshed a face per frame
+	bool farImpostor;
+	float farSplitVal;
+	int impostorFace;
+	//Camera position all six faces were drawn from
+	vec3 impostorCentre;
+	GLuint impostorTex;
+	GLuint impostorID;
+	std::string impostorVariant;
+	//While paused and still, jittered frames at full quality are averaged into historyTex until refineFrames of them are in
+	bool progressiveRefine;
+	bool refining;
+	int refineFrames;
+	float refineLightStepsVal;
+	int accumulatedFrames;
+	vec3 refineCamPos;
+	vec3 refineCamDir;
+	float refineTime;
+	bool refineTerrain;
+	GLuint historyTex;
 
 	float timePassed;
 
 	GLuint vertexArrayID;
 	GLuint programID;
+	GLuint terrainProgramID;
 	GLuint currentCloudID;
 	GLuint cloudFragmentID;
 	GLuint cloudComputeID;
 	GLuint passthroughID;
-	GLuint worleyShaderID;
-	
+	GLint cloudGroupSize[3];
+
+	GLuint cloudTimerQuery;
+	bool cloudTimerActive;
+	float cloudPassMs;
+	GLuint terrainTimerQuery;
+	bool terrainTimerActive;
+	float terrainPassMs;
 
 	GLuint bufferColourTex;
 	GLuint bufferDepthTex;
 	GLuint bufferFBO;
 
-	GLuint matrixID;
+	//Linear depth and its min/max pyramid, rebuilt from bufferDepthTex after the terrain pass
+	GLuint linearDepthTex;
+	GLuint depthBoundsTex;
+	int depthBoundsLevels;
+	GLuint depthPyramidID;
+
+	//Stands in for the default framebuffer when offscreen, 0 otherwise
+	GLuint outputColourTex;
+	GLuint outputFBO;
+
+	FrameCapture capture;
+	//The last recording from the UI could not be started or written
+	bool recordFailed;
+
 	GLuint cloudMatrixID;
 
 	GLuint texture;
-	GLuint textureID;
 	GLuint normTexture;
-	GLuint normTextureID;
+	GLuint normalShaderID;
 
+	//Noise volume settings, adjustable to trade memory for quality
+	NoiseGenerator noiseGenerator;
+	NoiseVolumeDesc worleyDesc;
+	NoiseVolumeDesc detailDesc;
+	int noiseSizeIndex;
+	int noiseFormatIndex;
 	GLuint worleyTex;
 	GLuint worleyTexID;
 	GLuint detailTex;
 	GLuint detailTexID;
 	GLuint bufferTexID;
-	GLuint depthTexID;
+	GLuint linearDepthTexID;
 	GLuint finalTex;
 	GLuint finalTexID;
 
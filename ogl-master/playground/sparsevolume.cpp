@@ -0,0 +1,277 @@
+#include "sparsevolume.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <common/mappedfile.hpp>
+
+static const size_t headerSize = 32;
+static const size_t brickVoxels = SparseVolume::brickSize * SparseVolume::brickSize * SparseVolume::brickSize;
+static const size_t recordSize = 12 + brickVoxels;
+
+static unsigned int ReadU32(const unsigned char* p) {
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static int ReadI32(const unsigned char* p) {
+	int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static float ReadF32(const unsigned char* p) {
+	float v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static void WriteU32(FILE* file, unsigned int v) {
+	fwrite(&v, 4, 1, file);
+}
+
+static void WriteF32(FILE* file, float v) {
+	fwrite(&v, 4, 1, file);
+}
+
+SparseVolume::SparseVolume() {
+	atlasTexture = 0;
+	tableTexture = 0;
+	atlasSlots = glm::ivec3(0);
+	tableSize = glm::ivec3(0);
+	boundsMin = glm::vec3(0.0f);
+	boundsMax = glm::vec3(0.0f);
+	voxelSize = 1.0f;
+	brickCount = 0;
+}
+
+SparseVolume::~SparseVolume() {
+	Release();
+}
+
+void SparseVolume::Release() {
+	if (!atlasTexture) {
+		return;
+	}
+	glDeleteTextures(1, &atlasTexture);
+	glDeleteTextures(1, &tableTexture);
+	atlasTexture = 0;
+	tableTexture = 0;
+	atlasSlots = glm::ivec3(0);
+	tableSize = glm::ivec3(0);
+	brickCount = 0;
+}
+
+size_t SparseVolume::MemorySize() const {
+	size_t atlasBytes = (size_t)atlasSlots.x * atlasSlots.y * atlasSlots.z * atlasBrickSize * atlasBrickSize * atlasBrickSize;
+	size_t tableBytes = (size_t)tableSize.x * tableSize.y * tableSize.z * 2;
+	return atlasBytes + tableBytes;
+}
+
+bool SparseVolume::Load(const char* path) {
+	Release();
+
+	MappedFile file;
+	if (!mapFile(file, path)) {
+		printf("%s could not be opened\n", path);
+		return false;
+	}
+	if (!fileRangeValid(file, 0, headerSize) || memcmp(file.data, "SVOL", 4) != 0 || ReadU32(file.data + 4) != 1) {
+		printf("%s is not a version 1 sparse volume\n", path);
+		unmapFile(file);
+		return false;
+	}
+
+	unsigned int count = ReadU32(file.data + 8);
+	float size = ReadF32(file.data + 12);
+	glm::vec3 origin(ReadF32(file.data + 16), ReadF32(file.data + 20), ReadF32(file.data + 24));
+	// The table stores slot + 1 in 16 bits
+	if (count == 0 || count > 65535 || !(size > 0.0f)) {
+		printf("%s: %u bricks of voxel size %f, expected 1 to 65535 bricks\n", path, count, size);
+		unmapFile(file);
+		return false;
+	}
+	if (!fileRangeValid(file, headerSize, recordSize * count)) {
+		printf("%s: truncated, %u bricks expected\n", path, count);
+		unmapFile(file);
+		return false;
+	}
+
+	// Brick range of the volume
+	std::vector<glm::ivec3> bricks(count);
+	std::vector<const unsigned char*> voxels(count);
+	glm::ivec3 brickMin(0x7fffffff), brickMax(-0x7fffffff);
+	for (unsigned int i = 0; i < count; i++) {
+		const unsigned char* record = file.data + headerSize + recordSize * i;
+		bricks[i] = glm::ivec3(ReadI32(record), ReadI32(record + 4), ReadI32(record + 8));
+		voxels[i] = record + 12;
+		brickMin = glm::min(brickMin, bricks[i]);
+		brickMax = glm::max(brickMax, bricks[i]);
+	}
+
+	// In 64 bits, as bricks far apart can span more than an int
+	long long rangeX = (long long)brickMax.x - brickMin.x + 1;
+	long long rangeY = (long long)brickMax.y - brickMin.y + 1;
+	long long rangeZ = (long long)brickMax.z - brickMin.z + 1;
+	GLint maxSize;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+	if (rangeX > maxSize || rangeY > maxSize || rangeZ > maxSize) {
+		printf("%s: %lldx%lldx%lld bricks across, more than a table texture holds\n", path, rangeX, rangeY, rangeZ);
+		unmapFile(file);
+		return false;
+	}
+	// A few bricks far apart would still need a huge table
+	if ((unsigned long long)(rangeX * rangeY * rangeZ) > maxTableEntries) {
+		printf("%s: %lldx%lldx%lld bricks across, more than the %u entry brick table\n", path, rangeX, rangeY, rangeZ,
+			(unsigned int)maxTableEntries);
+		unmapFile(file);
+		return false;
+	}
+	glm::ivec3 range((int)rangeX, (int)rangeY, (int)rangeZ);
+
+	// Slot + 1 of every brick in the range, 0 where it is empty
+	std::vector<unsigned short> table((size_t)range.x * range.y * range.z, 0);
+	for (unsigned int i = 0; i < count; i++) {
+		glm::ivec3 b = bricks[i] - brickMin;
+		unsigned short& entry = table[((size_t)b.z * range.y + b.y) * range.x + b.x];
+		if (entry != 0) {
+			printf("%s: brick %d %d %d appears twice\n", path, bricks[i].x, bricks[i].y, bricks[i].z);
+			unmapFile(file);
+			return false;
+		}
+		entry = (unsigned short)(i + 1);
+	}
+
+	// Roughly cubic atlas, filled slot by slot
+	int side = (int)ceil(cbrt((double)count));
+	glm::ivec3 slots(side, side, (count + side * side - 1) / (side * side));
+	if (slots.x * atlasBrickSize > maxSize || slots.z * atlasBrickSize > maxSize) {
+		printf("%s: %u bricks do not fit in one atlas texture\n", path, count);
+		unmapFile(file);
+		return false;
+	}
+	glm::ivec3 atlasSize = slots * atlasBrickSize;
+	std::vector<unsigned char> atlas((size_t)atlasSize.x * atlasSize.y * atlasSize.z, 0);
+
+	// Voxel at v, in voxels from the corner of brickMin, 0 outside the occupied bricks
+	glm::ivec3 rangeVoxels = range * brickSize;
+	auto voxelAt = [&](const glm::ivec3& v) -> unsigned char {
+		if (v.x < 0 || v.y < 0 || v.z < 0 || v.x >= rangeVoxels.x || v.y >= rangeVoxels.y || v.z >= rangeVoxels.z) {
+			return 0;
+		}
+		glm::ivec3 b = v / brickSize;
+		unsigned short entry = table[((size_t)b.z * range.y + b.y) * range.x + b.x];
+		if (entry == 0) {
+			return 0;
+		}
+		glm::ivec3 l = v - b * brickSize;
+		return voxels[entry - 1][(l.z * brickSize + l.y) * brickSize + l.x];
+	};
+
+	for (unsigned int i = 0; i < count; i++) {
+		glm::ivec3 slot(i % slots.x, (i / slots.x) % slots.y, i / (slots.x * slots.y));
+		glm::ivec3 first = (bricks[i] - brickMin) * brickSize - 1;
+		for (int z = 0; z < atlasBrickSize; z++) {
+			for (int y = 0; y < atlasBrickSize; y++) {
+				glm::ivec3 row = slot * atlasBrickSize + glm::ivec3(0, y, z);
+				unsigned char* dest = &atlas[((size_t)row.z * atlasSize.y + row.y) * atlasSize.x + row.x];
+				for (int x = 0; x < atlasBrickSize; x++) {
+					dest[x] = voxelAt(first + glm::ivec3(x, y, z));
+				}
+			}
+		}
+	}
+	unmapFile(file);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	glGenTextures(1, &atlasTexture);
+	glBindTexture(GL_TEXTURE_3D, atlasTexture);
+	glTexStorage3D(GL_TEXTURE_3D, 1, GL_R8, atlasSize.x, atlasSize.y, atlasSize.z);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, atlasSize.x, atlasSize.y, atlasSize.z, GL_RED, GL_UNSIGNED_BYTE, atlas.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+	glGenTextures(1, &tableTexture);
+	glBindTexture(GL_TEXTURE_3D, tableTexture);
+	glTexStorage3D(GL_TEXTURE_3D, 1, GL_R16UI, range.x, range.y, range.z);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, range.x, range.y, range.z, GL_RED_INTEGER, GL_UNSIGNED_SHORT, table.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	atlasSlots = slots;
+	tableSize = range;
+	voxelSize = size;
+	boundsMin = origin + glm::vec3(brickMin * brickSize) * voxelSize;
+	boundsMax = origin + glm::vec3((brickMax + 1) * brickSize) * voxelSize;
+	brickCount = (int)count;
+
+	printf("Loaded %s: %d bricks, %.1f MB\n", path, brickCount, MemorySize() / (1024.0f * 1024.0f));
+	return true;
+}
+
+bool SparseVolume::Write(const char* path, const std::vector<unsigned char>& densities, glm::ivec3 size,
+	float voxelSize, glm::vec3 origin) {
+	glm::ivec3 bricks = (size + brickSize - 1) / brickSize;
+
+	// Bricks with any density, partial ones at the far edges padded with 0
+	std::vector<glm::ivec3> occupied;
+	std::vector<unsigned char> records;
+	unsigned char brick[brickVoxels];
+	for (int bz = 0; bz < bricks.z; bz++) {
+		for (int by = 0; by < bricks.y; by++) {
+			for (int bx = 0; bx < bricks.x; bx++) {
+				bool empty = true;
+				for (int z = 0; z < brickSize; z++) {
+					for (int y = 0; y < brickSize; y++) {
+						for (int x = 0; x < brickSize; x++) {
+							glm::ivec3 v = glm::ivec3(bx, by, bz) * brickSize + glm::ivec3(x, y, z);
+							unsigned char density = 0;
+							if (v.x < size.x && v.y < size.y && v.z < size.z) {
+								density = densities[((size_t)v.z * size.y + v.y) * size.x + v.x];
+							}
+							brick[(z * brickSize + y) * brickSize + x] = density;
+							empty = empty && density == 0;
+						}
+					}
+				}
+				if (!empty) {
+					occupied.push_back(glm::ivec3(bx, by, bz));
+					records.insert(records.end(), brick, brick + brickVoxels);
+				}
+			}
+		}
+	}
+	if (occupied.empty() || occupied.size() > 65535) {
+		printf("%s: %u occupied bricks, expected 1 to 65535\n", path, (unsigned int)occupied.size());
+		return false;
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		printf("%s could not be opened for writing\n", path);
+		return false;
+	}
+	fwrite("SVOL", 1, 4, file);
+	WriteU32(file, 1);
+	WriteU32(file, (unsigned int)occupied.size());
+	WriteF32(file, voxelSize);
+	WriteF32(file, origin.x);
+	WriteF32(file, origin.y);
+	WriteF32(file, origin.z);
+	WriteU32(file, 0);
+	for (size_t i = 0; i < occupied.size(); i++) {
+		fwrite(&occupied[i].x, 4, 3, file);
+		fwrite(&records[i * brickVoxels], 1, brickVoxels, file);
+	}
+	fclose(file);
+
+	printf("Wrote %s: %u of %d bricks\n", path, (unsigned int)occupied.size(), bricks.x * bricks.y * bricks.z);
+	return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Authored cloud volumes stored sparsely, the way VDB stores its leaf nodes:
+// only the 8x8x8 bricks holding any density exist. The occupied bricks are
+// packed into a 3D atlas texture, each with a one voxel apron copied from its
+// neighbours so trilinear filtering is seamless across brick faces, and a
+// table over the volume's bricks gives every brick's atlas slot. The
+// SPARSE_VOLUME variant of CloudRaymarch.glsl samples density through the
+// table instead of the noise and steps over empty bricks in one go, so both
+// memory and march cost follow the occupied voxels.
+//
+// File layout (.svol, little endian):
+//   char[4]  "SVOL"
+//   uint32   version, 1
+//   uint32   brick count
+//   float    voxel size in world units
+//   float[3] world position of the corner of voxel (0, 0, 0)
+//   uint32   reserved
+// then per brick:
+//   int32[3] brick coordinates, voxel coordinates / 8
+//   uint8    512 densities, x fastest, 255 is a density of 1
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+class SparseVolume {
+public:
+	SparseVolume();
+	~SparseVolume();
+
+	bool Load(const char* path);
+	// Writes a dense grid of densities (x fastest, 255 is a density of 1) as a
+	// .svol file, keeping only the bricks that hold any density
+	static bool Write(const char* path, const std::vector<unsigned char>& densities, glm::ivec3 size,
+		float voxelSize, glm::vec3 origin);
+	bool IsLoaded() const { return atlasTexture != 0; };
+	void Release();
+
+	// R8 bricks with aprons, and R16UI slot + 1 per brick of the bounds, 0 where empty
+	GLuint AtlasTexture() const { return atlasTexture; };
+	GLuint TableTexture() const { return tableTexture; };
+
+	// World space box around the occupied bricks; the table starts at BoundsMin
+	glm::vec3 BoundsMin() const { return boundsMin; };
+	glm::vec3 BoundsMax() const { return boundsMax; };
+	float VoxelSize() const { return voxelSize; };
+
+	int BrickCount() const { return brickCount; };
+	size_t MemorySize() const;
+
+	static const int brickSize = 8;
+	static const int atlasBrickSize = brickSize + 2;
+	// Largest brick table Load builds, 32 MB of entries
+	static const size_t maxTableEntries = (size_t)1 << 24;
+protected:
+	GLuint atlasTexture;
+	GLuint tableTexture;
+	glm::ivec3 atlasSlots;				// bricks along each axis of the atlas
+	glm::ivec3 tableSize;				// bricks along each axis of the bounds
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	float voxelSize;
+	int brickCount;
+};
@@ -0,0 +1,435 @@
+#include "terraincull.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include <common/shader.hpp>
+#include <common/texture.hpp>
+
+static int Wrap(int i, int size) {
+	return ((i % size) + size) % size;
+}
+
+TerrainCuller::TerrainCuller() {
+	vertexBuffer = 0;
+	uvBuffer = 0;
+	indirectBuffer = 0;
+	patchCount = 0;
+	patchesDrawn = 0;
+
+	depthShader = 0;
+	depthGrid = 0;
+	gridWidth = 0;
+	gridHeight = 0;
+	screenWidth = 0;
+	screenHeight = 0;
+	for (int i = 0; i < ringSize; i++) {
+		pbos[i] = 0;
+		fences[i] = 0;
+	}
+	nextSlot = 0;
+}
+
+TerrainCuller::~TerrainCuller() {
+	Release();
+}
+
+void TerrainCuller::ReleaseOcclusion() {
+	for (int i = 0; i < ringSize; i++) {
+		if (fences[i]) {
+			glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+	}
+	if (pbos[0]) {
+		glDeleteBuffers(ringSize, pbos);
+		for (int i = 0; i < ringSize; i++) {
+			pbos[i] = 0;
+		}
+	}
+	if (depthGrid) {
+		glDeleteTextures(1, &depthGrid);
+		depthGrid = 0;
+	}
+	gridWidth = 0;
+	gridHeight = 0;
+	screenWidth = 0;
+	screenHeight = 0;
+	nextSlot = 0;
+	occlusionLevels.clear();
+	occlusionSizes.clear();
+}
+
+void TerrainCuller::Release() {
+	ReleaseOcclusion();
+	if (!vertexBuffer) {
+		return;
+	}
+	glDeleteBuffers(1, &vertexBuffer);
+	glDeleteBuffers(1, &uvBuffer);
+	glDeleteBuffers(1, &indirectBuffer);
+	glDeleteProgram(depthShader);
+	vertexBuffer = 0;
+	uvBuffer = 0;
+	indirectBuffer = 0;
+	depthShader = 0;
+	nodes.clear();
+	patchCount = 0;
+}
+
+// Fills nodes[index] with the patches order[first, first + count) and splits
+// it at the median until the leaves are small enough. The two children of a
+// node are allocated together, so the right one is always left + 1.
+void TerrainCuller::BuildNode(int index, int first, int count, std::vector<int>& order,
+	const std::vector<glm::vec3>& patchMin, const std::vector<glm::vec3>& patchMax) {
+	glm::vec3 boundsMin(1e30f), boundsMax(-1e30f);
+	for (int i = first; i < first + count; i++) {
+		boundsMin = glm::min(boundsMin, patchMin[order[i]]);
+		boundsMax = glm::max(boundsMax, patchMax[order[i]]);
+	}
+	nodes[index].boundsMin = boundsMin;
+	nodes[index].boundsMax = boundsMax;
+	nodes[index].first = first;
+	nodes[index].count = count;
+	nodes[index].left = -1;
+	if (count <= leafSize) {
+		return;
+	}
+
+	// Median of the patch centres along the wider horizontal axis
+	int axis = boundsMax.x - boundsMin.x >= boundsMax.z - boundsMin.z ? 0 : 2;
+	int half = count / 2;
+	std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+		[&](int a, int b) { return patchMin[a][axis] + patchMax[a][axis] < patchMin[b][axis] + patchMax[b][axis]; });
+
+	int left = (int)nodes.size();
+	nodes.resize(left + 2);
+	nodes[index].left = left;
+	BuildNode(left, first, half, order, patchMin, patchMax);
+	BuildNode(left + 1, first + half, count - half, order, patchMin, patchMax);
+}
+
+bool TerrainCuller::Build(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec2>& uvs, GLuint heightMap) {
+	Release();
+
+	int width, height;
+	std::vector<float> texels;
+	if (vertices.size() < 3 || !readTextureRed(heightMap, texels, &width, &height)) {
+		printf("Terrain culling: no patches or heightmap to build from\n");
+		return false;
+	}
+
+	// Patch bounds including the displacement. TexturedTES samples the repeating
+	// heightmap bilinearly, so every height it can produce lies between the
+	// texels around the patch's UV footprint.
+	patchCount = (int)vertices.size() / 3;
+	std::vector<glm::vec3> patchMin(patchCount), patchMax(patchCount);
+	for (int p = 0; p < patchCount; p++) {
+		glm::vec3 lo = vertices[p * 3], hi = vertices[p * 3];
+		glm::vec2 uvLo = uvs[p * 3], uvHi = uvs[p * 3];
+		for (int v = 1; v < 3; v++) {
+			lo = glm::min(lo, vertices[p * 3 + v]);
+			hi = glm::max(hi, vertices[p * 3 + v]);
+			uvLo = glm::min(uvLo, uvs[p * 3 + v]);
+			uvHi = glm::max(uvHi, uvs[p * 3 + v]);
+		}
+		int x0 = (int)floorf(uvLo.x * width - 0.5f);
+		int x1 = (int)floorf(uvHi.x * width - 0.5f) + 1;
+		int y0 = (int)floorf(uvLo.y * height - 0.5f);
+		int y1 = (int)floorf(uvHi.y * height - 0.5f) + 1;
+		float heightMin = 1e30f, heightMax = -1e30f;
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				float h = texels[Wrap(y, height) * width + Wrap(x, width)];
+				heightMin = fminf(heightMin, h);
+				heightMax = fmaxf(heightMax, h);
+			}
+		}
+		patchMin[p] = glm::vec3(lo.x, lo.y + heightMin, lo.z);
+		patchMax[p] = glm::vec3(hi.x, hi.y + heightMax, hi.z);
+	}
+
+	std::vector<int> order(patchCount);
+	for (int p = 0; p < patchCount; p++) {
+		order[p] = p;
+	}
+	nodes.resize(1);
+	BuildNode(0, 0, patchCount, order, patchMin, patchMax);
+
+	// Patches in tree order, so every node is one range of the buffer
+	std::vector<glm::vec3> sortedVertices(patchCount * 3);
+	std::vector<glm::vec2> sortedUVs(patchCount * 3);
+	for (int p = 0; p < patchCount; p++) {
+		for (int v = 0; v < 3; v++) {
+			sortedVertices[p * 3 + v] = vertices[order[p] * 3 + v];
+			sortedUVs[p * 3 + v] = uvs[order[p] * 3 + v];
+		}
+	}
+
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sortedVertices.size() * sizeof(glm::vec3), &sortedVertices[0], GL_STATIC_DRAW);
+	glGenBuffers(1, &uvBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, uvBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sortedUVs.size() * sizeof(glm::vec2), &sortedUVs[0], GL_STATIC_DRAW);
+	glGenBuffers(1, &indirectBuffer);
+
+	depthShader = LoadComputeShader("Shaders/DepthMaxCS.glsl");
+
+	printf("Terrain culling: %d patches, %d nodes\n", patchCount, (int)nodes.size());
+	return true;
+}
+
+void TerrainCuller::Cull(int index, bool inside, bool occlusion) {
+	const Node& node = nodes[index];
+
+	// Once a box is inside every plane its children are too
+	if (!inside) {
+		inside = true;
+		for (int i = 0; i < 6; i++) {
+			glm::vec3 normal = glm::vec3(planes[i]);
+			glm::vec3 farCorner = glm::vec3(
+				normal.x >= 0.0f ? node.boundsMax.x : node.boundsMin.x,
+				normal.y >= 0.0f ? node.boundsMax.y : node.boundsMin.y,
+				normal.z >= 0.0f ? node.boundsMax.z : node.boundsMin.z);
+			glm::vec3 nearCorner = node.boundsMin + node.boundsMax - farCorner;
+			if (glm::dot(normal, farCorner) + planes[i].w < 0.0f) {
+				return;
+			}
+			if (glm::dot(normal, nearCorner) + planes[i].w < 0.0f) {
+				inside = false;
+			}
+		}
+	}
+	if (occlusion && Occluded(node)) {
+		return;
+	}
+
+	if (node.left < 0 || (inside && !occlusion)) {
+		// Consecutive visible nodes are adjacent in the buffer and share a command
+		GLuint first = node.first * 3;
+		if (!commands.empty() && commands.back().first + commands.back().count == first) {
+			commands.back().count += node.count * 3;
+		}
+		else {
+			DrawCommand command = { (GLuint)node.count * 3, 1, first, 0 };
+			commands.push_back(command);
+		}
+		patchesDrawn += node.count;
+		return;
+	}
+	Cull(node.left, inside, occlusion);
+	Cull(node.left + 1, inside, occlusion);
+}
+
+// True if the box lay entirely behind the terrain in the frame the occlusion
+// grid came from. Anything that was partly off screen or crossed the camera
+// plane then counts as visible, since the grid says nothing about it.
+// The grid is a frame or more old, so the box's rectangle is grown by as far
+// as it has moved on screen since then. A fast turn then leaves newly visible
+// patches drawn rather than culled for a frame.
+bool TerrainCuller::Occluded(const Node& node) const {
+	glm::vec2 screenMin(1e30f), screenMax(-1e30f);
+	glm::vec2 motion(0.0f);
+	float nearest = 1.0f;
+	for (int c = 0; c < 8; c++) {
+		glm::vec3 corner(
+			c & 1 ? node.boundsMax.x : node.boundsMin.x,
+			c & 2 ? node.boundsMax.y : node.boundsMin.y,
+			c & 4 ? node.boundsMax.z : node.boundsMin.z);
+		glm::vec4 clip = occlusionMatrix * glm::vec4(corner, 1.0f);
+		glm::vec4 drawClip = drawMatrix * glm::vec4(corner, 1.0f);
+		if (clip.w <= 0.0f || drawClip.w <= 0.0f) {
+			return false;
+		}
+		glm::vec3 ndc = glm::vec3(clip) / clip.w;
+		screenMin = glm::min(screenMin, glm::vec2(ndc));
+		screenMax = glm::max(screenMax, glm::vec2(ndc));
+		motion = glm::max(motion, glm::abs(glm::vec2(drawClip) / drawClip.w - glm::vec2(ndc)));
+		nearest = fminf(nearest, ndc.z * 0.5f + 0.5f);
+	}
+	screenMin -= motion;
+	screenMax += motion;
+	if (screenMin.x < -1.0f || screenMin.y < -1.0f || screenMax.x > 1.0f || screenMax.y > 1.0f) {
+		return false;
+	}
+
+	int x0 = (int)((screenMin.x * 0.5f + 0.5f) * screenWidth) / tileSize;
+	int y0 = (int)((screenMin.y * 0.5f + 0.5f) * screenHeight) / tileSize;
+	int x1 = std::min((int)((screenMax.x * 0.5f + 0.5f) * screenWidth) / tileSize, gridWidth - 1);
+	int y1 = std::min((int)((screenMax.y * 0.5f + 0.5f) * screenHeight) / tileSize, gridHeight - 1);
+
+	// Coarsest level at which the rectangle still covers at most 2x2 texels
+	int level = 0;
+	while (level + 1 < (int)occlusionLevels.size() &&
+		((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1)) {
+		level++;
+	}
+	const std::vector<float>& grid = occlusionLevels[level];
+	int levelWidth = occlusionSizes[level].x;
+	for (int y = y0 >> level; y <= y1 >> level; y++) {
+		for (int x = x0 >> level; x <= x1 >> level; x++) {
+			if (grid[y * levelWidth + x] >= nearest) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Takes the newest readback that has finished and builds the coarser levels
+// from it. Never waits on the GPU.
+void TerrainCuller::CollectOcclusion() {
+	int newest = -1;
+	for (int i = 0; i < ringSize; i++) {
+		int slot = (nextSlot + i) % ringSize;
+		if (!fences[slot]) {
+			continue;
+		}
+		GLenum status = glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			break;
+		}
+		glDeleteSync(fences[slot]);
+		fences[slot] = 0;
+		newest = slot;
+	}
+	if (newest < 0) {
+		return;
+	}
+
+	occlusionLevels.resize(1);
+	occlusionSizes.resize(1);
+	occlusionLevels[0].resize(gridWidth * gridHeight);
+	occlusionSizes[0] = glm::ivec2(gridWidth, gridHeight);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[newest]);
+	void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, gridWidth * gridHeight * sizeof(float), GL_MAP_READ_BIT);
+	if (mapped) {
+		memcpy(&occlusionLevels[0][0], mapped, gridWidth * gridHeight * sizeof(float));
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (!mapped) {
+		occlusionLevels.clear();
+		occlusionSizes.clear();
+		return;
+	}
+	occlusionMatrix = slotMatrix[newest];
+
+	// Each level keeps the farthest depth of the up to 2x2 texels below it
+	while (occlusionSizes.back().x > 1 || occlusionSizes.back().y > 1) {
+		glm::ivec2 size = occlusionSizes.back();
+		glm::ivec2 next = glm::max((size + 1) / 2, glm::ivec2(1));
+		std::vector<float> level(next.x * next.y);
+		const std::vector<float>& below = occlusionLevels.back();
+		for (int y = 0; y < next.y; y++) {
+			for (int x = 0; x < next.x; x++) {
+				int sx = std::min(x * 2 + 1, size.x - 1);
+				int sy = std::min(y * 2 + 1, size.y - 1);
+				level[y * next.x + x] = fmaxf(
+					fmaxf(below[y * 2 * size.x + x * 2], below[y * 2 * size.x + sx]),
+					fmaxf(below[sy * size.x + x * 2], below[sy * size.x + sx]));
+			}
+		}
+		occlusionLevels.push_back(level);
+		occlusionSizes.push_back(next);
+	}
+}
+
+void TerrainCuller::Draw(const glm::mat4& clipMatrix, bool occlusion) {
+	if (!IsBuilt()) {
+		return;
+	}
+	if (occlusion) {
+		CollectOcclusion();
+	}
+
+	drawMatrix = clipMatrix;
+
+	// Frustum planes straight from the rows of the clip matrix, in model space
+	glm::vec4 rows[4];
+	for (int r = 0; r < 4; r++) {
+		rows[r] = glm::vec4(clipMatrix[0][r], clipMatrix[1][r], clipMatrix[2][r], clipMatrix[3][r]);
+	}
+	for (int i = 0; i < 3; i++) {
+		planes[i * 2] = rows[3] + rows[i];
+		planes[i * 2 + 1] = rows[3] - rows[i];
+	}
+
+	commands.clear();
+	patchesDrawn = 0;
+	Cull(0, false, occlusion && !occlusionLevels.empty());
+	if (commands.empty()) {
+		return;
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawCommand), &commands[0], GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+	glEnableVertexAttribArray(1);
+	glBindBuffer(GL_ARRAY_BUFFER, uvBuffer);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+	glMultiDrawArraysIndirect(GL_PATCHES, (void*)0, (GLsizei)commands.size(), 0);
+
+	glDisableVertexAttribArray(0);
+	glDisableVertexAttribArray(1);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void TerrainCuller::UpdateOcclusion(GLuint depthTex, int width, int height, const glm::mat4& clipMatrix) {
+	if (!IsBuilt()) {
+		return;
+	}
+
+	if (!depthGrid || width != screenWidth || height != screenHeight) {
+		ReleaseOcclusion();
+		gridWidth = (width + tileSize - 1) / tileSize;
+		gridHeight = (height + tileSize - 1) / tileSize;
+		screenWidth = width;
+		screenHeight = height;
+
+		glGenTextures(1, &depthGrid);
+		glBindTexture(GL_TEXTURE_2D, depthGrid);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, gridWidth, gridHeight);
+
+		glGenBuffers(ringSize, pbos);
+		for (int i = 0; i < ringSize; i++) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, gridWidth * gridHeight * sizeof(float), NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+	// Every slot still in flight, the GPU is well behind; skip a frame rather than wait
+	if (fences[nextSlot]) {
+		return;
+	}
+
+	glUseProgram(depthShader);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, depthTex);
+	glUniform1i(glGetUniformLocation(depthShader, "depthTex"), 0);
+	glUniform1i(glGetUniformLocation(depthShader, "maxDepth"), 0);
+	glUniform1i(glGetUniformLocation(depthShader, "tileSize"), tileSize);
+	glBindImageTexture(0, depthGrid, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+	glDispatchCompute((gridWidth + 7) / 8, (gridHeight + 7) / 8, 1);
+
+	glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[nextSlot]);
+	glBindTexture(GL_TEXTURE_2D, depthGrid);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, (void*)0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	fences[nextSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slotMatrix[nextSlot] = clipMatrix;
+	nextSlot = (nextSlot + 1) % ringSize;
+
+	glUseProgram(0);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// Culling for the tessellated terrain. The patches of terrain.obj are sorted
+// into a bounding volume hierarchy whose boxes include the heightmap
+// displacement TexturedTES adds, so each node covers one contiguous range of
+// the reordered vertex buffer. Every frame the tree is tested against the view
+// frustum and, optionally, against a coarse grid of the farthest depth in last
+// frame's terrain depth buffer (Hi-Z). The visible ranges are merged and drawn
+// with a single glMultiDrawArraysIndirect.
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+class TerrainCuller {
+public:
+	TerrainCuller();
+	~TerrainCuller();
+
+	// Builds the hierarchy over the patches (three vertices each) and uploads
+	// them in tree order. Reads the heightmap back, so it has to be loaded.
+	bool Build(const std::vector<glm::vec3>& vertices, const std::vector<glm::vec2>& uvs, GLuint heightMap);
+	bool IsBuilt() const { return vertexBuffer != 0; };
+	void Release();
+
+	// Draws the visible patches with the currently bound program, position at
+	// attribute 0 and UV at 1. clipMatrix is projection * view * model.
+	void Draw(const glm::mat4& clipMatrix, bool occlusion);
+
+	// Reduces the terrain depth just rendered with clipMatrix to the occlusion
+	// grid. The readback is asynchronous; a later Draw picks it up once ready.
+	void UpdateOcclusion(GLuint depthTex, int width, int height, const glm::mat4& clipMatrix);
+
+	int PatchesDrawn() const { return patchesDrawn; };
+	int PatchCount() const { return patchCount; };
+protected:
+	struct Node {
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		int first;				// first patch in tree order
+		int count;
+		int left;				// -1 for a leaf, the right child follows the left
+	};
+
+	struct DrawCommand {
+		GLuint count;
+		GLuint instanceCount;
+		GLuint first;
+		GLuint baseInstance;
+	};
+
+	void BuildNode(int index, int first, int count, std::vector<int>& order,
+		const std::vector<glm::vec3>& patchMin, const std::vector<glm::vec3>& patchMax);
+	void Cull(int index, bool inside, bool occlusion);
+	bool Occluded(const Node& node) const;
+	void CollectOcclusion();
+	void ReleaseOcclusion();
+
+	static const int leafSize = 16;			// patches
+	static const int tileSize = 16;			// pixels per occlusion grid texel
+	static const int ringSize = 3;
+
+	std::vector<Node> nodes;				// nodes[0] is the root
+	std::vector<DrawCommand> commands;
+	glm::vec4 planes[6];
+	glm::mat4 drawMatrix;					// clipMatrix of the Draw being culled
+
+	GLuint vertexBuffer;
+	GLuint uvBuffer;
+	GLuint indirectBuffer;
+	int patchCount;
+	int patchesDrawn;
+
+	// Hi-Z: farthest depth per tile, level 0 at tile resolution and each level
+	// above it half the size
+	GLuint depthShader;
+	GLuint depthGrid;
+	int gridWidth;
+	int gridHeight;
+	int screenWidth;
+	int screenHeight;
+	GLuint pbos[ringSize];
+	GLsync fences[ringSize];
+	glm::mat4 slotMatrix[ringSize];
+	int nextSlot;
+	std::vector<std::vector<float> > occlusionLevels;
+	std::vector<glm::ivec2> occlusionSizes;
+	glm::mat4 occlusionMatrix;
+};
@@ -0,0 +1,250 @@
+#include "terrainlod.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <common/texture.hpp>
+
+// Skirts reach at least this far below the edge, in heightmap units
+static const float minSkirtDepth = 2.0f / 255.0f;
+
+TerrainLOD::TerrainLOD() {
+	resolution = gridSize << (levels - 1);
+	vertexBuffer = 0;
+	indexBuffer = 0;
+	indirectBuffer = 0;
+	indexCount = 0;
+	trianglesPerChunk = 0;
+	chunksDrawn = 0;
+}
+
+TerrainLOD::~TerrainLOD() {
+	Release();
+}
+
+void TerrainLOD::Release() {
+	if (!vertexBuffer) {
+		return;
+	}
+	glDeleteBuffers(1, &vertexBuffer);
+	glDeleteBuffers(1, &indexBuffer);
+	glDeleteBuffers(1, &indirectBuffer);
+	vertexBuffer = 0;
+	indexBuffer = 0;
+	indirectBuffer = 0;
+	chunks.clear();
+	heights.clear();
+}
+
+float TerrainLOD::Height(int x, int z) const {
+	return heights[z * (resolution + 1) + x];
+}
+
+// Appends the grid and skirt vertices of one chunk and, below the finest
+// level, its four children. Returns the index of the chunk.
+int TerrainLOD::BuildChunk(int level, int x, int z, std::vector<glm::vec3>& positions) {
+	int span = resolution >> level;		// finest quads covered
+	int stride = span / gridSize;
+	int x0 = x * span;
+	int z0 = z * span;
+
+	Chunk chunk;
+	chunk.level = level;
+	chunk.baseVertex = (GLint)positions.size();
+	chunk.boundsMin = glm::vec3(1e30f);
+	chunk.boundsMax = glm::vec3(-1e30f);
+	for (int j = 0; j <= gridSize; j++) {
+		for (int i = 0; i <= gridSize; i++) {
+			int hx = x0 + i * stride;
+			int hz = z0 + j * stride;
+			glm::vec3 p(-1.0f + 2.0f * hx / resolution, Height(hx, hz), -1.0f + 2.0f * hz / resolution);
+			positions.push_back(p);
+			chunk.boundsMin = glm::min(chunk.boundsMin, p);
+			chunk.boundsMax = glm::max(chunk.boundsMax, p);
+		}
+	}
+	// Skirts start as copies of the edges and are lowered once the errors are known
+	for (int i = 0; i <= gridSize; i++) positions.push_back(positions[chunk.baseVertex + i]);
+	for (int i = 0; i <= gridSize; i++) positions.push_back(positions[chunk.baseVertex + gridSize * (gridSize + 1) + i]);
+	for (int j = 0; j <= gridSize; j++) positions.push_back(positions[chunk.baseVertex + j * (gridSize + 1)]);
+	for (int j = 0; j <= gridSize; j++) positions.push_back(positions[chunk.baseVertex + j * (gridSize + 1) + gridSize]);
+
+	// Error against the finest samples, interpolated across the same triangles as the index buffer
+	chunk.error = 0.0f;
+	if (stride > 1) {
+		for (int fz = 0; fz <= span; fz++) {
+			for (int fx = 0; fx <= span; fx++) {
+				int qi = fx / stride < gridSize ? fx / stride : gridSize - 1;
+				int qj = fz / stride < gridSize ? fz / stride : gridSize - 1;
+				float tx = (float)(fx - qi * stride) / stride;
+				float tz = (float)(fz - qj * stride) / stride;
+				float h00 = Height(x0 + qi * stride, z0 + qj * stride);
+				float h10 = Height(x0 + (qi + 1) * stride, z0 + qj * stride);
+				float h01 = Height(x0 + qi * stride, z0 + (qj + 1) * stride);
+				float h11 = Height(x0 + (qi + 1) * stride, z0 + (qj + 1) * stride);
+				float h = tx + tz <= 1.0f ?
+					h00 + tx * (h10 - h00) + tz * (h01 - h00) :
+					h11 + (1.0f - tx) * (h01 - h11) + (1.0f - tz) * (h10 - h11);
+				chunk.error = fmaxf(chunk.error, fabsf(Height(x0 + fx, z0 + fz) - h));
+			}
+		}
+	}
+
+	int index = (int)chunks.size();
+	chunks.push_back(chunk);
+
+	for (int c = 0; c < 4; c++) {
+		int child = -1;
+		if (level + 1 < levels) {
+			child = BuildChunk(level + 1, x * 2 + (c & 1), z * 2 + (c >> 1), positions);
+			// A parent is never more accurate than its children
+			chunks[index].error = fmaxf(chunks[index].error, chunks[child].error);
+		}
+		chunks[index].children[c] = child;
+	}
+	return index;
+}
+
+bool TerrainLOD::Build(GLuint heightMap) {
+	Release();
+
+	int width, height;
+	std::vector<float> texels;
+	if (!readTextureRed(heightMap, texels, &width, &height)) {
+		printf("Terrain LOD: heightmap has no contents\n");
+		return false;
+	}
+
+	// Bilinear samples at the finest vertices. loadOBJ negates V, so with the
+	// heightmap repeating V runs along +z.
+	heights.resize((resolution + 1) * (resolution + 1));
+	for (int j = 0; j <= resolution; j++) {
+		for (int i = 0; i <= resolution; i++) {
+			float u = (float)i / resolution;
+			float v = (float)j / resolution;
+			float tx = glm::clamp(u * width - 0.5f, 0.0f, width - 1.0f);
+			float ty = glm::clamp(v * height - 0.5f, 0.0f, height - 1.0f);
+			int x0 = (int)tx, y0 = (int)ty;
+			int x1 = x0 + 1 < width ? x0 + 1 : x0;
+			int y1 = y0 + 1 < height ? y0 + 1 : y0;
+			float fx = tx - x0, fy = ty - y0;
+			float top = texels[y0 * width + x0] * (1.0f - fx) + texels[y0 * width + x1] * fx;
+			float bottom = texels[y1 * width + x0] * (1.0f - fx) + texels[y1 * width + x1] * fx;
+			heights[j * (resolution + 1) + i] = top * (1.0f - fy) + bottom * fy;
+		}
+	}
+
+	std::vector<glm::vec3> positions;
+	BuildChunk(0, 0, 0, positions);
+
+	// Cracks against a coarser neighbour are at most its error, which is at
+	// most the parent's
+	int skirtStart = (gridSize + 1) * (gridSize + 1);
+	for (size_t c = 0; c < chunks.size(); c++) {
+		for (int child = 0; child < 4; child++) {
+			if (chunks[c].children[child] >= 0) {
+				const Chunk& chunk = chunks[chunks[c].children[child]];
+				for (int s = 0; s < 4 * (gridSize + 1); s++) {
+					positions[chunk.baseVertex + skirtStart + s].y -= fmaxf(chunks[c].error, minSkirtDepth);
+				}
+			}
+		}
+	}
+	for (int s = 0; s < 4 * (gridSize + 1); s++) {
+		positions[chunks[0].baseVertex + skirtStart + s].y -= fmaxf(chunks[0].error, minSkirtDepth);
+	}
+
+	// One index buffer serves every chunk through baseVertex
+	std::vector<GLuint> indices;
+	for (int j = 0; j < gridSize; j++) {
+		for (int i = 0; i < gridSize; i++) {
+			GLuint a = j * (gridSize + 1) + i;
+			GLuint b = a + 1;
+			GLuint c = a + gridSize + 1;
+			GLuint d = c + 1;
+			// Counter-clockwise seen from above
+			indices.push_back(a); indices.push_back(c); indices.push_back(b);
+			indices.push_back(b); indices.push_back(c); indices.push_back(d);
+		}
+	}
+	for (int edge = 0; edge < 4; edge++) {
+		for (int k = 0; k < gridSize; k++) {
+			GLuint top0, top1;
+			switch (edge) {
+			case 0: top0 = k; break;
+			case 1: top0 = gridSize * (gridSize + 1) + k; break;
+			case 2: top0 = k * (gridSize + 1); break;
+			default: top0 = k * (gridSize + 1) + gridSize; break;
+			}
+			top1 = top0 + (edge < 2 ? 1 : gridSize + 1);
+			GLuint bottom0 = skirtStart + edge * (gridSize + 1) + k;
+			GLuint bottom1 = bottom0 + 1;
+			// Both windings, a skirt can be seen from either side of the crack
+			indices.push_back(top0); indices.push_back(bottom0); indices.push_back(top1);
+			indices.push_back(top1); indices.push_back(bottom0); indices.push_back(bottom1);
+			indices.push_back(top0); indices.push_back(top1); indices.push_back(bottom0);
+			indices.push_back(top1); indices.push_back(bottom1); indices.push_back(bottom0);
+		}
+	}
+	indexCount = (GLsizei)indices.size();
+	trianglesPerChunk = indexCount / 3;
+
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+	glGenBuffers(1, &indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glGenBuffers(1, &indirectBuffer);
+
+	printf("Terrain LOD: %d chunks, %d vertices, root error %.4f\n", (int)chunks.size(), (int)positions.size(), chunks[0].error);
+	return true;
+}
+
+void TerrainLOD::Select(int index, const glm::mat4& modelMatrix, const glm::vec3& camera, float pixelsPerUnit, float pixelError) {
+	const Chunk& chunk = chunks[index];
+
+	// Distance to the nearest point of the world space bounds
+	glm::vec3 a = glm::vec3(modelMatrix * glm::vec4(chunk.boundsMin, 1.0f));
+	glm::vec3 b = glm::vec3(modelMatrix * glm::vec4(chunk.boundsMax, 1.0f));
+	glm::vec3 nearest = glm::clamp(camera, glm::min(a, b), glm::max(a, b));
+	float distance = glm::length(camera - nearest);
+
+	float error = chunk.error * glm::length(glm::vec3(modelMatrix[1]));
+	if (chunk.children[0] < 0 || error * pixelsPerUnit <= pixelError * distance) {
+		DrawCommand command = { (GLuint)indexCount, 1, 0, chunk.baseVertex, 0 };
+		commands.push_back(command);
+		return;
+	}
+	for (int c = 0; c < 4; c++) {
+		Select(chunk.children[c], modelMatrix, camera, pixelsPerUnit, pixelError);
+	}
+}
+
+void TerrainLOD::Draw(const glm::mat4& modelMatrix, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix,
+	int viewportHeight, float pixelError) {
+	if (!IsBuilt()) {
+		return;
+	}
+
+	glm::vec3 camera = glm::vec3(glm::inverse(viewMatrix)[3]);
+	float pixelsPerUnit = projectionMatrix[1][1] * viewportHeight * 0.5f;
+	commands.clear();
+	Select(0, modelMatrix, camera, pixelsPerUnit, pixelError);
+	chunksDrawn = (int)commands.size();
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawCommand), &commands[0], GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)0, (GLsizei)commands.size(), 0);
+
+	glDisableVertexAttribArray(0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
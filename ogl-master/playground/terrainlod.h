@@ -0,0 +1,72 @@
+#pragma once
+
+// Tessellation-free terrain backend. The heightmap is read back once and turned
+// into a quadtree of vertex-displaced grid chunks; every level has the same grid
+// size, so each level up halves the resolution. Each frame the coarsest chunks
+// whose geometric error projects to less than a pixel threshold are selected and
+// drawn with a single glMultiDrawElementsIndirect. Skirts hang from the chunk
+// edges to hide the cracks between neighbours of different LOD.
+//
+// The terrain covers x, z in [-1, 1] with the height in y, the same model space
+// as terrain.obj after TexturedTES displaces it.
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+class TerrainLOD {
+public:
+	TerrainLOD();
+	~TerrainLOD();
+
+	// Reads the heightmap back and builds every level. Needs a current GL context.
+	bool Build(GLuint heightMap);
+	bool IsBuilt() const { return vertexBuffer != 0; };
+	void Release();
+
+	// Selects chunks for the camera and draws them with the currently bound
+	// program, which takes the model space position at attribute 0.
+	void Draw(const glm::mat4& modelMatrix, const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix,
+		int viewportHeight, float pixelError);
+
+	int ChunksDrawn() const { return chunksDrawn; };
+	int TrianglesDrawn() const { return chunksDrawn * trianglesPerChunk; };
+protected:
+	struct Chunk {
+		int level;
+		GLint baseVertex;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		float error;			// largest height difference to the finest level
+		int children[4];		// -1 for the finest level
+	};
+
+	struct DrawCommand {
+		GLuint count;
+		GLuint instanceCount;
+		GLuint firstIndex;
+		GLint baseVertex;
+		GLuint baseInstance;
+	};
+
+	int BuildChunk(int level, int x, int z, std::vector<glm::vec3>& positions);
+	float Height(int x, int z) const;
+	void Select(int chunk, const glm::mat4& modelMatrix, const glm::vec3& camera, float pixelsPerUnit, float pixelError);
+
+	static const int gridSize = 32;		// quads along a chunk edge
+	static const int levels = 5;		// the finest level has 16x16 chunks
+
+	int resolution;						// quads across the whole terrain at the finest level
+	std::vector<float> heights;			// (resolution + 1)^2 samples at the finest level
+	std::vector<Chunk> chunks;			// chunks[0] is the root
+	std::vector<DrawCommand> commands;
+
+	GLuint vertexBuffer;
+	GLuint indexBuffer;
+	GLuint indirectBuffer;
+	GLsizei indexCount;
+	int trianglesPerChunk;
+	int chunksDrawn;
+};
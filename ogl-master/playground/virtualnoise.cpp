@@ -0,0 +1,291 @@
+#include "virtualnoise.h"
+
+#include <stdio.h>
+#include <math.h>
+
+VirtualNoise::VirtualNoise() {
+	generator = NULL;
+	tiles = 1;
+	pageSize = 0;
+	pagesPerSide = 0;
+	cacheSlots = glm::ivec3(0);
+	pageTable = 0;
+	pageCache = 0;
+	fallback = 0;
+	fallbackBytes = 0;
+	frame = 0;
+	servicedFrame = 0;
+	requestedPages = 0;
+	requestBuffer = 0;
+	for (int i = 0; i < ringSize; i++) {
+		readback[i] = 0;
+		fences[i] = 0;
+		readbackFrame[i] = 0;
+	}
+	nextSlot = 0;
+}
+
+VirtualNoise::~VirtualNoise() {
+	Release();
+}
+
+void VirtualNoise::Release() {
+	if (!pageTable) {
+		return;
+	}
+	for (int i = 0; i < ringSize; i++) {
+		if (fences[i]) {
+			glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+	}
+	glDeleteBuffers(ringSize, readback);
+	glDeleteBuffers(1, &requestBuffer);
+	glDeleteTextures(1, &pageTable);
+	glDeleteTextures(1, &pageCache);
+	glDeleteTextures(1, &fallback);
+	for (int i = 0; i < ringSize; i++) {
+		readback[i] = 0;
+	}
+	requestBuffer = 0;
+	pageTable = 0;
+	pageCache = 0;
+	fallback = 0;
+	pageSlot.clear();
+	slotPage.clear();
+	slotUsed.clear();
+	requestedPages = 0;
+	nextSlot = 0;
+}
+
+bool VirtualNoise::Create(NoiseGenerator* noiseGenerator, const NoiseVolumeDesc& tileDesc, int tileCount, int pageVoxels, int slots) {
+	Release();
+
+	int size = tileDesc.size * tileCount;
+	if (!noiseGenerator || !noiseGenerator->IsLoaded() || pageVoxels <= 0 || size % pageVoxels != 0) {
+		printf("Virtual noise: %d voxels across do not split into pages of %d\n", size, pageVoxels);
+		return false;
+	}
+	generator = noiseGenerator;
+	tiles = tileCount;
+	pageSize = pageVoxels;
+	pagesPerSide = size / pageSize;
+	int pageCount = pagesPerSide * pagesPerSide * pagesPerSide;
+	// The table stores slot + 1 in 16 bits
+	if (slots <= 0 || slots > 65535) {
+		printf("Virtual noise: %d cache slots, 1 to 65535 expected\n", slots);
+		return false;
+	}
+
+	// Same noise with tiles times the cells, so it only repeats once across the whole volume
+	virtualDesc = tileDesc;
+	virtualDesc.size = size;
+	virtualDesc.format = GL_R8;
+	for (size_t i = 0; i < virtualDesc.octaves.size(); i++) {
+		virtualDesc.octaves[i].frequency *= tiles;
+	}
+
+	int cachePage = pageSize + 2;
+	GLint maxSize;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+	int side = (int)ceil(cbrt((double)slots));
+	cacheSlots = glm::ivec3(side, side, (slots + side * side - 1) / (side * side));
+	if (cacheSlots.x * cachePage > maxSize || cacheSlots.z * cachePage > maxSize) {
+		printf("Virtual noise: %d pages of %d^3 do not fit in one cache texture\n", slots, cachePage);
+		return false;
+	}
+
+	glGenTextures(1, &pageTable);
+	glBindTexture(GL_TEXTURE_3D, pageTable);
+	glTexStorage3D(GL_TEXTURE_3D, 1, GL_R16UI, pagesPerSide, pagesPerSide, pagesPerSide);
+	std::vector<unsigned short> empty(pageCount, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, pagesPerSide, pagesPerSide, pagesPerSide, GL_RED_INTEGER, GL_UNSIGNED_SHORT, empty.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+	glGenTextures(1, &pageCache);
+	glBindTexture(GL_TEXTURE_3D, pageCache);
+	glTexStorage3D(GL_TEXTURE_3D, 1, GL_R8, cacheSlots.x * cachePage, cacheSlots.y * cachePage, cacheSlots.z * cachePage);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	// The whole volume at the tiling noise's size: the same function, sampled tiles times coarser
+	NoiseVolumeDesc fallbackDesc = virtualDesc;
+	fallbackDesc.size = tileDesc.size;
+	fallback = generator->CreateVolume(fallbackDesc);
+	generator->Generate(fallback, fallbackDesc);
+	fallbackBytes = fallbackDesc.MemorySize();
+
+	glGenBuffers(1, &requestBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, requestBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (pageCount + 31) / 32 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	GLuint zero = 0;
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glGenBuffers(ringSize, readback);
+	for (int i = 0; i < ringSize; i++) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, readback[i]);
+		glBufferData(GL_COPY_WRITE_BUFFER, (pageCount + 31) / 32 * sizeof(GLuint), NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	pageSlot.assign(pageCount, -1);
+	slotPage.assign(slots, -1);
+	slotUsed.assign(slots, 0);
+	frame = 0;
+	servicedFrame = 0;
+	requestedPages = 0;
+	nextSlot = 0;
+	return true;
+}
+
+void VirtualNoise::BindRequests() const {
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, requestBinding, requestBuffer);
+}
+
+int VirtualNoise::CachedPages() const {
+	int cached = 0;
+	for (size_t i = 0; i < slotPage.size(); i++) {
+		cached += slotPage[i] >= 0;
+	}
+	return cached;
+}
+
+size_t VirtualNoise::MemorySize() const {
+	if (!pageTable) {
+		return 0;
+	}
+	size_t cachePage = pageSize + 2;
+	size_t cacheBytes = (size_t)cacheSlots.x * cacheSlots.y * cacheSlots.z * cachePage * cachePage * cachePage;
+	size_t tableBytes = pageSlot.size() * 2;
+	return cacheBytes + tableBytes + fallbackBytes;
+}
+
+void VirtualNoise::SetTableEntry(int page, unsigned short entry) {
+	int x = page % pagesPerSide;
+	int y = (page / pagesPerSide) % pagesPerSide;
+	int z = page / (pagesPerSide * pagesPerSide);
+	glBindTexture(GL_TEXTURE_3D, pageTable);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, x, y, z, 1, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_SHORT, &entry);
+}
+
+// A free slot, else the one whose page went longest without a request. Pages
+// requested in the frame being serviced are never evicted, -1 if that leaves none.
+int VirtualNoise::FindSlot() const {
+	int best = -1;
+	for (int i = 0; i < (int)slotPage.size(); i++) {
+		if (slotPage[i] < 0) {
+			return i;
+		}
+		if (slotUsed[i] < servicedFrame && (best < 0 || slotUsed[i] < slotUsed[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+// Takes the newest readback that has arrived, marks its cached pages as used
+// and lists the missing ones
+void VirtualNoise::CollectRequests(std::vector<int>& missing) {
+	int newest = -1;
+	for (int i = 0; i < ringSize; i++) {
+		int slot = (nextSlot + i) % ringSize;
+		if (!fences[slot]) {
+			continue;
+		}
+		GLenum status = glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			break;
+		}
+		glDeleteSync(fences[slot]);
+		fences[slot] = 0;
+		newest = slot;
+	}
+	if (newest < 0) {
+		return;
+	}
+
+	int words = ((int)pageSlot.size() + 31) / 32;
+	glBindBuffer(GL_COPY_READ_BUFFER, readback[newest]);
+	const GLuint* bits = (const GLuint*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, words * sizeof(GLuint), GL_MAP_READ_BIT);
+	if (!bits) {
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		return;
+	}
+	servicedFrame = readbackFrame[newest];
+	requestedPages = 0;
+	for (int w = 0; w < words; w++) {
+		for (GLuint word = bits[w]; word; word &= word - 1) {
+			int bit = 0;
+			while (!(word & (1u << bit))) {
+				bit++;
+			}
+			int page = w * 32 + bit;
+			requestedPages++;
+			if (pageSlot[page] >= 0) {
+				slotUsed[pageSlot[page]] = servicedFrame;
+			}
+			else {
+				missing.push_back(page);
+			}
+		}
+	}
+	glUnmapBuffer(GL_COPY_READ_BUFFER);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+int VirtualNoise::Update(int maxPages) {
+	if (!pageTable) {
+		return 0;
+	}
+
+	std::vector<int> missing;
+	CollectRequests(missing);
+	int generated = 0;
+	for (int i = 0; i < (int)missing.size() && i < maxPages; i++) {
+		int slot = FindSlot();
+		if (slot < 0) {
+			break;
+		}
+		int page = missing[i];
+		if (slotPage[slot] >= 0) {
+			pageSlot[slotPage[slot]] = -1;
+			SetTableEntry(slotPage[slot], 0);
+		}
+		slotPage[slot] = page;
+		slotUsed[slot] = servicedFrame;
+		pageSlot[page] = slot;
+
+		glm::ivec3 pagePos(page % pagesPerSide, (page / pagesPerSide) % pagesPerSide, page / (pagesPerSide * pagesPerSide));
+		glm::ivec3 slotPos(slot % cacheSlots.x, (slot / cacheSlots.x) % cacheSlots.y, slot / (cacheSlots.x * cacheSlots.y));
+		generator->GenerateRegion(pageCache, GL_R8, virtualDesc, 0.0f, pagePos * pageSize - 1,
+			glm::ivec3(pageSize + 2), slotPos * (pageSize + 2));
+		SetTableEntry(page, (unsigned short)(slot + 1));
+		generated++;
+	}
+
+	// Every slot still in flight, the GPU is well behind; keep collecting into the same requests
+	if (fences[nextSlot]) {
+		return generated;
+	}
+	int words = ((int)pageSlot.size() + 31) / 32;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_READ_BUFFER, requestBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, readback[nextSlot]);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, words * sizeof(GLuint));
+	GLuint zero = 0;
+	glClearBufferData(GL_COPY_READ_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	fences[nextSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readbackFrame[nextSlot] = ++frame;
+	nextSlot = (nextSlot + 1) % ringSize;
+	return generated;
+}
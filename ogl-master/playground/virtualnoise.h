@@ -0,0 +1,86 @@
+#pragma once
+
+// Base noise as one large non-repeating volume that is never stored whole. The
+// volume is split into pages. Only the pages the clouds sample are
+// generated, by WorleyCS.glsl, into a fixed cache texture. Each cached page
+// keeps a one voxel apron, so filtering needs no neighbour lookups. A page
+// table gives every page's cache slot.
+//
+// The VIRTUAL_NOISE variant of CloudRaymarch.glsl sets one bit per page it
+// samples in a request buffer. Each frame the buffer is copied to a readback
+// ring and cleared, and once a copy has arrived the missing pages are
+// generated, a few per frame, into free slots or in place of the least
+// recently requested ones. Until its page arrives a sample reads the fallback,
+// the whole volume at the size of the tiling noise.
+
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "noisegen.h"
+
+class VirtualNoise {
+public:
+	VirtualNoise();
+	~VirtualNoise();
+
+	// tileDesc is the tiling base noise. The virtual volume is tiles times its
+	// size with tiles times as many cells per octave, so the features keep
+	// their size and repeat tiles times less often.
+	bool Create(NoiseGenerator* generator, const NoiseVolumeDesc& tileDesc, int tiles, int pageSize, int cacheSlots);
+	bool IsCreated() const { return pageTable != 0; };
+	void Release();
+
+	// Binds the request buffer for the cloud pass
+	void BindRequests() const;
+	// Call after the cloud pass. Reads back the requests of an earlier frame
+	// and generates up to maxPages of the pages it misses. Returns the number
+	// of pages generated.
+	int Update(int maxPages);
+
+	// R16UI slot + 1 per page, 0 if it isn't cached
+	GLuint PageTable() const { return pageTable; };
+	GLuint PageCache() const { return pageCache; };
+	GLuint Fallback() const { return fallback; };
+	int Tiles() const { return tiles; };
+	int PageSize() const { return pageSize; };
+
+	int PageCount() const { return (int)pageSlot.size(); };
+	int CachedPages() const;
+	int RequestedPages() const { return requestedPages; };
+	size_t MemorySize() const;
+
+	static const int requestBinding = 3;
+protected:
+	void CollectRequests(std::vector<int>& missing);
+	int FindSlot() const;
+	void SetTableEntry(int page, unsigned short entry);
+
+	static const int ringSize = 3;
+
+	NoiseGenerator* generator;
+	NoiseVolumeDesc virtualDesc;
+	int tiles;
+	int pageSize;
+	int pagesPerSide;
+	glm::ivec3 cacheSlots;					// slots along each axis of the cache
+
+	GLuint pageTable;
+	GLuint pageCache;
+	GLuint fallback;
+	size_t fallbackBytes;
+
+	std::vector<int> pageSlot;				// per page, -1 if it isn't cached
+	std::vector<int> slotPage;				// per slot, -1 if it is free
+	std::vector<unsigned int> slotUsed;		// frame the slot's page was last requested
+	unsigned int frame;						// requests copied so far
+	unsigned int servicedFrame;				// frame of the requests last read back
+	int requestedPages;
+
+	// One bit per page, set by the cloud shaders and cleared every frame
+	GLuint requestBuffer;
+	GLuint readback[ringSize];
+	GLsync fences[ringSize];
+	unsigned int readbackFrame[ringSize];
+	int nextSlot;
+};